@@ -0,0 +1,1185 @@
+/**
+ * @file loadgen.c
+ * @brief HTTP/1.1 and h2c load generator for throughput and latency benchmarks
+ *
+ * Each thread drives its share of the connections from its own epoll
+ * instance. In closed-loop mode (the default) every connection keeps
+ * --pipeline requests in flight and sends the next one as soon as a
+ * response completes, which measures peak throughput. With --rate the
+ * run is open-loop: requests are scheduled at a fixed rate whether or
+ * not the server keeps up, and each latency is taken from the request's
+ * scheduled send time rather than the moment a connection was free to
+ * send it. A stalled server is therefore charged for every request it
+ * delayed, so the percentiles are corrected for coordinated omission.
+ *
+ * With --mode=h2c each connection speaks cleartext HTTP/2 with prior
+ * knowledge and --pipeline sets the number of concurrent streams. The
+ * first request on a connection adds its fields to the server's HPACK
+ * table and later ones refer to them by index, as browsers do.
+ *
+ * Latencies go into a log-linear histogram (~3% resolution). Results
+ * are printed as a table, or as one JSON object per run with --json.
+ *
+ * Build: gcc -O2 -pthread -o loadgen bench/loadgen.c
+ * Run:   ./loadgen --port=8080 --path=/index.html --connections=64 --duration=10 [--rate=20000] [--json]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define MAX_THREADS 64
+#define MAX_PIPELINE 64
+#define MAX_EVENTS 256
+#define RECV_CHUNK 65536
+#define HEADER_MAX 8192
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_KEEP 16
+#define H2_CONTROL_ROOM 512
+#define H2_WINDOW_MAX 2147483647u
+#define H2_WINDOW_REFILL (1u << 30)
+
+/**
+ * @enum ConnMode
+ * @brief Whether connections are reused between requests
+ */
+typedef enum {
+    MODE_KEEPALIVE,  /**< Persistent connections, optionally pipelined */
+    MODE_CLOSE,      /**< One request per connection, then reconnect */
+    MODE_H2C         /**< Cleartext HTTP/2, concurrent streams per connection */
+} ConnMode;
+
+/**
+ * @struct LoadConfig
+ * @brief Command line settings shared by every thread
+ */
+typedef struct {
+    const char* host;       /**< Server address (dotted quad) */
+    int port;               /**< Server port */
+    const char* path;       /**< Request target */
+    const char* name;       /**< Label echoed in the results */
+    int connections;        /**< Total connections across threads */
+    int threads;            /**< Worker threads */
+    int pipeline;           /**< Requests in flight per connection */
+    double duration;        /**< Measured seconds */
+    double warmup;          /**< Unmeasured seconds before the run */
+    double rate;            /**< Total requests/second, 0 for closed loop */
+    ConnMode mode;          /**< Keep-alive or close */
+    int json;               /**< Print one JSON object instead of a table */
+} LoadConfig;
+
+static LoadConfig config = {
+    "127.0.0.1", 8080, "/", NULL, 16, 2, 1, 5.0, 1.0, 0.0, MODE_KEEPALIVE, 0
+};
+
+static struct sockaddr_in server_addr;
+static char request_text[1024];
+static size_t request_len;
+static char h2_repeat_text[32];
+static size_t h2_repeat_len;
+static size_t out_capacity;
+
+/**
+ * @struct Histogram
+ * @brief Log-linear latency histogram in microseconds
+ *
+ * Values below HIST_SUB get a bucket each; above that every power of
+ * two is split into HIST_SUB linear sub-buckets.
+ */
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];  /**< Samples per bucket */
+    unsigned long total;                 /**< Samples recorded */
+    double sum;                          /**< Sum of samples, for the mean */
+    uint64_t max;                        /**< Largest sample */
+} Histogram;
+
+/**
+ * @struct Client
+ * @brief One connection and the requests it has in flight
+ */
+typedef struct {
+    int fd;                             /**< Socket, -1 while disconnected */
+    int connecting;                     /**< Non-blocking connect pending */
+    int responses;                      /**< Responses read on this socket */
+    int server_closing;                 /**< Last response said Connection: close */
+    char* out;                          /**< Request bytes not yet written */
+    size_t out_len;                     /**< Bytes queued in out */
+    size_t out_sent;                    /**< Bytes of out already written */
+    uint64_t starts[MAX_PIPELINE];      /**< Start time of each request in flight */
+    int start_head;                     /**< Oldest request in starts */
+    int inflight;                       /**< Requests sent or queued, not answered */
+    char header[HEADER_MAX];            /**< Partial response header, or h2c frame header and payload start */
+    size_t header_len;                  /**< Bytes in header */
+    int status;                         /**< Status of the response being read */
+    long long body_left;                /**< Body or h2c frame payload bytes still to skip */
+    uint32_t stream_ids[MAX_PIPELINE];  /**< h2c: stream in each starts slot, 0 if free */
+    int stream_status[MAX_PIPELINE];    /**< h2c: status of each stream's response */
+    uint32_t next_stream;               /**< h2c: next client stream id */
+    int indexed;                        /**< h2c: request fields are in the server's table */
+    unsigned long unacked;              /**< h2c: DATA bytes not yet given back in WINDOW_UPDATE */
+} Client;
+
+/**
+ * @struct LoadThread
+ * @brief Per-thread connections, schedule and results
+ */
+typedef struct {
+    pthread_t thread;               /**< Thread handle */
+    int epfd;                       /**< Epoll instance for this thread's sockets */
+    Client* clients;                /**< This thread's connections */
+    int client_count;               /**< Number of clients */
+    double interval_ns;             /**< Open loop: gap between scheduled requests */
+    uint64_t schedule_start;        /**< Open loop: time of request 0 */
+    unsigned long scheduled_sent;   /**< Open loop: scheduled requests handed out */
+    uint64_t measure_start;         /**< Completions before this are not recorded */
+    uint64_t end;                   /**< Stop time */
+    Histogram hist;                 /**< Recorded latencies */
+    unsigned long requests;         /**< Completed, recorded requests */
+    unsigned long status[6];        /**< Recorded responses by status class */
+    unsigned long errors;           /**< Connect, read and write failures */
+    unsigned long reconnects;       /**< Server-initiated closes survived */
+    unsigned long incomplete;       /**< Requests unanswered at the end */
+    unsigned long long bytes;       /**< Response bytes received while measuring */
+} LoadThread;
+
+static LoadThread threads[MAX_THREADS];
+
+/**
+ * @brief Current monotonic time
+ * @return uint64_t Nanoseconds
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Histogram bucket for a value
+ * @param value Latency in microseconds
+ * @return int Bucket index
+ */
+int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    int bucket = ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief Largest value that falls in a bucket
+ * @param bucket Bucket index
+ * @return uint64_t Upper bound in microseconds
+ */
+uint64_t hist_bucket_upper(int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(HIST_SUB + (bucket & (HIST_SUB - 1))) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+/**
+ * @brief Record one latency
+ * @param hist Histogram to update
+ * @param value Latency in microseconds
+ */
+void hist_record(Histogram* hist, uint64_t value) {
+    hist->counts[hist_bucket(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value > hist->max) hist->max = value;
+}
+
+/**
+ * @brief Add one histogram into another
+ * @param into Accumulated histogram
+ * @param from Histogram to add
+ */
+void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+/**
+ * @brief Value at a quantile
+ * @param hist Histogram to read
+ * @param quantile Fraction between 0 and 1
+ * @return uint64_t Upper bound of the bucket holding that rank, capped at the max
+ */
+uint64_t hist_quantile(const Histogram* hist, double quantile) {
+    if (hist->total == 0) return 0;
+    unsigned long rank = (unsigned long)(quantile * hist->total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * @brief Write an HTTP/2 frame header
+ * @param p Output position
+ * @param len Payload length
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param id Stream identifier
+ * @return unsigned char* Position after the header
+ */
+unsigned char* h2_frame_header(unsigned char* p, size_t len, int type, int flags, uint32_t id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = id >> 24;
+    p[6] = id >> 16;
+    p[7] = id >> 8;
+    p[8] = id;
+    return p + H2_FRAME_HEADER;
+}
+
+/**
+ * @brief Write a 32-bit big-endian value
+ * @param p Output position
+ * @param value Value to write
+ * @return unsigned char* Position after the value
+ */
+unsigned char* h2_put32(unsigned char* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+    return p + 4;
+}
+
+/**
+ * @brief Write an HPACK string literal without Huffman coding
+ * @param p Output position
+ * @param str String
+ * @param len Length of str
+ * @return unsigned char* Position after the literal
+ */
+unsigned char* hpack_string(unsigned char* p, const char* str, size_t len) {
+    if (len < 127) {
+        *p++ = len;
+    } else {
+        *p++ = 127;
+        size_t rest = len - 127;
+        while (rest >= 128) {
+            *p++ = 0x80 | (rest & 0x7f);
+            rest >>= 7;
+        }
+        *p++ = rest;
+    }
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/**
+ * @brief Build the h2c request HEADERS frames, stream id left at 0
+ *
+ * The first request on a connection sends :path, :authority and
+ * user-agent as literals with incremental indexing; the server's table
+ * then holds them at indexes 64, 63 and 62, which is all a repeat
+ * request needs next to the static GET and http entries.
+ *
+ * @param authority Value of :authority
+ * @return int 0 on success, -1 if the request does not fit
+ */
+int h2_build_requests(const char* authority) {
+    size_t path_len = strlen(config.path);
+    size_t authority_len = strlen(authority);
+    if (H2_FRAME_HEADER + path_len + authority_len + 32 > sizeof(request_text)) return -1;
+
+    unsigned char* start = (unsigned char*)request_text;
+    unsigned char* p = start + H2_FRAME_HEADER;
+    *p++ = 0x82;  // :method GET
+    *p++ = 0x86;  // :scheme http
+    *p++ = 0x44;  // :path, indexed name
+    p = hpack_string(p, config.path, path_len);
+    *p++ = 0x41;  // :authority, indexed name
+    p = hpack_string(p, authority, authority_len);
+    *p++ = 0x7a;  // user-agent, indexed name
+    p = hpack_string(p, "loadgen", 7);
+    request_len = p - start;
+    h2_frame_header(start, request_len - H2_FRAME_HEADER, 0x1, 0x5, 0);
+
+    static const unsigned char repeat[] = { 0x82, 0x86, 0xc0, 0xbf, 0xbe };
+    start = (unsigned char*)h2_repeat_text;
+    p = h2_frame_header(start, sizeof(repeat), 0x1, 0x5, 0);
+    memcpy(p, repeat, sizeof(repeat));
+    h2_repeat_len = H2_FRAME_HEADER + sizeof(repeat);
+    return 0;
+}
+
+/**
+ * @brief Append a frame to a client's send queue
+ * @param c Client
+ * @param frame Frame bytes
+ * @param len Length of frame
+ * @return int 0 on success, -1 if the queue is full
+ */
+int h2_queue(Client* c, const unsigned char* frame, size_t len) {
+    if (c->out_len + len > out_capacity) return -1;
+    memcpy(c->out + c->out_len, frame, len);
+    c->out_len += len;
+    return 0;
+}
+
+/**
+ * @brief Queue the connection preface on a fresh h2c connection
+ *
+ * Both windows are opened to the maximum, so the server is only ever
+ * held back by WINDOW_UPDATE when a run has received a gigabyte since
+ * the last one.
+ *
+ * @param c Client that just connected
+ */
+void h2_start(Client* c) {
+    unsigned char frame[128];
+    unsigned char* p = frame;
+    memcpy(p, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+    p += 24;
+    p = h2_frame_header(p, 12, 0x4, 0, 0);
+    *p++ = 0;
+    *p++ = 0x2;  // ENABLE_PUSH
+    p = h2_put32(p, 0);
+    *p++ = 0;
+    *p++ = 0x4;  // INITIAL_WINDOW_SIZE
+    p = h2_put32(p, H2_WINDOW_MAX);
+    p = h2_frame_header(p, 4, 0x8, 0, 0);
+    p = h2_put32(p, H2_WINDOW_MAX - 65535);
+    c->next_stream = 1;
+    c->indexed = 0;
+    c->unacked = 0;
+    h2_queue(c, frame, p - frame);
+}
+
+/**
+ * @brief Queue a request on a new stream
+ * @param c Client
+ * @param slot starts slot the stream's start time is in
+ */
+void h2_queue_request(Client* c, int slot) {
+    const char* text = c->indexed ? h2_repeat_text : request_text;
+    size_t len = c->indexed ? h2_repeat_len : request_len;
+    unsigned char* frame = (unsigned char*)c->out + c->out_len;
+    memcpy(frame, text, len);
+    h2_put32(frame + 5, c->next_stream);
+    c->out_len += len;
+    c->stream_ids[slot] = c->next_stream;
+    c->next_stream += 2;
+    c->indexed = 1;
+}
+
+/**
+ * @brief Open a non-blocking connection for a client
+ * @param t Owning thread
+ * @param c Client to connect
+ * @return int 0 on success, -1 on error
+ */
+int client_connect(LoadThread* t, Client* c) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->connecting = 1;
+    c->responses = 0;
+    c->server_closing = 0;
+    c->header_len = 0;
+    c->body_left = 0;
+    if (config.mode == MODE_H2C) h2_start(c);
+    return 0;
+}
+
+/**
+ * @brief Close a client's socket, keeping its queued requests
+ * @param c Client to close
+ */
+void client_close(Client* c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->connecting = 0;
+    c->server_closing = 0;
+}
+
+/**
+ * @brief Forget a client's unanswered requests and unsent bytes
+ * @param c Client whose requests failed
+ */
+void client_drop(Client* c) {
+    c->inflight = 0;
+    c->out_len = c->out_sent = 0;
+    memset(c->stream_ids, 0, sizeof(c->stream_ids));
+}
+
+/**
+ * @brief Write as much of the queued request bytes as the socket takes
+ * @param c Client to flush
+ * @return int 0 when drained or blocked, -1 on error
+ */
+int client_flush(Client* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+/**
+ * @brief Re-send a client's unanswered requests on a fresh connection
+ *
+ * Used when the server closes a keep-alive connection (e.g. at its
+ * --max-requests limit) with requests still in flight. Their original
+ * start times are kept; h2c streams are renumbered on the new connection.
+ *
+ * @param t Owning thread
+ * @param c Client whose socket was closed
+ */
+void client_reconnect(LoadThread* t, Client* c) {
+    client_close(c);
+    c->out_len = c->out_sent = 0;
+    int pending = c->inflight;
+    if (pending == 0) return;
+    if (client_connect(t, c) < 0) {
+        t->errors++;
+        return;
+    }
+    if (config.mode == MODE_H2C) {
+        for (int i = 0; i < MAX_PIPELINE; i++) {
+            if (c->stream_ids[i]) h2_queue_request(c, i);
+        }
+        return;
+    }
+    for (int i = 0; i < pending; i++) {
+        memcpy(c->out + c->out_len, request_text, request_len);
+        c->out_len += request_len;
+    }
+}
+
+/**
+ * @brief Handle a connection that failed or was closed by the server
+ *
+ * A connection that already carried responses was closed by the server
+ * between requests, so its unanswered requests are resent. One that
+ * never got a response counts as an error and its requests are dropped.
+ *
+ * @param t Owning thread
+ * @param c Client whose connection was lost
+ */
+void client_lost(LoadThread* t, Client* c) {
+    if (c->inflight > 0 && c->responses == 0) {
+        t->errors++;
+        client_drop(c);
+    } else if (c->inflight > 0) {
+        t->reconnects++;
+    }
+    client_reconnect(t, c);
+}
+
+/**
+ * @brief Queue a request on a client and start sending it
+ * @param t Owning thread
+ * @param c Client with a free pipeline slot
+ * @param start Time the request's latency is measured from
+ * @return int 0 on success, -1 if the connection failed
+ */
+int client_send(LoadThread* t, Client* c, uint64_t start) {
+    if (c->fd < 0 && client_connect(t, c) < 0) {
+        t->errors++;
+        return -1;
+    }
+    if (config.mode == MODE_H2C) {
+        int slot = 0;
+        while (c->stream_ids[slot]) slot++;
+        c->starts[slot] = start;
+        h2_queue_request(c, slot);
+    } else {
+        c->starts[(c->start_head + c->inflight) % MAX_PIPELINE] = start;
+        memcpy(c->out + c->out_len, request_text, request_len);
+        c->out_len += request_len;
+    }
+    c->inflight++;
+    if (!c->connecting && client_flush(c) < 0) {
+        client_lost(t, c);
+        return c->fd < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Whether a client can take another request now
+ * @param c Client to check
+ * @return int 1 if a pipeline slot is free
+ */
+int client_ready(const Client* c) {
+    if (c->server_closing) return 0;
+    if (config.mode == MODE_CLOSE) return c->inflight == 0;
+    return c->inflight < config.pipeline;
+}
+
+/**
+ * @brief Scheduled send time of an open-loop request
+ * @param t Thread whose schedule to read
+ * @param index Request number on that schedule
+ * @return uint64_t Time in nanoseconds
+ */
+uint64_t scheduled_time(const LoadThread* t, unsigned long index) {
+    return t->schedule_start + (uint64_t)(index * t->interval_ns);
+}
+
+/**
+ * @brief Hand every due scheduled request to a free client
+ *
+ * Requests that come due while every client is busy wait here, and
+ * keep their scheduled time as their start, so the wait is counted.
+ *
+ * @param t Thread whose schedule to run
+ * @param now Current time
+ */
+void schedule_requests(LoadThread* t, uint64_t now) {
+    for (int i = 0; i < t->client_count; i++) {
+        Client* c = &t->clients[i];
+        while (client_ready(c)) {
+            uint64_t start = scheduled_time(t, t->scheduled_sent);
+            if (start > now || client_send(t, c, start) < 0) break;
+            t->scheduled_sent++;
+        }
+        if (scheduled_time(t, t->scheduled_sent) > now) break;
+    }
+}
+
+/**
+ * @brief Account for one complete response
+ * @param t Owning thread
+ * @param c Client the response arrived on
+ * @param start Time the request's latency is measured from
+ * @param status HTTP status code
+ * @param now Current time
+ */
+void response_done(LoadThread* t, Client* c, uint64_t start, int status, uint64_t now) {
+    c->inflight--;
+    c->responses++;
+
+    if (now >= t->measure_start) {
+        hist_record(&t->hist, (now - start) / 1000);
+        t->requests++;
+        t->status[status >= 100 && status < 600 ? status / 100 : 0]++;
+    }
+}
+
+/**
+ * @brief Take the start time of the oldest pipelined request
+ * @param c Client whose response completed
+ * @return uint64_t Start time of the request it answered
+ */
+uint64_t pipeline_pop(Client* c) {
+    uint64_t start = c->starts[c->start_head];
+    c->start_head = (c->start_head + 1) % MAX_PIPELINE;
+    return start;
+}
+
+/**
+ * @brief Parse a response header block
+ * @param header Header bytes including the blank line
+ * @param len Length of header
+ * @param content_length Receives Content-Length, 0 if absent
+ * @param closing Receives 1 if the server will close the connection
+ * @return int Status code, or -1 if the status line is malformed
+ */
+int parse_response_header(const char* header, size_t len, long long* content_length, int* closing) {
+    if (len < 12 || memcmp(header, "HTTP/1.", 7) != 0) return -1;
+    int status = atoi(header + 9);
+    *content_length = 0;
+    *closing = memcmp(header, "HTTP/1.0", 8) == 0;
+
+    const char* line = memchr(header, '\n', len);
+    while (line && (size_t)(line + 1 - header) < len) {
+        line++;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            *content_length = atoll(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* v = line + 11;
+            while (*v == ' ') v++;
+            *closing = strncasecmp(v, "close", 5) == 0;
+        }
+        line = memchr(line, '\n', len - (line - header));
+    }
+    return status;
+}
+
+/**
+ * @brief Consume received bytes, completing responses as they end
+ * @param t Owning thread
+ * @param c Client the bytes arrived on
+ * @param data Received bytes
+ * @param len Length of data
+ * @param now Current time
+ * @return int 0 on success, -1 on a protocol error
+ */
+int client_on_data(LoadThread* t, Client* c, const char* data, size_t len, uint64_t now) {
+    while (len > 0) {
+        if (c->body_left > 0) {
+            size_t n = (size_t)c->body_left < len ? (size_t)c->body_left : len;
+            c->body_left -= n;
+            data += n;
+            len -= n;
+            if (c->body_left == 0) response_done(t, c, pipeline_pop(c), c->status, now);
+            continue;
+        }
+
+        if (c->inflight == 0) return -1;
+
+        // Accumulate the header; the terminator may straddle reads
+        size_t old = c->header_len;
+        size_t n = sizeof(c->header) - old < len ? sizeof(c->header) - old : len;
+        memcpy(c->header + old, data, n);
+        size_t scan = old > 3 ? old - 3 : 0;
+        size_t end = 0;
+        for (size_t i = scan; i + 4 <= old + n; i++) {
+            if (memcmp(c->header + i, "\r\n\r\n", 4) == 0) {
+                end = i + 4;
+                break;
+            }
+        }
+        if (!end) {
+            if (old + n == sizeof(c->header)) return -1;
+            c->header_len = old + n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        long long content_length;
+        int closing;
+        int status = parse_response_header(c->header, end, &content_length, &closing);
+        if (status < 0) return -1;
+        if (closing) c->server_closing = 1;
+        data += end - old;
+        len -= end - old;
+        c->header_len = 0;
+        if (content_length > 0) {
+            c->status = status;
+            c->body_left = content_length;
+        } else {
+            response_done(t, c, pipeline_pop(c), status, now);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Status code at the start of a response header block
+ *
+ * Only the leading :status field is decoded: the static table covers
+ * the common codes and anything else arrives as a literal.
+ *
+ * @param p Start of the header block
+ * @param len Bytes available
+ * @return int Status code, or 0 if it cannot be read
+ */
+int h2_status(const unsigned char* p, size_t len) {
+    static const int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    if (len >= 1 && p[0] >= 0x88 && p[0] <= 0x8e) return indexed[p[0] - 0x88];
+    if (len >= 5 && (p[0] == 0x08 || p[0] == 0x18 || p[0] == 0x48) && p[1] == 3) {
+        return (p[2] - '0') * 100 + (p[3] - '0') * 10 + (p[4] - '0');
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the starts slot of an open stream
+ * @param c Client
+ * @param id Stream identifier
+ * @return int Slot, or -1 if the stream is not open
+ */
+int h2_stream_slot(const Client* c, uint32_t id) {
+    for (int i = 0; i < MAX_PIPELINE; i++) {
+        if (id != 0 && c->stream_ids[i] == id) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Act on a complete h2c frame
+ *
+ * Only the first H2_FRAME_KEEP payload bytes are kept, which is enough
+ * for the status, PING data and error codes. SETTINGS and PING are
+ * acknowledged, and the connection window is refilled as DATA arrives.
+ *
+ * @param t Owning thread
+ * @param c Client the frame arrived on
+ * @param now Current time
+ * @return int 0 on success, -1 on a protocol error
+ */
+int h2_on_frame(LoadThread* t, Client* c, uint64_t now) {
+    const unsigned char* h = (const unsigned char*)c->header;
+    size_t len = ((size_t)h[0] << 16) | (h[1] << 8) | h[2];
+    int type = h[3];
+    int flags = h[4];
+    uint32_t id = ((uint32_t)(h[5] & 0x7f) << 24) | (h[6] << 16) | (h[7] << 8) | h[8];
+    const unsigned char* payload = h + H2_FRAME_HEADER;
+    size_t kept = c->header_len - H2_FRAME_HEADER;
+    int slot = h2_stream_slot(c, id);
+    unsigned char frame[H2_FRAME_HEADER + 8];
+    c->header_len = 0;
+
+    switch (type) {
+    case 0x0:  // DATA
+        c->unacked += len;
+        if (c->unacked >= H2_WINDOW_REFILL) {
+            h2_put32(h2_frame_header(frame, 4, 0x8, 0, 0), c->unacked);
+            if (h2_queue(c, frame, H2_FRAME_HEADER + 4) < 0) return -1;
+            c->unacked = 0;
+        }
+        break;
+    case 0x1:  // HEADERS
+        if (slot >= 0) c->stream_status[slot] = h2_status(payload, kept);
+        break;
+    case 0x3:  // RST_STREAM
+        if (slot >= 0) {
+            t->errors++;
+            c->stream_ids[slot] = 0;
+            c->inflight--;
+        }
+        return 0;
+    case 0x4:  // SETTINGS
+        if (!(flags & 0x1)) {
+            h2_frame_header(frame, 0, 0x4, 0x1, 0);
+            if (h2_queue(c, frame, H2_FRAME_HEADER) < 0) return -1;
+        }
+        return 0;
+    case 0x6:  // PING
+        if (!(flags & 0x1) && kept >= 8) {
+            memcpy(h2_frame_header(frame, 8, 0x6, 0x1, 0), payload, 8);
+            if (h2_queue(c, frame, H2_FRAME_HEADER + 8) < 0) return -1;
+        }
+        return 0;
+    case 0x7:  // GOAWAY: streams it did not take are resent after the close
+        c->server_closing = 1;
+        return 0;
+    default:
+        return 0;
+    }
+
+    if ((flags & 0x1) && slot >= 0) {
+        c->stream_ids[slot] = 0;
+        response_done(t, c, c->starts[slot], c->stream_status[slot], now);
+    }
+    return 0;
+}
+
+/**
+ * @brief Consume received h2c bytes frame by frame
+ * @param t Owning thread
+ * @param c Client the bytes arrived on
+ * @param data Received bytes
+ * @param len Length of data
+ * @param now Current time
+ * @return int 0 on success, -1 on a protocol error
+ */
+int h2_on_data(LoadThread* t, Client* c, const char* data, size_t len, uint64_t now) {
+    while (len > 0) {
+        if (c->header_len < H2_FRAME_HEADER) {
+            size_t n = H2_FRAME_HEADER - c->header_len < len ? H2_FRAME_HEADER - c->header_len : len;
+            memcpy(c->header + c->header_len, data, n);
+            c->header_len += n;
+            data += n;
+            len -= n;
+            if (c->header_len < H2_FRAME_HEADER) break;
+            const unsigned char* h = (const unsigned char*)c->header;
+            c->body_left = ((long long)h[0] << 16) | (h[1] << 8) | h[2];
+        } else {
+            size_t n = (size_t)c->body_left < len ? (size_t)c->body_left : len;
+            size_t keep = H2_FRAME_HEADER + H2_FRAME_KEEP - c->header_len;
+            if (keep > n) keep = n;
+            memcpy(c->header + c->header_len, data, keep);
+            c->header_len += keep;
+            c->body_left -= n;
+            data += n;
+            len -= n;
+        }
+        if (c->body_left == 0 && h2_on_frame(t, c, now) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle readiness on a client socket
+ * @param t Owning thread
+ * @param c Client that is ready
+ * @param events Epoll event mask
+ * @param buf Scratch receive buffer
+ */
+void client_event(LoadThread* t, Client* c, uint32_t events, char* buf) {
+    if (c->fd < 0) return;
+
+    if (c->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            t->errors++;
+            client_drop(c);
+            client_close(c);
+            return;
+        }
+        c->connecting = 0;
+    }
+    if ((events & EPOLLOUT) && !c->connecting && client_flush(c) < 0) {
+        client_lost(t, c);
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, RECV_CHUNK, 0);
+        if (n > 0) {
+            uint64_t now = now_ns();
+            if (now >= t->measure_start) t->bytes += n;
+            int rc = config.mode == MODE_H2C ? h2_on_data(t, c, buf, n, now)
+                                             : client_on_data(t, c, buf, n, now);
+            if (rc < 0) {
+                t->errors++;
+                client_drop(c);
+                client_close(c);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        // EOF or reset: expected after Connection: close, otherwise the
+        // server dropped requests we will resend
+        client_lost(t, c);
+        return;
+    }
+
+    // Acknowledgements and window updates queued while reading
+    if (c->out_len > c->out_sent && !c->connecting && client_flush(c) < 0) {
+        client_lost(t, c);
+        return;
+    }
+
+    // The server announced a close and has answered everything: reconnect
+    // now rather than waiting for its FIN
+    if (c->server_closing && c->inflight == 0) {
+        client_close(c);
+        c->out_len = c->out_sent = 0;
+    }
+}
+
+/**
+ * @brief Thread entry point: drive this thread's clients until the end time
+ * @param arg LoadThread to run
+ * @return void* NULL
+ */
+void* load_thread(void* arg) {
+    LoadThread* t = arg;
+    struct epoll_event events[MAX_EVENTS];
+    char* buf = malloc(RECV_CHUNK);
+    if (!buf) {
+        perror("malloc");
+        exit(1);
+    }
+    int open_loop = t->interval_ns > 0;
+
+    if (!open_loop) {
+        for (int i = 0; i < t->client_count; i++) {
+            while (client_ready(&t->clients[i]) && client_send(t, &t->clients[i], now_ns()) == 0) {
+            }
+        }
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= t->end) break;
+
+        if (open_loop) {
+            schedule_requests(t, now);
+        } else {
+            // Top up anything that closed or finished since the last pass
+            for (int i = 0; i < t->client_count; i++) {
+                while (client_ready(&t->clients[i]) && client_send(t, &t->clients[i], now) == 0) {
+                }
+            }
+        }
+
+        // Sleep until the next scheduled request, or until the end when
+        // requests are already waiting for a client to free up. A
+        // millisecond timeout would send requests up to 1ms late, so
+        // the open loop waits with nanosecond resolution.
+        uint64_t wake = t->end;
+        if (open_loop) {
+            uint64_t next = scheduled_time(t, t->scheduled_sent);
+            if (next > now && next < wake) wake = next;
+        }
+        struct timespec timeout = { (wake - now) / 1000000000, (wake - now) % 1000000000 };
+        int n = epoll_pwait2(t->epfd, events, MAX_EVENTS, &timeout, NULL);
+        if (n < 0 && errno == ENOSYS) {
+            n = epoll_wait(t->epfd, events, MAX_EVENTS, (int)((wake - now) / 1000000));
+        }
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) client_event(t, events[i].data.ptr, events[i].events, buf);
+    }
+
+    // Whatever is still outstanding took at least until now; in an
+    // open-loop run leaving it out would flatter the tail
+    uint64_t end = now_ns();
+    for (int i = 0; i < t->client_count; i++) {
+        Client* c = &t->clients[i];
+        for (int k = 0; k < MAX_PIPELINE; k++) {
+            // Pipelined requests fill a ring from start_head, h2c streams any free slot
+            int slot = config.mode == MODE_H2C ? k : (c->start_head + k) % MAX_PIPELINE;
+            int open = config.mode == MODE_H2C ? c->stream_ids[k] != 0 : k < c->inflight;
+            if (!open) continue;
+            t->incomplete++;
+            if (open_loop) hist_record(&t->hist, (end - c->starts[slot]) / 1000);
+        }
+        client_close(c);
+    }
+    if (open_loop) {
+        for (; scheduled_time(t, t->scheduled_sent) < t->end; t->scheduled_sent++) {
+            t->incomplete++;
+            hist_record(&t->hist, (end - scheduled_time(t, t->scheduled_sent)) / 1000);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Print merged results as a table or a JSON object
+ * @param hist Merged histogram
+ * @param total Thread totals summed into one LoadThread
+ */
+void print_results(const Histogram* hist, const LoadThread* total) {
+    static const double quantiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999 };
+    static const char* const quantile_names[] = { "p50", "p75", "p90", "p99", "p999", "p9999" };
+    static const char* const mode_names[] = { "keepalive", "close", "h2c" };
+    static const char* const mode_labels[] = { "keep-alive", "close", "h2c" };
+    int count = sizeof(quantiles) / sizeof(quantiles[0]);
+    double rps = total->requests / config.duration;
+    double mean = hist->total ? hist->sum / hist->total : 0;
+
+    if (config.json) {
+        printf("{\"name\":\"%s\",\"path\":\"%s\",\"mode\":\"%s\",\"loop\":\"%s\","
+               "\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"duration_s\":%.3f,"
+               "\"target_rps\":%.0f,\"requests\":%lu,\"throughput_rps\":%.1f,"
+               "\"bytes_per_s\":%.0f,\"errors\":%lu,\"reconnects\":%lu,\"incomplete\":%lu,"
+               "\"status\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu,\"other\":%lu},"
+               "\"latency_us\":{\"corrected\":%s,\"mean\":%.1f",
+               config.name ? config.name : config.path, config.path,
+               mode_names[config.mode], config.rate > 0 ? "open" : "closed",
+               config.connections, config.threads, config.pipeline, config.duration,
+               config.rate, total->requests, rps, total->bytes / config.duration,
+               total->errors, total->reconnects, total->incomplete,
+               total->status[1], total->status[2], total->status[3], total->status[4],
+               total->status[5], total->status[0], config.rate > 0 ? "true" : "false", mean);
+        for (int i = 0; i < count; i++) {
+            printf(",\"%s\":%llu", quantile_names[i], (unsigned long long)hist_quantile(hist, quantiles[i]));
+        }
+        printf(",\"max\":%llu}}\n", (unsigned long long)hist->max);
+        return;
+    }
+
+    printf("%s %s, %d connections, %d threads, pipeline %d, %s loop",
+           config.path, mode_labels[config.mode],
+           config.connections, config.threads, config.pipeline, config.rate > 0 ? "open" : "closed");
+    if (config.rate > 0) printf(" at %.0f req/s", config.rate);
+    printf("\n  %lu requests in %.1fs: %.1f req/s, %.2f MB/s\n",
+           total->requests, config.duration, rps, total->bytes / config.duration / 1e6);
+    printf("  status 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu; errors %lu, reconnects %lu, incomplete %lu\n",
+           total->status[2], total->status[3], total->status[4], total->status[5],
+           total->status[0] + total->status[1], total->errors, total->reconnects, total->incomplete);
+    printf("  latency%s (us): mean %.1f", config.rate > 0 ? " from schedule" : "", mean);
+    for (int i = 0; i < count; i++) {
+        printf(" %s %llu", quantile_names[i], (unsigned long long)hist_quantile(hist, quantiles[i]));
+    }
+    printf(" max %llu\n", (unsigned long long)hist->max);
+}
+
+/**
+ * @brief Print usage and exit
+ * @param prog Program name
+ */
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host=ADDR          server IPv4 address (127.0.0.1)\n"
+            "  --port=N             server port (8080)\n"
+            "  --path=TARGET        request target (/)\n"
+            "  --connections=N      total connections (16)\n"
+            "  --threads=N          client threads (2)\n"
+            "  --pipeline=N         requests in flight per keep-alive connection, or\n"
+            "                       concurrent streams per h2c connection (1)\n"
+            "  --mode=keepalive|close|h2c\n"
+            "  --rate=N             open loop at N requests/second; 0 = closed loop (0)\n"
+            "  --duration=SEC       measured seconds (5)\n"
+            "  --warmup=SEC         unmeasured seconds first (1)\n"
+            "  --name=LABEL         label for the results\n"
+            "  --json               one JSON object per run\n",
+            prog);
+    exit(2);
+}
+
+/**
+ * @brief Load generator entry point
+ * @param argc Argument count
+ * @param argv Options, see usage()
+ * @return int 0 if every request succeeded, 1 otherwise
+ */
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--host=", 7) == 0) config.host = arg + 7;
+        else if (strncmp(arg, "--port=", 7) == 0) config.port = atoi(arg + 7);
+        else if (strncmp(arg, "--path=", 7) == 0) config.path = arg + 7;
+        else if (strncmp(arg, "--name=", 7) == 0) config.name = arg + 7;
+        else if (strncmp(arg, "--connections=", 14) == 0) config.connections = atoi(arg + 14);
+        else if (strncmp(arg, "--threads=", 10) == 0) config.threads = atoi(arg + 10);
+        else if (strncmp(arg, "--pipeline=", 11) == 0) config.pipeline = atoi(arg + 11);
+        else if (strncmp(arg, "--rate=", 7) == 0) config.rate = atof(arg + 7);
+        else if (strncmp(arg, "--duration=", 11) == 0) config.duration = atof(arg + 11);
+        else if (strncmp(arg, "--warmup=", 9) == 0) config.warmup = atof(arg + 9);
+        else if (strcmp(arg, "--mode=keepalive") == 0) config.mode = MODE_KEEPALIVE;
+        else if (strcmp(arg, "--mode=close") == 0) config.mode = MODE_CLOSE;
+        else if (strcmp(arg, "--mode=h2c") == 0) config.mode = MODE_H2C;
+        else if (strcmp(arg, "--json") == 0) config.json = 1;
+        else usage(argv[0]);
+    }
+    if (config.threads < 1 || config.threads > MAX_THREADS || config.connections < 1 ||
+        config.pipeline < 1 || config.pipeline > MAX_PIPELINE || config.duration <= 0 ||
+        config.warmup < 0 || config.rate < 0) {
+        usage(argv[0]);
+    }
+    if (config.mode == MODE_CLOSE) config.pipeline = 1;
+    if (config.threads > config.connections) config.threads = config.connections;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid host address: %s\n", config.host);
+        return 2;
+    }
+    if (config.mode == MODE_H2C) {
+        char authority[64];
+        snprintf(authority, sizeof(authority), "%s:%d", config.host, config.port);
+        if (h2_build_requests(authority) < 0) {
+            fprintf(stderr, "Request target too long\n");
+            return 2;
+        }
+    } else {
+        request_len = snprintf(request_text, sizeof(request_text),
+                               "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: loadgen\r\n%s\r\n",
+                               config.path, config.host, config.port,
+                               config.mode == MODE_CLOSE ? "Connection: close\r\n" : "");
+        if (request_len >= sizeof(request_text)) {
+            fprintf(stderr, "Request target too long\n");
+            return 2;
+        }
+    }
+    out_capacity = request_len * MAX_PIPELINE + (config.mode == MODE_H2C ? H2_CONTROL_ROOM : 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    uint64_t start = now_ns();
+    uint64_t measure_start = start + (uint64_t)(config.warmup * 1e9);
+    uint64_t end = measure_start + (uint64_t)(config.duration * 1e9);
+    for (int i = 0; i < config.threads; i++) {
+        LoadThread* t = &threads[i];
+        t->client_count = config.connections / config.threads + (i < config.connections % config.threads);
+        t->clients = calloc(t->client_count, sizeof(Client));
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (!t->clients || t->epfd < 0) {
+            perror("setup");
+            return 1;
+        }
+        for (int c = 0; c < t->client_count; c++) {
+            t->clients[c].fd = -1;
+            t->clients[c].out = malloc(out_capacity);
+            if (!t->clients[c].out) {
+                perror("malloc");
+                return 1;
+            }
+        }
+        // Each thread gets an equal share of the rate, offset so the
+        // threads' schedules interleave instead of firing together
+        if (config.rate > 0) {
+            t->interval_ns = 1e9 * config.threads / config.rate;
+            t->schedule_start = start + (uint64_t)(t->interval_ns * i / config.threads);
+        }
+        t->measure_start = measure_start;
+        t->end = end;
+        if (pthread_create(&t->thread, NULL, load_thread, t) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    Histogram* hist = calloc(1, sizeof(Histogram));
+    LoadThread* total = calloc(1, sizeof(LoadThread));
+    if (!hist || !total) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < config.threads; i++) {
+        LoadThread* t = &threads[i];
+        pthread_join(t->thread, NULL);
+        hist_merge(hist, &t->hist);
+        total->requests += t->requests;
+        for (int s = 0; s < 6; s++) total->status[s] += t->status[s];
+        total->errors += t->errors;
+        total->reconnects += t->reconnects;
+        total->incomplete += t->incomplete;
+        total->bytes += t->bytes;
+    }
+    print_results(hist, total);
+    return total->errors ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file mime_bench.c
+ * @brief Microbenchmark for MIME type lookup
+ *
+ * Compares the perfect-hash table against the strcmp chain it replaced,
+ * with the built-in types and optionally with a mime.types file merged
+ * in, after checking that every known extension resolves in any case.
+ *
+ * Build: gcc -O2 -pthread -o mime_bench bench/mime_bench.c
+ * Run:   ./mime_bench [iterations] [/etc/mime.types]
+ */
+
+#define SERVER_NO_MAIN
+#include "../server.c"
+
+/**
+ * @brief The original lookup: one strcmp per known extension
+ * @param filename File name to check
+ * @return const char* MIME type string
+ */
+const char* mime_type_chain(const char* filename) {
+    const char *ext = strrchr(filename, '.');
+    if (!ext) return "text/plain";
+
+    if (strcmp(ext, ".html") == 0) return "text/html";
+    if (strcmp(ext, ".css") == 0) return "text/css";
+    if (strcmp(ext, ".js") == 0) return "application/javascript";
+    if (strcmp(ext, ".json") == 0) return "application/json";
+    if (strcmp(ext, ".png") == 0) return "image/png";
+    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
+
+    return "text/plain";
+}
+
+/** Paths in roughly the mix a static site sees */
+static const char* const bench_paths[] = {
+    "./index.html", "./css/site.min.css", "./js/app.bundle.js", "./api/data.json",
+    "./img/logo.png", "./img/hero.jpeg", "./img/photo.JPG", "./fonts/inter.woff2",
+    "./favicon.ico", "./img/icon.svg", "./video/intro.webm", "./docs/manual.pdf",
+    "./LICENSE", "./download/archive.tar.gz", "./wasm/module.wasm", "./feed.xml",
+};
+
+#define BENCH_PATH_COUNT (sizeof(bench_paths) / sizeof(bench_paths[0]))
+
+/**
+ * @brief Current time in nanoseconds
+ * @return double Monotonic nanoseconds
+ */
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Check that every built-in extension resolves, in either case
+ * @return int Number of wrong lookups
+ */
+int check_table(void) {
+    int errors = 0;
+    for (size_t i = 0; i < sizeof(builtin_mime_types) / sizeof(builtin_mime_types[0]); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "./dir.d/file.%s", builtin_mime_types[i].ext);
+        const char* type = get_mime_type(name);
+        // A mime.types file may remap an extension; it must still resolve
+        if (!config.mime_types && strcmp(type, builtin_mime_types[i].type) != 0) errors++;
+        for (char* p = strrchr(name, '.'); *p; p++) {
+            if (*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+        }
+        if (strcmp(get_mime_type(name), type) != 0) errors++;
+    }
+    errors += strcmp(get_mime_type("./README"), "text/plain") != 0;
+    errors += strcmp(get_mime_type("./dir.d/README"), "text/plain") != 0;
+    errors += strcmp(get_mime_type("./file.nosuchext"), "application/octet-stream") != 0;
+    return errors;
+}
+
+/**
+ * @brief Time a lookup function over the benchmark paths
+ * @param lookup Function under test
+ * @param iterations Passes over the path list
+ * @return double Nanoseconds per lookup
+ */
+double time_lookup(const char* (*lookup)(const char*), long iterations) {
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        for (size_t p = 0; p < BENCH_PATH_COUNT; p++) {
+            const char* type = lookup(bench_paths[p]);
+            __asm__ volatile("" : : "r"(type) : "memory");
+        }
+    }
+    return (now_ns() - start) / (iterations * BENCH_PATH_COUNT);
+}
+
+/**
+ * @brief Benchmark entry point
+ * @param argc Argument count
+ * @param argv Optional iteration count and mime.types path
+ * @return int 0 on success, 1 if a lookup returned the wrong type
+ */
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    const char* files[2] = { NULL, argc > 2 ? argv[2] : NULL };
+    int failed = 0;
+
+    printf("%-28s %8s %12s\n", "lookup", "slots", "ns/lookup");
+    printf("%-28s %8s %12.1f\n", "strcmp chain", "-", time_lookup(mime_type_chain, iterations));
+
+    for (int f = 0; f < 2; f++) {
+        if (f == 1 && !files[1]) break;
+        config.mime_types = files[f];
+        if (mime_init(files[f]) < 0) {
+            perror(files[f]);
+            return 1;
+        }
+        int errors = check_table();
+        if (errors) {
+            printf("%d wrong lookups with %s\n", errors, files[f] ? files[f] : "built-in types");
+            failed = 1;
+        }
+        printf("%-28s %8u %12.1f\n", files[f] ? files[f] : "perfect hash (built-in)",
+               mime_table.slot_mask + 1, time_lookup(get_mime_type, iterations));
+    }
+    return failed;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Pool engine check: a request for a file with a precompressed sibling
+# hands both opens to the pool exactly once and never repeats a lookup
+# when it resumes, so the cache counts two misses and no hits.
+#
+# Usage: bench/offload_check.sh
+# Environment: PORT (18081)
+
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-18081}
+SERVER=$(pwd)/server
+
+if [ ! -x "$SERVER" ]; then
+    echo "$SERVER not built; run make check" >&2
+    exit 1
+fi
+
+ROOT=$(mktemp -d)
+head -c 4096 /dev/zero | tr '\0' 'x' > "$ROOT/a.css"
+gzip -c "$ROOT/a.css" > "$ROOT/a.css.gz"
+
+(cd "$ROOT" && exec "$SERVER" --port="$PORT" --engine=pool --workers=1 --access-log=off) >/dev/null &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$ROOT"' EXIT INT TERM
+sleep 1
+
+encoding=$(curl -s -o /dev/null -H 'Accept-Encoding: gzip' -w '%header{content-encoding}' \
+           "http://127.0.0.1:$PORT/a.css")
+metrics=$(curl -s "http://127.0.0.1:$PORT/metrics")
+misses=$(echo "$metrics" | sed -n 's/^minihttp_file_cache_misses_total{[^}]*} //p')
+hits=$(echo "$metrics" | sed -n 's/^minihttp_file_cache_hits_total{[^}]*} //p')
+
+if [ "$encoding" != gzip ] || [ "$misses" != 2 ] || [ "$hits" != 0 ]; then
+    echo "FAIL: encoding=$encoding misses=$misses hits=$hits, want gzip, 2 and 0" >&2
+    exit 1
+fi
+echo "ok: misses=$misses hits=$hits" >&2
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Benchmark scenarios: start the server on loopback against a generated
+# document root and run the load generator over each scenario.
+#
+# Every scenario runs twice: closed loop to find peak throughput, then
+# open loop at half that rate for coordinated-omission-corrected latency.
+# Results are appended to the output file as one JSON object per run.
+#
+# Usage: bench/scenarios.sh [results.jsonl]
+# Environment: PORT (18080), DURATION (5), WARMUP (1), CONNECTIONS (64),
+#              THREADS (2), SERVER_ARGS (extra server options, e.g. --engine=uring)
+
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-18080}
+DURATION=${DURATION:-5}
+WARMUP=${WARMUP:-1}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-2}
+OUT=${1:-bench/results.jsonl}
+SERVER=$(pwd)/server
+LOADGEN=$(pwd)/bench/loadgen
+
+for bin in "$SERVER" "$LOADGEN"; do
+    if [ ! -x "$bin" ]; then
+        echo "$bin not built; run make bench" >&2
+        exit 1
+    fi
+done
+
+ROOT=$(mktemp -d)
+head -c 1024 /dev/zero | tr '\0' 'x' > "$ROOT/small.html"
+head -c 10485760 /dev/urandom > "$ROOT/large.bin"
+
+# Per-connection request limits would turn keep-alive runs into reconnect runs
+(cd "$ROOT" && exec "$SERVER" --port="$PORT" --access-log=off --max-requests=1000000000 $SERVER_ARGS) >/dev/null &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$ROOT"' EXIT INT TERM
+sleep 1
+: > "$OUT"
+
+# scenario NAME LOADGEN-OPTIONS...
+scenario() {
+    name=$1
+    shift
+    result=$("$LOADGEN" --port="$PORT" --duration="$DURATION" --warmup="$WARMUP" \
+             --connections="$CONNECTIONS" --threads="$THREADS" --name="$name" --json "$@")
+    echo "$result" >> "$OUT"
+    rps=$(echo "$result" | sed -n 's/.*"throughput_rps":\([0-9.]*\).*/\1/p')
+    rate=$(awk "BEGIN { printf \"%d\", $rps / 2 }")
+    if [ "$rate" -gt 0 ]; then
+        "$LOADGEN" --port="$PORT" --duration="$DURATION" --warmup="$WARMUP" \
+            --connections="$CONNECTIONS" --threads="$THREADS" --name="$name" --json \
+            --rate="$rate" "$@" >> "$OUT"
+    fi
+    printf '%-12s %12s req/s\n' "$name" "$rps" >&2
+}
+
+scenario small      --path=/small.html
+scenario small-close --path=/small.html --mode=close
+scenario large      --path=/large.bin --connections=8
+scenario not-found  --path=/missing.html
+scenario pipelined  --path=/small.html --pipeline=16
+scenario h2c        --path=/small.html --mode=h2c
+scenario h2c-streams --path=/small.html --mode=h2c --pipeline=16
+scenario h2c-large  --path=/large.bin --mode=h2c --connections=8
+
+echo "results in $OUT" >&2
@@ -1,276 +1,8535 @@
 /**
  * @file server.c
  * @brief Mini Concurrent HTTP/1.1 Web Server
- * 
+ *
  * A lightweight web server supporting:
- * - Concurrent client handling (fork-based)
- * - HTTP/1.1 GET requests
- * - MIME type detection
+ * - Concurrent client handling (epoll event loop or fork-based)
+ * - Multi-core sharded workers with SO_REUSEPORT listeners
+ * - Optional io_uring engine with batched submissions
+ * - Thread pool engine handing blocking file opens to work-stealing threads
+ * - HTTP/1.1 GET, HEAD and OPTIONS requests with keep-alive and pipelining
+ * - Cleartext HTTP/2 (h2c) with prior knowledge: multiplexed streams, HPACK
+ *   and flow control, answered by the same handlers as HTTP/1.1
+ * - Date header cached per worker and responses assembled without snprintf
+ * - Header, body, idle and write-stall timeouts on a per-worker timer wheel
+ * - Asynchronous access log in common, combined or JSON format
+ * - Prometheus metrics endpoint with per-worker counters and latency histograms
+ * - Pooled connection objects and per-request arenas, no malloc per request
+ * - Connection buffers lent from per-worker pools on huge pages only while in use
+ * - MIME type detection through a perfect hash, extendable from mime.types
  * - Basic error handling (404, 500)
- * - File serving with buffer optimization
- * 
+ * - Zero-copy file serving with sendfile() or splice()
+ * - Per-worker LRU cache of open files invalidated through inotify
+ * - Conditional GET with ETag/Last-Modified and 304 Not Modified
+ * - Byte-range requests, including multipart/byteranges
+ * - Precompressed .br/.zst/.gz siblings chosen by Accept-Encoding
+ * - Optional on-the-fly gzip/zstd of text types on background threads
+ * - Incremental request parser with SSE4.2/AVX2 delimiter scanning
+ *
  * @license MIT
  * @author Kutlwano Mokheseng
  * @version 1.0.0
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// On-the-fly compression is opt-in at build time since it needs linking:
+// -DHAVE_ZLIB -lz for gzip, -DHAVE_ZSTD -lzstd for zstd
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+// Multishot recv (Linux 6.0) is the newest io_uring feature the engine uses
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
 
 #define PORT 8080
 #define BUFFER_SIZE 8192
 #define BACKLOG 10
+#define MAX_EVENTS 1024
+#define MAX_WORKERS 256
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+#define URING_HELD_MAX 4
+#define URING_HELD_H2 20
+#define DEFAULT_MAX_REQUESTS 100
+#define DEFAULT_IDLE_TIMEOUT 15
+#define PIPELINE_RESERVE 2048
+#define PIPE_CHUNK 65536
+#define MAX_HEADERS 64
+#define DEFAULT_MAX_URI 2048
+#define DEFAULT_FILE_CACHE 256
+#define DEFAULT_MEM_CACHE (8 * 1024 * 1024)
+#define DEFAULT_MEM_CACHE_MAX_FILE 65536
+#define MAX_RANGES 16
+#define DEFAULT_COMPRESS_MIN_SIZE 1024
+#define COMPRESS_MAX_SOURCE (16 * 1024 * 1024)
+#define COMPRESS_QUEUE_MAX 1024
+#define MIME_EXT_MAX 32
+#define TASK_DEQUE_SIZE 1024
+#define DEFAULT_POOL_THREADS 4
+#define POOL_OPENS_MAX 2
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_BODY_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define MAX_BODY_DISCARD 65536
+#define ACCESS_LOG_RING 4096
+#define ACCESS_LOG_BATCH 65536
+#define ACCESS_LOG_LINE_MAX 4096
+#define STATUS_CODE_MAX 600
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS 256
+#define CONN_SLAB 64
+#define CONN_ARENA_SIZE 1024
+#define ARENA_BLOCK_SIZE 16384
+#define BUFFER_CLASSES_MAX 8
+#define BUFFER_CHUNK_SIZE (2 * 1024 * 1024)
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_MAX 16384
+#define H2_CONTROL_MAX 1024
+#define H2_MAX_STREAMS 128
+#define H2_WINDOW_DEFAULT 65535
+#define H2_WINDOW_MAX 2147483647L
+#define H2_WINDOW_UPDATE_AT 32768
+#define H2_TABLE_SIZE 4096
+#define H2_HEADER_BLOCK_MAX 16384
+#define H2_REQUEST_MAX 16384
+#define H2_RESPONSE_MAX 2048
+#define H2_PENDING_MAX 768
+
+/**
+ * @enum EngineType
+ * @brief Connection handling strategy selected with --engine
+ */
+typedef enum {
+    ENGINE_EPOLL,   /**< Single-process edge-triggered epoll reactor */
+    ENGINE_FORK,    /**< One forked child per connection */
+    ENGINE_URING,   /**< io_uring completion loop, falls back to epoll */
+    ENGINE_POOL     /**< epoll loops with blocking work on a thread pool */
+} EngineType;
+
+/**
+ * @enum ZeroCopyMode
+ * @brief How file bodies are moved to the socket, selected with --zerocopy
+ */
+typedef enum {
+    ZC_SENDFILE,    /**< sendfile() straight from the page cache */
+    ZC_SPLICE,      /**< splice() file -> pipe -> socket */
+    ZC_COPY         /**< read()/write() through the output buffer */
+} ZeroCopyMode;
+
+/**
+ * @enum LogFormat
+ * @brief Access log line layout, selected with --log-format
+ */
+typedef enum {
+    LOG_COMMON,     /**< Common Log Format plus latency */
+    LOG_COMBINED,   /**< Common plus Referer and User-Agent, plus latency */
+    LOG_JSON        /**< One JSON object per line */
+} LogFormat;
+
+/**
+ * @struct ServerConfig
+ * @brief Startup options parsed from the command line
+ */
+typedef struct {
+    EngineType engine;      /**< Connection handling engine */
+    int port;               /**< TCP port to listen on */
+    int workers;            /**< Event loop workers, 0 = one per online CPU */
+    int cpus[MAX_WORKERS];  /**< CPU affinity list, workers assigned round-robin */
+    int cpu_count;          /**< Entries in @c cpus, 0 = no pinning */
+    int max_requests;       /**< Requests served per connection before closing */
+    int idle_timeout;       /**< Seconds a connection may sit idle */
+    int header_timeout;     /**< Seconds allowed for a whole request header */
+    int body_timeout;       /**< Seconds allowed between request body reads */
+    int write_timeout;      /**< Seconds a response may make no progress */
+    ZeroCopyMode zerocopy;  /**< File body transmission method */
+    int max_header_size;    /**< Largest accepted request header in bytes */
+    int max_headers;        /**< Most header fields accepted per request */
+    int max_uri;            /**< Longest accepted request target */
+    int file_cache_entries; /**< Open files cached per worker, 0 = no cache */
+    int file_cache_revalidate; /**< Seconds between stat() checks, 0 = use inotify */
+    long mem_cache_size;    /**< File body bytes held in memory per worker, 0 = none */
+    long mem_cache_max_file; /**< Largest file kept in memory */
+    unsigned compress;      /**< Bit per encoding compressed on the fly, 0 = off */
+    long compress_min_size; /**< Smallest file worth compressing */
+    int compress_threads;   /**< Background compression threads */
+    const char* mime_types; /**< mime.types file merged over the built-in types, or NULL */
+    int pool_threads;       /**< Thread pool size for the pool engine */
+    const char* access_log; /**< Access log path, "-" for stdout, NULL for none */
+    LogFormat log_format;   /**< Access log line layout */
+    const char* metrics_path; /**< Request path serving the metrics, NULL for none */
+    int buffer_sizes[BUFFER_CLASSES_MAX]; /**< Connection buffer size classes, ascending */
+    int buffer_classes;     /**< Entries in @c buffer_sizes */
+    int http2;              /**< Accept cleartext HTTP/2 from clients sending its preface */
+} ServerConfig;
+
+static ServerConfig config = {
+    ENGINE_EPOLL, PORT, 0, { 0 }, 0, DEFAULT_MAX_REQUESTS, DEFAULT_IDLE_TIMEOUT,
+    DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT, DEFAULT_WRITE_TIMEOUT,
+    ZC_SENDFILE, BUFFER_SIZE - 1, MAX_HEADERS, DEFAULT_MAX_URI, DEFAULT_FILE_CACHE, 0,
+    DEFAULT_MEM_CACHE, DEFAULT_MEM_CACHE_MAX_FILE, 0, DEFAULT_COMPRESS_MIN_SIZE, 1, NULL,
+    DEFAULT_POOL_THREADS, "-", LOG_COMMON, "/metrics", { 2048, BUFFER_SIZE }, 2, 1
+};
+
+/** multipart/byteranges boundary, made unique per process at startup */
+static char range_boundary[24] = "5ad1e1a3c0b7f2d9";
+
+/** Status line and reason phrase of a status code, built at compile time */
+#define STATUS_LINE(code, text) \
+    [code] = { "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1, text }
+
+/** Every status the server sends, indexed by code */
+static const struct {
+    const char* line;   /**< Status line including CRLF, NULL for codes never sent */
+    size_t len;         /**< Length of @c line */
+    const char* text;   /**< Reason phrase */
+} status_lines[STATUS_CODE_MAX] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(414, "URI Too Long"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(505, "HTTP Version Not Supported"),
+};
+
+/** Methods the server implements, sent with OPTIONS and 501 responses */
+static const char allow_header[] = "Allow: GET, HEAD, OPTIONS\r\n";
+
+/** Two-digit decimal strings "00" to "99", for formatting two digits per division */
+static const char decimal_pairs[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+typedef struct Connection Connection;
+typedef struct H2Session H2Session;
+
+/**
+ * @struct MimeEntry
+ * @brief File extension and the Content-Type it maps to
+ */
+typedef struct {
+    const char* ext;    /**< Lowercase extension without the dot */
+    const char* type;   /**< Content-Type */
+} MimeEntry;
+
+/**
+ * @struct MimeSlot
+ * @brief Slot of the MIME perfect hash
+ */
+typedef struct {
+    const char* ext;    /**< Lowercase extension, NULL for an empty slot */
+    const char* type;   /**< Content-Type */
+    unsigned hash;      /**< mime_hash() of @c ext, checked before comparing */
+    unsigned len;       /**< Length of @c ext */
+} MimeSlot;
+
+/**
+ * @struct MimeTable
+ * @brief Perfect hash of extensions built at startup
+ *
+ * An extension's hash picks a bucket, and the bucket's seed remixes the
+ * same hash into a slot. Seeds are searched for when the table is built
+ * so that no two extensions share a slot, making every lookup one pass
+ * over the extension and a single comparison.
+ */
+typedef struct {
+    MimeSlot* slots;        /**< @c slot_mask + 1 entries */
+    unsigned slot_mask;     /**< Slot count minus one */
+    unsigned* seeds;        /**< Second-level hash seed per bucket */
+    unsigned bucket_mask;   /**< Entries in @c seeds minus one */
+} MimeTable;
+
+static MimeTable mime_table;
+
+/** Types known without a mime.types file */
+static const MimeEntry builtin_mime_types[] = {
+    { "html", "text/html" }, { "htm", "text/html" }, { "shtml", "text/html" },
+    { "css", "text/css" }, { "js", "application/javascript" },
+    { "mjs", "application/javascript" }, { "json", "application/json" },
+    { "map", "application/json" }, { "jsonld", "application/ld+json" },
+    { "webmanifest", "application/manifest+json" }, { "xml", "application/xml" },
+    { "xhtml", "application/xhtml+xml" }, { "rss", "application/rss+xml" },
+    { "atom", "application/atom+xml" }, { "txt", "text/plain" }, { "text", "text/plain" },
+    { "log", "text/plain" }, { "md", "text/markdown" }, { "markdown", "text/markdown" },
+    { "csv", "text/csv" }, { "tsv", "text/tab-separated-values" }, { "ics", "text/calendar" },
+    { "vtt", "text/vtt" }, { "yaml", "application/yaml" }, { "yml", "application/yaml" },
+    { "toml", "application/toml" }, { "c", "text/x-c" }, { "h", "text/x-c" },
+    { "cpp", "text/x-c++" }, { "py", "text/x-python" }, { "sh", "application/x-sh" },
+    { "png", "image/png" }, { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" },
+    { "jpe", "image/jpeg" }, { "gif", "image/gif" }, { "webp", "image/webp" },
+    { "avif", "image/avif" }, { "svg", "image/svg+xml" }, { "svgz", "image/svg+xml" },
+    { "ico", "image/vnd.microsoft.icon" }, { "bmp", "image/bmp" }, { "tif", "image/tiff" },
+    { "tiff", "image/tiff" }, { "apng", "image/apng" }, { "jxl", "image/jxl" },
+    { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" },
+    { "otf", "font/otf" }, { "eot", "application/vnd.ms-fontobject" },
+    { "mp3", "audio/mpeg" }, { "ogg", "audio/ogg" }, { "oga", "audio/ogg" },
+    { "opus", "audio/opus" }, { "wav", "audio/wav" }, { "flac", "audio/flac" },
+    { "aac", "audio/aac" }, { "m4a", "audio/mp4" }, { "weba", "audio/webm" },
+    { "mp4", "video/mp4" }, { "m4v", "video/mp4" }, { "webm", "video/webm" },
+    { "ogv", "video/ogg" }, { "mov", "video/quicktime" }, { "avi", "video/x-msvideo" },
+    { "mkv", "video/x-matroska" }, { "mpeg", "video/mpeg" }, { "mpg", "video/mpeg" },
+    { "ts", "video/mp2t" }, { "m3u8", "application/vnd.apple.mpegurl" },
+    { "mpd", "application/dash+xml" }, { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" }, { "zip", "application/zip" }, { "gz", "application/gzip" },
+    { "tgz", "application/gzip" }, { "bz2", "application/x-bzip2" }, { "xz", "application/x-xz" },
+    { "zst", "application/zstd" }, { "br", "application/x-brotli" }, { "tar", "application/x-tar" },
+    { "7z", "application/x-7z-compressed" }, { "rar", "application/vnd.rar" },
+    { "jar", "application/java-archive" }, { "apk", "application/vnd.android.package-archive" },
+    { "deb", "application/vnd.debian.binary-package" }, { "rpm", "application/x-rpm" },
+    { "iso", "application/x-iso9660-image" }, { "dmg", "application/x-apple-diskimage" },
+    { "exe", "application/vnd.microsoft.portable-executable" }, { "bin", "application/octet-stream" },
+    { "doc", "application/msword" }, { "xls", "application/vnd.ms-excel" },
+    { "ppt", "application/vnd.ms-powerpoint" },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    { "odt", "application/vnd.oasis.opendocument.text" }, { "rtf", "application/rtf" },
+    { "epub", "application/epub+zip" }, { "swf", "application/x-shockwave-flash" },
+    { "pem", "application/x-pem-file" }, { "crt", "application/x-x509-ca-cert" },
+    { "glb", "model/gltf-binary" }, { "gltf", "model/gltf+json" },
+};
+
+/**
+ * @enum ContentEncoding
+ * @brief Representation of a file that can be served, in order of preference
+ */
+typedef enum {
+    ENC_IDENTITY,   /**< The file itself */
+    ENC_BR,         /**< Precompressed .br sibling */
+    ENC_ZSTD,       /**< .zst sibling or compressed on the fly */
+    ENC_GZIP,       /**< .gz sibling or compressed on the fly */
+    ENC_COUNT
+} ContentEncoding;
+
+/** Accept-Encoding token and sibling file suffix of each encoding */
+static const struct {
+    const char* token;
+    const char* suffix;
+} encodings[ENC_COUNT] = {
+    { "identity", "" },
+    { "br", ".br" },
+    { "zstd", ".zst" },
+    { "gzip", ".gz" },
+};
+
+/** Bit per encoding this build can compress on the fly */
+static const unsigned compress_supported = 0
+#ifdef HAVE_ZLIB
+    | 1u << ENC_GZIP
+#endif
+#ifdef HAVE_ZSTD
+    | 1u << ENC_ZSTD
+#endif
+    ;
+
+/**
+ * @struct WatchLink
+ * @brief Position of a cached entry in a chain of the watch descriptor table
+ */
+typedef struct WatchLink {
+    struct FileEntry* next;     /**< Next entry in the bucket */
+    struct FileEntry** pprev;   /**< Link pointing at this entry, NULL if not linked */
+} WatchLink;
+
+/**
+ * @struct FileEntry
+ * @brief Open file with its metadata and precomputed response header
+ *
+ * Small files are read into @c body, which follows @c path in the same
+ * allocation, and their descriptor is closed; larger ones keep @c fd open
+ * for zero-copy sends. Entries are shared by every response that sends
+ * the file: @c refs counts the connections still sending it, so an entry
+ * evicted or invalidated while in use lingers until the last of them
+ * finishes.
+ */
+typedef struct FileEntry {
+    int fd;                     /**< Open file descriptor, -1 if @c body holds the file */
+    char* body;                 /**< File contents, NULL if sent from @c fd */
+    off_t size;                 /**< File size in bytes */
+    struct timespec mtime;      /**< Modification time when opened */
+    dev_t dev;                  /**< Device, to detect replacement */
+    ino_t ino;                  /**< Inode, to detect replacement */
+    const char* mime_type;      /**< Content-Type */
+    ContentEncoding encoding;   /**< Representation; the file opened is @c path plus its
+                                     suffix unless @c generated */
+    unsigned variants;          /**< Bit per encoding with a precompressed sibling */
+    unsigned compressing;       /**< Bit per encoding whose on-the-fly compression was
+                                     requested */
+    int generated;              /**< @c body was compressed by the server from @c path;
+                                     @c mtime, @c dev and @c ino are the source's */
+    off_t source_size;          /**< Size of the file a generated body came from */
+    char etag[64];              /**< Entity tag including quotes and any W/ prefix */
+    size_t etag_len;            /**< Bytes used in @c etag */
+    char last_modified[32];     /**< mtime as an HTTP-date */
+    char header[384];           /**< Status line, Content-Type, Content-Length and validators */
+    size_t header_len;          /**< Bytes used in @c header */
+    size_t validators_off;      /**< Start of the Content-Encoding, Vary, ETag and
+                                     Last-Modified lines in @c header */
+    int refs;                   /**< Cache and connection references */
+    int cached;                 /**< Still reachable through the cache */
+    int wd;                     /**< inotify watch descriptor, -1 if none */
+    int dir_wd;                 /**< inotify watch on the directory, for siblings coming
+                                     and going, -1 if none */
+    time_t validated;           /**< Monotonic seconds of the last check */
+    unsigned hash;              /**< Hash of @c path */
+    struct FileEntry* hash_next;    /**< Bucket chain */
+    struct FileEntry* lru_prev;     /**< More recently used neighbour */
+    struct FileEntry* lru_next;     /**< Less recently used neighbour */
+    WatchLink watch_links[2];   /**< Chains of the cache's @c watches tables, by @c wd
+                                     and by @c dir_wd */
+    char path[];                /**< Resolved path, with @c encoding the cache key */
+} FileEntry;
+
+/**
+ * @struct FileCache
+ * @brief Per-worker LRU cache of open files keyed by resolved path
+ *
+ * A hit costs no filesystem syscalls. Changes are picked up from inotify,
+ * or by re-checking stat() once an entry is older than the revalidation
+ * interval when inotify is unavailable or --file-cache-revalidate is set.
+ */
+typedef struct {
+    FileEntry** buckets;        /**< Hash table, @c bucket_mask + 1 chains */
+    unsigned bucket_mask;       /**< Bucket count minus one */
+    FileEntry** watches[2];     /**< Entries by @c wd and by @c dir_wd, @c bucket_mask + 1
+                                     chains each, so an inotify event finds its entries
+                                     without walking the LRU list */
+    FileEntry* lru_head;        /**< Most recently used entry */
+    FileEntry* lru_tail;        /**< Least recently used entry, evicted first */
+    int count;                  /**< Cached entries */
+    long mem_bytes;             /**< File bytes held in memory by cached entries */
+    int inotify_fd;             /**< Change notifications, -1 if unavailable */
+    unsigned long hits;         /**< Lookups served from the cache */
+    unsigned long misses;       /**< Lookups that had to open the file */
+} FileCache;
+
+/**
+ * @enum TimeoutKind
+ * @brief Which connection deadline a timer enforces
+ */
+typedef enum {
+    TIMEOUT_HEADER,     /**< Whole request header, counted from its first byte */
+    TIMEOUT_BODY,       /**< Gap between reads of a request body being discarded */
+    TIMEOUT_IDLE,       /**< Keep-alive wait for the next request */
+    TIMEOUT_WRITE,      /**< Gap between writes the client accepts */
+    TIMEOUT_COUNT
+} TimeoutKind;
+
+/** Labels for the timeout counters */
+static const char* const timeout_names[TIMEOUT_COUNT] = { "header", "body", "idle", "write" };
+
+/**
+ * @struct Timer
+ * @brief Deadline linked into a timer wheel slot
+ *
+ * Embedded in the object it times out; @c pprev makes cancelling O(1)
+ * without knowing which slot the timer sits in.
+ */
+typedef struct Timer {
+    struct Timer* next;         /**< Slot list link */
+    struct Timer** pprev;       /**< Link pointing at this timer, NULL when not armed */
+    unsigned long expires;      /**< Tick the timer fires on */
+    unsigned char level;        /**< Wheel level holding the timer */
+    unsigned char slot;         /**< Slot within the level */
+    unsigned char kind;         /**< TimeoutKind being enforced */
+} Timer;
+
+/**
+ * @struct TimerWheel
+ * @brief Hierarchical timing wheel with one-second ticks
+ *
+ * Level @c n slots are 64^n ticks wide. A timer is filed in the lowest
+ * level whose span covers its distance from @c now and moves down a level
+ * each time the level below wraps, so arming and cancelling are O(1) and
+ * a tick only touches the timers due in it.
+ */
+typedef struct {
+    Timer* slots[TIMER_LEVELS][TIMER_SLOTS];    /**< Timer lists per level and slot */
+    uint64_t occupied[TIMER_LEVELS];            /**< Bit per non-empty slot */
+    unsigned long now;                          /**< Last tick processed */
+    int count;                                  /**< Armed timers */
+} TimerWheel;
+
+/**
+ * @struct ArenaBlock
+ * @brief Overflow block of a request arena
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;    /**< Next block of the arena or of the worker's free list */
+    size_t size;                /**< Usable bytes in @c data */
+    char data[];                /**< Allocation space */
+} ArenaBlock;
+
+/**
+ * @struct Arena
+ * @brief Bump allocator for memory that lives as long as one request
+ *
+ * Allocations are carved from the connection's inline space and then from
+ * overflow blocks. arena_reset() rewinds it between requests and hands
+ * the blocks back to the worker instead of freeing them.
+ */
+typedef struct {
+    char* ptr;                  /**< Next free byte */
+    char* end;                  /**< End of the block being carved */
+    char* base;                 /**< Inline space */
+    size_t base_size;           /**< Bytes of inline space */
+    ArenaBlock* blocks;         /**< Overflow blocks in use, newest first */
+} Arena;
+
+/**
+ * @struct ConnPool
+ * @brief Per-worker slab pool of connections, arena blocks and HTTP/2 sessions
+ *
+ * Connections are carved CONN_SLAB at a time and recycled through a free
+ * list, and arena overflow blocks and HTTP/2 sessions through others, so
+ * once the pool has grown to the peak load a worker serves without calling
+ * malloc or free.
+ */
+typedef struct {
+    Connection* free;           /**< Unused connections, linked by @c pool_next */
+    unsigned long capacity;     /**< Connections carved from slabs */
+    unsigned long in_use;       /**< Connections handed out */
+    unsigned long high_water;   /**< Most connections in use at once */
+    ArenaBlock* blocks;         /**< Unused ARENA_BLOCK_SIZE blocks */
+    unsigned long block_count;  /**< ARENA_BLOCK_SIZE blocks allocated */
+    H2Session* sessions;        /**< Unused HTTP/2 sessions */
+    unsigned long session_count; /**< HTTP/2 sessions allocated */
+} ConnPool;
+
+/**
+ * @struct BufferPool
+ * @brief Per-worker pool of connection buffers in configured size classes
+ *
+ * Buffers are carved from 2MB chunks, backed by huge pages where the
+ * system provides them, and recycled through a free list per class. A
+ * connection only holds a buffer while it has bytes in it, so idle
+ * keep-alive connections cost no buffer memory.
+ */
+typedef struct {
+    char* free[BUFFER_CLASSES_MAX];     /**< Unused buffers per class, linked through
+                                             their first bytes */
+    unsigned long in_use[BUFFER_CLASSES_MAX];       /**< Buffers handed out per class */
+    unsigned long high_water[BUFFER_CLASSES_MAX];   /**< Most buffers in use at once per class */
+    unsigned long capacity[BUFFER_CLASSES_MAX];     /**< Buffers carved per class */
+    char* carve;                        /**< Next unused byte of the newest chunk */
+    char* carve_end;                    /**< End of the newest chunk */
+    unsigned long chunks;               /**< Chunks mapped */
+    unsigned long huge_chunks;          /**< Chunks mapped from reserved huge pages */
+} BufferPool;
+
+/**
+ * @struct Metrics
+ * @brief Per-worker counters exposed by the metrics endpoint
+ *
+ * Only the owning worker writes them, with plain increments; a scrape sums
+ * every worker's copy with relaxed loads, so recording never contends.
+ * Latency is kept HDR-style: values below LATENCY_SUB microseconds get a
+ * bucket each, and every power of two above is split into LATENCY_SUB
+ * linear sub-buckets, bounding the error to 1/LATENCY_SUB of the value.
+ */
+typedef struct {
+    unsigned long requests[STATUS_CODE_MAX];    /**< Responses by status code */
+    unsigned long bytes_sent;                   /**< Bytes written to client sockets */
+    unsigned long accepted;                     /**< Connections accepted */
+    unsigned long accept_errors;                /**< accept() failures */
+    long active;                                /**< Connections currently open */
+    unsigned long latency[LATENCY_BUCKETS];     /**< Request latency histogram */
+    unsigned long latency_sum_us;               /**< Sum of recorded latencies */
+    unsigned long h2_connections;               /**< Connections that switched to HTTP/2 */
+    unsigned long h2_streams;                   /**< HTTP/2 streams opened */
+} Metrics;
+
+/**
+ * @struct AccessRecord
+ * @brief One request as the access log sees it, formatted by the logger
+ */
+typedef struct {
+    time_t time;                /**< Wall clock second the response was queued */
+    struct in_addr addr;        /**< Client address */
+    int status;                 /**< Response status code */
+    int version_minor;          /**< HTTP/1.x minor version, -1 if the request line was bad */
+    int http2;                  /**< Request came on an HTTP/2 stream */
+    long long bytes;            /**< Response body bytes */
+    unsigned long latency_us;   /**< From the request's first byte to its response */
+    char method[16];            /**< Request method, empty if unparsed */
+    char target[256];           /**< Request target, truncated */
+    char referer[128];          /**< Referer (combined and JSON formats only) */
+    char user_agent[192];       /**< User-Agent (combined and JSON formats only) */
+} AccessRecord;
+
+/**
+ * @struct AccessLog
+ * @brief Single-producer ring of access records drained by the logger thread
+ *
+ * The worker only writes @c head and the logger only writes @c tail, so
+ * neither side ever waits; a worker that finds the ring full counts the
+ * record as dropped instead.
+ */
+typedef struct {
+    AccessRecord* records;      /**< ACCESS_LOG_RING slots, NULL when logging is off */
+    unsigned long head;         /**< Next slot to fill, written by the worker */
+    char pad[64];               /**< Keeps @c head and @c tail on separate cache lines */
+    unsigned long tail;         /**< Next slot to format, written by the logger */
+    unsigned long dropped;      /**< Records lost to a full ring */
+} AccessLog;
+
+/**
+ * @struct Task
+ * @brief Blocking work handed from a worker to the thread pool
+ *
+ * Concrete tasks embed this as their first member. @c run executes on a
+ * pool thread and must not touch worker state; @c complete then runs on
+ * the owning worker's loop thread, where it may.
+ */
+typedef struct Task {
+    void (*run)(struct Task* task);         /**< Blocking part, on a pool thread */
+    void (*complete)(struct Task* task);    /**< Follow-up on the owning worker */
+    struct Worker* worker;                  /**< Worker that submitted the task */
+    struct Task* next;                      /**< Completion stack link */
+} Task;
+
+/**
+ * @struct TaskDeque
+ * @brief Chase-Lev work-stealing deque of submitted tasks
+ *
+ * Only the owning worker pushes at @c bottom; pool threads steal from
+ * @c top with a compare-and-swap, so submitting a task takes no lock.
+ */
+typedef struct {
+    long top;                       /**< Next task to steal */
+    long bottom;                    /**< Next free slot */
+    Task* tasks[TASK_DEQUE_SIZE];   /**< Ring indexed modulo the size */
+} TaskDeque;
+
+/**
+ * @struct DateCache
+ * @brief Date header line, reformatted only when the wall clock second changes
+ */
+typedef struct {
+    time_t second;      /**< Wall clock second @c line shows */
+    char line[40];      /**< "Date: <IMF-fixdate>\r\n" */
+    size_t len;         /**< Length of @c line */
+} DateCache;
+
+/**
+ * @struct Worker
+ * @brief Event loop thread with its own listener and epoll instance
+ *
+ * Workers share nothing on the hot path: each binds its own SO_REUSEPORT
+ * listener and the kernel load-balances incoming connections between them.
+ */
+typedef struct Worker {
+    int id;             /**< Worker index */
+    int cpu;            /**< CPU to pin to, -1 for no affinity */
+    int listen_sock;    /**< This worker's listening socket */
+    int epfd;           /**< This worker's epoll instance */
+    pthread_t thread;   /**< Thread running the event loop */
+    time_t now;         /**< Monotonic seconds at the last loop wakeup */
+    DateCache date;     /**< Date header for responses queued this second */
+    TimerWheel timers;  /**< Connection timeouts */
+    unsigned long timeouts[TIMEOUT_COUNT];  /**< Connections closed per timeout kind */
+    AccessLog log;      /**< Access records waiting for the logger thread */
+    Metrics metrics;    /**< Counters read by the metrics endpoint */
+    ConnPool conns;     /**< Connection objects and arena blocks */
+    BufferPool buffers; /**< Receive and send buffers */
+    FileCache files;    /**< Open file cache */
+    FileEntry* compressed;  /**< Finished compressions handed back by the compressor
+                                 threads, a lock-free stack linked by @c hash_next */
+    TaskDeque tasks;    /**< Tasks waiting for a pool thread (pool engine) */
+    Task* tasks_done;   /**< Finished tasks, a lock-free stack pushed by pool threads */
+    int task_fd;        /**< eventfd signalled when @c tasks_done becomes non-empty */
+    Connection* resume_head;    /**< Connections whose pool open finished */
+} Worker;
+
+/**
+ * @struct CompressJob
+ * @brief Request for a compressor thread to build an encoded body
+ *
+ * Carries the identity of the file as the worker saw it, so a file that
+ * changes before the job runs is skipped rather than cached under stale
+ * validators.
+ */
+typedef struct CompressJob {
+    Task task;                  /**< Pool task, when the pool engine runs it */
+    FileEntry* result;          /**< Pool engine result, NULL if not worth caching */
+    struct CompressJob* next;   /**< Queue link */
+    Worker* worker;             /**< Worker to hand the result back to */
+    ContentEncoding encoding;   /**< Encoding to produce */
+    off_t size;                 /**< Source size */
+    struct timespec mtime;      /**< Source modification time */
+    dev_t dev;                  /**< Source device */
+    ino_t ino;                  /**< Source inode */
+    const char* mime_type;      /**< Content-Type */
+    char etag[64];              /**< Entity tag of the identity representation */
+    size_t etag_len;            /**< Bytes used in @c etag */
+    char path[];                /**< Resolved path */
+} CompressJob;
+
+/**
+ * @struct OpenTask
+ * @brief File open handed to the pool on a cache miss
+ */
+typedef struct {
+    Task task;                  /**< Pool task */
+    Connection* conn;           /**< Connection waiting for the file, in whose arena the
+                                     task lives; CONN_CLOSING if it closed meanwhile */
+    ContentEncoding encoding;   /**< Representation to open */
+    FileEntry* entry;           /**< Opened entry, NULL if the file cannot be served */
+    int taken;                  /**< @c entry was handed to the resumed request */
+    FileEntry* held;            /**< Entry the request already had when it handed the open
+                                     off, given back to it on resume; NULL if none */
+    char path[];                /**< Resolved path */
+} OpenTask;
+
+/** Pool threads, sleeping on @c ready until a task is pushed */
+static struct {
+    sem_t ready;        /**< One post per submitted task */
+    Worker* workers;    /**< Workers whose deques are stolen from */
+    int worker_count;   /**< Entries in @c workers */
+} task_pool;
+
+/** Jobs waiting for a compressor thread */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    CompressJob* head;
+    CompressJob* tail;
+    int length;
+} compress_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+/**
+ * @struct Slice
+ * @brief Byte range inside a connection's receive buffer
+ */
+typedef struct {
+    unsigned int off;   /**< Offset from the start of the buffer */
+    unsigned int len;   /**< Length in bytes */
+} Slice;
+
+/**
+ * @struct HTTPHeader
+ * @brief One request header field, referenced in place
+ */
+typedef struct {
+    Slice name;         /**< Field name */
+    Slice value;        /**< Field value without surrounding whitespace */
+} HTTPHeader;
+
+/**
+ * @struct ByteRange
+ * @brief One satisfiable range of a Range request
+ */
+typedef struct {
+    off_t start;        /**< First byte */
+    off_t len;          /**< Number of bytes */
+} ByteRange;
+
+/**
+ * @struct HeaderBuf
+ * @brief Response header being assembled in a caller's buffer
+ *
+ * Appends stop at the end of the buffer, truncating like snprintf would.
+ */
+typedef struct {
+    char* pos;          /**< Next byte to write */
+    char* end;          /**< End of the buffer */
+} HeaderBuf;
+
+/**
+ * @enum ParseResult
+ * @brief Outcome of feeding buffered bytes to the request parser
+ */
+typedef enum {
+    PARSE_NEED_MORE,    /**< Header incomplete, call again with more bytes */
+    PARSE_DONE,         /**< Header complete, see HTTPRequest::length */
+    PARSE_ERROR         /**< Malformed or oversized, see HTTPRequest::error_status */
+} ParseResult;
+
+/**
+ * @struct HTTPRequest
+ * @brief Parsed HTTP request structure
+ *
+ * Filled incrementally by parse_http_request(). Every field refers to the
+ * receive buffer by offset and length; nothing is copied. The parser state
+ * is kept here so parsing resumes where it stopped when more bytes arrive.
+ */
+typedef struct {
+    int state;              /**< Parser state (internal) */
+    size_t pos;             /**< Next byte to examine */
+    size_t mark;            /**< Start of the token being scanned */
+    Slice method;           /**< HTTP method (GET, POST, etc.) */
+    Slice path;             /**< Requested resource path, without query */
+    Slice query;            /**< Query string after '?', empty if none */
+    Slice version;          /**< HTTP version */
+    int version_minor;      /**< Minor version of HTTP/1.x */
+    HTTPHeader headers[MAX_HEADERS]; /**< Header fields in arrival order */
+    int header_count;       /**< Entries in @c headers */
+    int conn_close;         /**< Connection: close was sent */
+    int conn_keep_alive;    /**< Connection: keep-alive was sent */
+    long long content_length; /**< Content-Length, -1 if absent */
+    int chunked;            /**< Transfer-Encoding: chunked was sent */
+    size_t length;          /**< Header bytes including the blank line */
+    int error_status;       /**< HTTP status to answer with on PARSE_ERROR */
+} HTTPRequest;
+
+/**
+ * @enum ConnState
+ * @brief Per-connection state machine driven by the event loop
+ */
+typedef enum {
+    CONN_READING,   /**< Waiting for a complete request header */
+    CONN_WRITING,   /**< Flushing the queued responses */
+    CONN_CLOSING    /**< Response done or error, socket to be closed */
+} ConnState;
+
+/**
+ * @struct Connection
+ * @brief Client connection with its request and response buffers
+ *
+ * The response is queued in @c out (headers and small bodies) followed by
+ * an optional file body that is sent zero-copy (or streamed through @c out)
+ * as the socket accepts data, so the same code works for blocking and
+ * non-blocking sockets.
+ * Pipelined requests wait in @c in and their responses are queued in order.
+ * Both buffers come from the worker's BufferPool when there is something
+ * to put in them and go back once they are empty.
+ */
+struct Connection {
+    int fd;                     /**< Client socket descriptor */
+    ConnState state;            /**< Current state */
+    Worker* worker;             /**< Owning worker, NULL in the fork engine */
+    struct sockaddr_in addr;    /**< Client address information */
+    char* in;                   /**< Received request bytes (NUL-terminated), NULL if none */
+    size_t in_len;              /**< Bytes held in @c in */
+    size_t in_size;             /**< Size of @c in */
+    int in_class;               /**< Buffer size class of @c in */
+    HTTPRequest req;            /**< Parser state for the request at the start of @c in */
+    char* out;                  /**< Pending response bytes, NULL if none */
+    size_t out_len;             /**< Bytes held in @c out */
+    size_t out_size;            /**< Size of @c out, also while it is not held */
+    size_t out_sent;            /**< Bytes of @c out already written */
+    int file_fd;                /**< File body descriptor, -1 if none */
+    FileEntry* file;            /**< Entry owning @c file_fd or @c body */
+    const char* body;           /**< In-memory file body, NULL if none */
+    ByteRange* ranges;          /**< Parts of a multipart/byteranges body, in @c arena */
+    int range_count;            /**< Entries in @c ranges, 0 if not multipart */
+    int range_next;             /**< Next part to send */
+    off_t file_offset;          /**< Next file body offset to read */
+    off_t file_remaining;       /**< File body bytes not yet read */
+    int pipe_fds[2];            /**< splice() pipe, created on first use */
+    size_t pipe_len;            /**< File bytes sitting in the pipe */
+    int keep_alive;             /**< Keep the connection open after the response */
+    H2Session* h2;              /**< HTTP/2 state once the client sent the preface, NULL
+                                     for HTTP/1.x */
+    int head;                   /**< Request is HEAD: headers only, no body */
+    int requests;               /**< Requests served on this connection */
+    int readable;               /**< Socket may still hold unread bytes */
+    int peer_closed;            /**< Client finished sending */
+    off_t body_remaining;       /**< Request body bytes still to discard */
+    Timer timer;                /**< Deadline for the current phase */
+    int timer_requests;         /**< @c requests when the header timer was armed */
+    uint64_t request_start;     /**< Monotonic ns the current request's first byte arrived */
+    int status;                 /**< Status of the response last queued */
+    long long body_bytes;       /**< Body length of the response last queued */
+    int pending_ops;            /**< io_uring requests still in flight */
+    int recv_armed;             /**< io_uring multishot recv active */
+    int chain_pending;          /**< io_uring send chain requests in flight */
+    int chain_failed;           /**< io_uring send chain hit an error */
+    size_t read_len;            /**< io_uring file read/splice size in flight */
+    struct iovec iov[2];        /**< io_uring sendmsg of @c out and @c body */
+    struct msghdr msg;          /**< io_uring sendmsg header */
+    OpenTask* opening;          /**< Pool open in flight; the request waits for it */
+    OpenTask* opened;           /**< Finished pool open for the request being resumed */
+    int offloads;               /**< Pool opens made for the current request, at most
+                                     POOL_OPENS_MAX */
+    Connection* resume_next;    /**< Worker resume list link */
+    Connection* pool_next;      /**< Worker free list link while unused */
+    Arena arena;                /**< Memory for the request being served */
+    char arena_space[CONN_ARENA_SIZE]; /**< Inline space @c arena starts from */
+    int held_count;             /**< io_uring recv buffers waiting for room in @c in */
+    struct {
+        unsigned short bid;     /**< Provided buffer id */
+        unsigned short off;     /**< Bytes already copied into @c in */
+        unsigned short len;     /**< Bytes received into the buffer */
+    } held[URING_HELD_H2];
+};
+
+/**
+ * @enum H2FrameType
+ * @brief HTTP/2 frame types (RFC 9113 section 6)
+ */
+typedef enum {
+    H2_DATA = 0,
+    H2_HEADERS = 1,
+    H2_PRIORITY = 2,
+    H2_RST_STREAM = 3,
+    H2_SETTINGS = 4,
+    H2_PUSH_PROMISE = 5,
+    H2_PING = 6,
+    H2_GOAWAY = 7,
+    H2_WINDOW_UPDATE = 8,
+    H2_CONTINUATION = 9
+} H2FrameType;
+
+/** HTTP/2 frame flags; END_STREAM and ACK share a bit on different frames */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/**
+ * @enum H2Error
+ * @brief HTTP/2 error codes carried by RST_STREAM and GOAWAY
+ */
+typedef enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+} H2Error;
+
+/**
+ * @enum H2Setting
+ * @brief SETTINGS parameters the server reads or sends
+ */
+typedef enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+} H2Setting;
+
+/**
+ * @struct HpackTable
+ * @brief HPACK dynamic table (RFC 7541 section 2.3.2)
+ *
+ * Names and values sit back to back in @c data, oldest entry first, so
+ * evicting from the front is a memmove of at most H2_TABLE_SIZE bytes.
+ * Index 1 is the newest entry.
+ */
+typedef struct {
+    char data[H2_TABLE_SIZE];   /**< Entry names and values, oldest first */
+    size_t data_len;            /**< Bytes used in @c data */
+    struct {
+        unsigned short off;         /**< Start of the name in @c data */
+        unsigned short name_len;    /**< Name length; the value follows it */
+        unsigned short value_len;   /**< Value length */
+    } entries[H2_TABLE_SIZE / 32];  /**< Entries, oldest first */
+    int count;                  /**< Entries in the table */
+    size_t size;                /**< Size as HPACK counts it, 32 bytes overhead per entry */
+    size_t max_size;            /**< Current size limit */
+} HpackTable;
+
+/**
+ * @struct H2Stream
+ * @brief HTTP/2 stream from its request headers until its response is queued
+ *
+ * A stream's response body is sent as DATA frames in turns with the other
+ * streams, as flow control allows: first @c pending (a short body such as
+ * an error page, or a multipart part header), then the file bytes, then the
+ * next multipart part.
+ */
+typedef struct H2Stream {
+    uint32_t id;                /**< Stream identifier, 0 while the slot is free */
+    long window;                /**< Bytes the client lets us send on the stream */
+    FileEntry* file;            /**< Entry holding the body, NULL if none */
+    off_t offset;               /**< Next body offset to send */
+    off_t remaining;            /**< Bytes of the current range not yet framed */
+    ByteRange ranges[MAX_RANGES]; /**< Parts of a multipart/byteranges body */
+    int range_count;            /**< Entries in @c ranges, 0 once the closing boundary is queued */
+    int range_next;             /**< Next part to send */
+    char pending[H2_PENDING_MAX]; /**< Body bytes to send before the file */
+    size_t pending_len;         /**< Bytes in @c pending */
+    size_t pending_sent;        /**< Bytes of @c pending already framed */
+    struct H2Stream* next;      /**< Send queue or free list link */
+} H2Stream;
+
+/**
+ * @struct H2Session
+ * @brief HTTP/2 state of a connection
+ *
+ * Frames are consumed from the connection's input buffer as they arrive;
+ * DATA, HEADERS and CONTINUATION payloads are taken in pieces, so a frame
+ * never has to fit in the buffer whole. Each request is rewritten as
+ * HTTP/1.1 into @c request and answered by the HTTP/1.1 handlers, whose
+ * response head is translated into a HEADERS frame.
+ */
+struct H2Session {
+    H2Stream streams[H2_MAX_STREAMS]; /**< Stream slots */
+    H2Stream* free;             /**< Unused slots */
+    H2Stream* sending;          /**< Streams with body left to send, in turn order */
+    H2Stream* sending_tail;     /**< Last stream in @c sending */
+    int stream_count;           /**< Streams with a response in progress */
+    uint32_t last_stream_id;    /**< Highest stream the client opened */
+    long window;                /**< Bytes the client lets us send on the connection */
+    long initial_window;        /**< Client's SETTINGS_INITIAL_WINDOW_SIZE */
+    size_t recv_unacked;        /**< DATA bytes received since the last WINDOW_UPDATE */
+    uint32_t recv_stream;       /**< Stream the last DATA frame was on */
+    size_t recv_stream_unacked; /**< Its DATA bytes not yet given back in a WINDOW_UPDATE */
+    int settings_seen;          /**< The client's first SETTINGS frame arrived */
+    int draining;               /**< GOAWAY sent or received: no new streams */
+    int goaway_sent;            /**< A GOAWAY frame was queued */
+    int failed;                 /**< Connection error: input is ignored until the close */
+    int frame_open;             /**< A DATA, HEADERS, CONTINUATION, GOAWAY or unknown frame
+                                     is being received in pieces */
+    unsigned char frame_type;   /**< Type of that frame */
+    unsigned char frame_flags;  /**< Its flags */
+    size_t frame_left;          /**< Payload bytes still to arrive, before the padding */
+    size_t frame_skip;          /**< Padding bytes after them */
+    uint32_t block_stream;      /**< Stream whose header block is incomplete, 0 if none */
+    size_t block_len;           /**< Bytes in @c block */
+    char block[H2_HEADER_BLOCK_MAX]; /**< Header block fragments received so far */
+    HpackTable decoder;         /**< Client's dynamic table, for request headers */
+    HpackTable encoder;         /**< Our dynamic table, for response headers */
+    int encoder_resized;        /**< Announce @c encoder's size in the next header block */
+    char field[H2_TABLE_SIZE];  /**< Name and value of the header field being decoded */
+    char request[H2_REQUEST_MAX]; /**< Request being answered, as HTTP/1.1 */
+    char response[H2_RESPONSE_MAX]; /**< HTTP/1.1 response head and short body queued for it */
+    H2Session* pool_next;       /**< Worker free list link while unused */
+};
+
+/**
+ * @enum ParserState
+ * @brief Position of the request parser within the header
+ */
+typedef enum {
+    HP_START,           /**< Before the request line, skipping empty lines */
+    HP_METHOD,          /**< Inside the method token */
+    HP_PATH,            /**< Inside the request target path */
+    HP_QUERY,           /**< Inside the query string */
+    HP_VERSION,         /**< Inside the protocol version */
+    HP_LINE_LF,         /**< Expecting LF after a CR */
+    HP_HEADER_START,    /**< At the start of a header line or the blank line */
+    HP_HEADER_NAME,     /**< Inside a field name */
+    HP_HEADER_OWS,      /**< Whitespace before a field value */
+    HP_HEADER_VALUE,    /**< Inside a field value */
+    HP_END_LF           /**< Expecting the LF of the blank line */
+} ParserState;
+
+/**
+ * @brief Token characters allowed in methods and field names (RFC 7230 tchar)
+ */
+static const unsigned char tchar_table[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+    ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1,
+    ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1,
+    ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+    ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+    ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+    ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+    ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+    ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+    ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+/**
+ * @brief Find the first byte that is not a token character
+ * @param buf Buffer to scan
+ * @param pos Offset to start at
+ * @param len Bytes available
+ * @return size_t Offset of the delimiter, @p len if none yet
+ */
+size_t scan_token_scalar(const char* buf, size_t pos, size_t len) {
+    while (pos < len && tchar_table[(unsigned char)buf[pos]]) pos++;
+    return pos;
+}
+
+/**
+ * @brief Find the end of a request target: space, '?' or a control character
+ * @param buf Buffer to scan
+ * @param pos Offset to start at
+ * @param len Bytes available
+ * @return size_t Offset of the delimiter, @p len if none yet
+ */
+size_t scan_target_scalar(const char* buf, size_t pos, size_t len) {
+    while (pos < len) {
+        unsigned char c = buf[pos];
+        if (c <= ' ' || c == '?' || c == 0x7f) break;
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * @brief Find the end of a field value or version: CR, LF or another control
+ * @param buf Buffer to scan
+ * @param pos Offset to start at
+ * @param len Bytes available
+ * @return size_t Offset of the delimiter, @p len if none yet
+ */
+size_t scan_line_scalar(const char* buf, size_t pos, size_t len) {
+    while (pos < len) {
+        unsigned char c = buf[pos];
+        if ((c < ' ' && c != '\t') || c == 0x7f) break;
+        pos++;
+    }
+    return pos;
+}
+
+#if SCAN_X86
+
+/**
+ * @brief SSE4.2 scan_token(): PCMPESTRI over 16 bytes at a time
+ *
+ * The eight delimiter ranges that fit one instruction are a superset of
+ * the non-token bytes (they also cover '|', '}' and '~'), so each hit is
+ * confirmed against the exact table before stopping.
+ */
+__attribute__((target("sse4.2")))
+size_t scan_token_sse42(const char* buf, size_t pos, size_t len) {
+    static const char ranges[16] = "\x00 \"\"(),,//:@[]{\xff";
+    const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+
+    while (pos + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + pos));
+        int idx = _mm_cmpestri(r, 16, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                            _SIDD_LEAST_SIGNIFICANT);
+        if (idx == 16) {
+            pos += 16;
+            continue;
+        }
+        pos += idx;
+        if (!tchar_table[(unsigned char)buf[pos]]) return pos;
+        pos++;
+    }
+    return scan_token_scalar(buf, pos, len);
+}
+
+/**
+ * @brief SSE4.2 scan_target(): PCMPESTRI over 16 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+size_t scan_target_sse42(const char* buf, size_t pos, size_t len) {
+    static const char ranges[16] = "\x00 ??\x7f\x7f";
+    const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+
+    while (pos + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + pos));
+        int idx = _mm_cmpestri(r, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                           _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) return pos + idx;
+        pos += 16;
+    }
+    return scan_target_scalar(buf, pos, len);
+}
+
+/**
+ * @brief SSE4.2 scan_line(): PCMPESTRI over 16 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+size_t scan_line_sse42(const char* buf, size_t pos, size_t len) {
+    static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+    const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+
+    while (pos + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + pos));
+        int idx = _mm_cmpestri(r, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                           _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) return pos + idx;
+        pos += 16;
+    }
+    return scan_line_scalar(buf, pos, len);
+}
+
+/**
+ * @brief Nibble lookup table for the AVX2 token classifier
+ *
+ * Bit h of entry l is set when byte (h << 4 | l) is a token character;
+ * filled from tchar_table by scan_select(). Duplicated for both lanes.
+ */
+static unsigned char tchar_nibbles[32];
+
+/**
+ * @brief AVX2 scan_token(): exact token classification of 32 bytes at a time
+ *
+ * Each byte's low nibble selects a row of tchar_nibbles and its high
+ * nibble selects a bit within the row (PSHUFB twice, then AND); bytes
+ * with the high bit set select no bit and so count as delimiters.
+ */
+__attribute__((target("avx2")))
+size_t scan_token_avx2(const char* buf, size_t pos, size_t len) {
+    const __m256i lo_lut = _mm256_loadu_si256((const __m256i*)tchar_nibbles);
+    const __m256i hi_bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (pos + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + pos));
+        __m256i lo = _mm256_and_si256(v, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i is_token = _mm256_and_si256(_mm256_shuffle_epi8(lo_lut, lo),
+                                            _mm256_shuffle_epi8(hi_bit, hi));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(is_token, zero));
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+    return scan_token_scalar(buf, pos, len);
+}
+
+/**
+ * @brief AVX2 scan_target(): compare 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+size_t scan_target_avx2(const char* buf, size_t pos, size_t len) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i question = _mm256_set1_epi8('?');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    while (pos + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + pos));
+        // Unsigned v <= ' ' is min(v, ' ') == v
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, question));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, del));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+    return scan_target_scalar(buf, pos, len);
+}
+
+/**
+ * @brief AVX2 scan_line(): compare 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+size_t scan_line_avx2(const char* buf, size_t pos, size_t len) {
+    const __m256i ctl_max = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    while (pos + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + pos));
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl_max), v);
+        hit = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), hit);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, del));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+    return scan_line_scalar(buf, pos, len);
+}
+
+#endif /* SCAN_X86 */
+
+/**
+ * @struct ScanKernels
+ * @brief One implementation of the parser's delimiter scans
+ */
+typedef struct {
+    const char* name;   /**< Name used by --simd */
+    size_t (*token)(const char*, size_t, size_t);   /**< scan_token() kernel */
+    size_t (*target)(const char*, size_t, size_t);  /**< scan_target() kernel */
+    size_t (*line)(const char*, size_t, size_t);    /**< scan_line() kernel */
+} ScanKernels;
+
+static const ScanKernels scan_kernels[] = {
+    { "scalar", scan_token_scalar, scan_target_scalar, scan_line_scalar },
+#if SCAN_X86
+    { "sse4.2", scan_token_sse42, scan_target_sse42, scan_line_sse42 },
+    { "avx2", scan_token_avx2, scan_target_avx2, scan_line_avx2 },
+#endif
+};
+
+#define SCAN_KERNEL_COUNT (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+/** Kernels used by the parser, chosen once at startup */
+static ScanKernels scanner = { "scalar", scan_token_scalar, scan_target_scalar, scan_line_scalar };
+
+/**
+ * @brief Check whether the CPU can run a kernel set
+ * @param kernels Kernel set
+ * @return int 1 if supported, 0 otherwise
+ */
+int scan_supported(const ScanKernels* kernels) {
+#if SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(kernels->name, "sse4.2") == 0) return __builtin_cpu_supports("sse4.2");
+    if (strcmp(kernels->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    return strcmp(kernels->name, "scalar") == 0;
+}
+
+/**
+ * @brief Select the parser's scan kernels
+ * @param name "auto" for the fastest the CPU supports (via CPUID), or a
+ *             kernel name
+ * @return int 0 on success, -1 if unknown or unsupported on this CPU
+ */
+int scan_select(const char* name) {
+#if SCAN_X86
+    for (int i = 0; i < 16; i++) {
+        unsigned char bits = 0;
+        for (int hi = 0; hi < 8; hi++) {
+            if (tchar_table[hi << 4 | i]) bits |= 1 << hi;
+        }
+        tchar_nibbles[i] = tchar_nibbles[i + 16] = bits;
+    }
+#endif
+
+    int auto_select = strcmp(name, "auto") == 0;
+    for (int i = SCAN_KERNEL_COUNT - 1; i >= 0; i--) {
+        if ((auto_select || strcmp(name, scan_kernels[i].name) == 0) &&
+            scan_supported(&scan_kernels[i])) {
+            scanner = scan_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Reset a parser before the next request on the connection
+ * @param req Parser to reset
+ */
+void http_request_reset(HTTPRequest* req) {
+    memset(req, 0, offsetof(HTTPRequest, headers));
+    req->state = HP_START;
+    req->header_count = 0;
+    req->conn_close = 0;
+    req->conn_keep_alive = 0;
+    req->content_length = -1;
+    req->chunked = 0;
+    req->length = 0;
+    req->error_status = 0;
+}
+
+/**
+ * @brief Compare a slice with a string, ignoring ASCII case
+ * @param buf Buffer the slice refers to
+ * @param slice Slice to compare
+ * @param str NUL-terminated string
+ * @return int 1 if equal, 0 otherwise
+ */
+int slice_equals(const char* buf, Slice slice, const char* str) {
+    return strlen(str) == slice.len && strncasecmp(buf + slice.off, str, slice.len) == 0;
+}
+
+/**
+ * @brief Check whether a comma-separated field value contains a token
+ * @param buf Buffer the value refers to
+ * @param value Field value
+ * @param token Token to look for, matched case-insensitively
+ * @return int 1 if present, 0 otherwise
+ */
+int slice_has_token(const char* buf, Slice value, const char* token) {
+    size_t token_len = strlen(token);
+    const char* p = buf + value.off;
+    const char* end = p + value.len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char* start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != ';') p++;
+        if ((size_t)(p - start) == token_len && strncasecmp(start, token, token_len) == 0) {
+            return 1;
+        }
+        while (p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Look up a request header by name
+ * @param req Parsed request
+ * @param buf Buffer the request refers to
+ * @param name Field name, matched case-insensitively
+ * @return const HTTPHeader* First matching header, NULL if absent
+ */
+const HTTPHeader* find_header(const HTTPRequest* req, const char* buf, const char* name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (slice_equals(buf, req->headers[i].name, name)) {
+            return &req->headers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Record a completed header field and interpret the framing ones
+ * @param req Parser
+ * @param buf Receive buffer
+ * @param value_end Offset just past the field value
+ * @return int 0 on success, -1 on error (error_status set)
+ */
+int add_header(HTTPRequest* req, const char* buf, size_t value_end) {
+    HTTPHeader* header = &req->headers[req->header_count];
+
+    // Trim trailing whitespace from the value
+    while (value_end > req->mark && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t')) {
+        value_end--;
+    }
+    header->value.off = req->mark;
+    header->value.len = value_end - req->mark;
+
+    if (slice_equals(buf, header->name, "Connection")) {
+        req->conn_close |= slice_has_token(buf, header->value, "close");
+        req->conn_keep_alive |= slice_has_token(buf, header->value, "keep-alive");
+    } else if (slice_equals(buf, header->name, "Content-Length")) {
+        long long length = 0;
+        if (header->value.len == 0 || header->value.len > 18 || req->content_length >= 0) {
+            req->error_status = 400;
+            return -1;
+        }
+        for (unsigned int i = 0; i < header->value.len; i++) {
+            char c = buf[header->value.off + i];
+            if (c < '0' || c > '9') {
+                req->error_status = 400;
+                return -1;
+            }
+            length = length * 10 + (c - '0');
+        }
+        req->content_length = length;
+    } else if (slice_equals(buf, header->name, "Transfer-Encoding")) {
+        req->chunked |= slice_has_token(buf, header->value, "chunked");
+    }
+
+    req->header_count++;
+    return 0;
+}
+
+/**
+ * @brief Parse HTTP request header incrementally
+ *
+ * Consumes the bytes buffered so far, resuming where the previous call
+ * stopped, so each byte is examined once however the request is split
+ * across reads. Method, path, version and headers are recorded as slices
+ * of @p buf. Size limits come from the server configuration.
+ *
+ * @param req Pointer to HTTPRequest structure to populate
+ * @param buf Receive buffer, starting at the request
+ * @param len Bytes available in @p buf
+ * @return ParseResult PARSE_DONE, PARSE_NEED_MORE or PARSE_ERROR
+ */
+ParseResult parse_http_request(HTTPRequest* req, const char* buf, size_t len) {
+    size_t pos = req->pos;
+
+    if (req->error_status) return PARSE_ERROR;
+
+    while (pos < len) {
+        switch (req->state) {
+        case HP_START:
+            // Tolerate empty lines before the request line (RFC 7230 3.5)
+            if (buf[pos] == '\r' || buf[pos] == '\n') {
+                pos++;
+                break;
+            }
+            req->mark = pos;
+            req->state = HP_METHOD;
+            /* fall through */
+
+        case HP_METHOD:
+            pos = scanner.token(buf, pos, len);
+            if (pos == len) break;
+            if (buf[pos] != ' ' || pos == req->mark) goto bad_request;
+            req->method.off = req->mark;
+            req->method.len = pos - req->mark;
+            req->mark = ++pos;
+            req->state = HP_PATH;
+            break;
+
+        case HP_PATH:
+            pos = scanner.target(buf, pos, len);
+            if (pos - req->mark > (size_t)config.max_uri) goto uri_too_long;
+            if (pos == len) break;
+            if ((buf[pos] != ' ' && buf[pos] != '?') || pos == req->mark) goto bad_request;
+            req->path.off = req->mark;
+            req->path.len = pos - req->mark;
+            if (buf[pos] == '?') {
+                req->mark = ++pos;
+                req->state = HP_QUERY;
+            } else {
+                req->mark = ++pos;
+                req->state = HP_VERSION;
+            }
+            break;
+
+        case HP_QUERY:
+            while (pos < len && (unsigned char)buf[pos] > ' ' && buf[pos] != 0x7f) pos++;
+            if (pos - req->path.off > (size_t)config.max_uri) goto uri_too_long;
+            if (pos == len) break;
+            if (buf[pos] != ' ') goto bad_request;
+            req->query.off = req->mark;
+            req->query.len = pos - req->mark;
+            req->mark = ++pos;
+            req->state = HP_VERSION;
+            break;
+
+        case HP_VERSION:
+            pos = scanner.line(buf, pos, len);
+            if (pos == len) break;
+            if (buf[pos] != '\r' && buf[pos] != '\n') goto bad_request;
+            req->version.off = req->mark;
+            req->version.len = pos - req->mark;
+            if (req->version.len != 8 || strncmp(buf + req->mark, "HTTP/", 5) != 0 ||
+                buf[req->mark + 6] != '.') {
+                goto bad_request;
+            }
+            if (buf[req->mark + 5] != '1' || buf[req->mark + 7] < '0' || buf[req->mark + 7] > '9') {
+                req->error_status = 505;
+                goto error;
+            }
+            req->version_minor = buf[req->mark + 7] - '0';
+            req->state = buf[pos] == '\r' ? HP_LINE_LF : HP_HEADER_START;
+            pos++;
+            break;
+
+        case HP_LINE_LF:
+            if (buf[pos] != '\n') goto bad_request;
+            req->state = HP_HEADER_START;
+            pos++;
+            break;
+
+        case HP_HEADER_START:
+            if (buf[pos] == '\r') {
+                req->state = HP_END_LF;
+                pos++;
+                break;
+            }
+            if (buf[pos] == '\n') {
+                pos++;
+                goto done;
+            }
+            if (req->header_count == config.max_headers) {
+                req->error_status = 431;
+                goto error;
+            }
+            req->mark = pos;
+            req->state = HP_HEADER_NAME;
+            /* fall through */
+
+        case HP_HEADER_NAME:
+            pos = scanner.token(buf, pos, len);
+            if (pos == len) break;
+            if (buf[pos] != ':' || pos == req->mark) goto bad_request;
+            req->headers[req->header_count].name.off = req->mark;
+            req->headers[req->header_count].name.len = pos - req->mark;
+            req->state = HP_HEADER_OWS;
+            pos++;
+            /* fall through */
+
+        case HP_HEADER_OWS:
+            while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t')) pos++;
+            if (pos == len) break;
+            req->mark = pos;
+            req->state = HP_HEADER_VALUE;
+            /* fall through */
+
+        case HP_HEADER_VALUE:
+            pos = scanner.line(buf, pos, len);
+            if (pos == len) break;
+            if (buf[pos] != '\r' && buf[pos] != '\n') goto bad_request;
+            if (add_header(req, buf, pos) < 0) goto error;
+            req->state = buf[pos] == '\r' ? HP_LINE_LF : HP_HEADER_START;
+            pos++;
+            break;
+
+        case HP_END_LF:
+            if (buf[pos] != '\n') goto bad_request;
+            pos++;
+            goto done;
+        }
+    }
+
+    req->pos = pos;
+    if (len >= (size_t)config.max_header_size) {
+        req->error_status = req->state <= HP_QUERY ? 414 : 431;
+        goto error;
+    }
+    return PARSE_NEED_MORE;
+
+done:
+    if (pos > (size_t)config.max_header_size) {
+        req->error_status = 431;
+        goto error;
+    }
+    req->pos = pos;
+    req->length = pos;
+    return PARSE_DONE;
+
+uri_too_long:
+    req->error_status = 414;
+    goto error;
+
+bad_request:
+    req->error_status = 400;
+
+error:
+    req->pos = pos;
+    req->length = len;
+    return PARSE_ERROR;
+}
+
+/**
+ * @brief Hash a file extension, ignoring ASCII case (FNV-1a)
+ * @param ext Extension without the dot
+ * @param len Extension length
+ * @return unsigned Hash value
+ */
+unsigned mime_hash(const char* ext, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = ext[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Map an extension hash to a slot under a bucket's seed
+ * @param hash mime_hash() of the extension
+ * @param seed Bucket's seed
+ * @param mask Slot count minus one
+ * @return unsigned Slot index
+ */
+static inline unsigned mime_slot(unsigned hash, unsigned seed, unsigned mask) {
+    unsigned h = (hash ^ seed) * 0x9e3779b1u;
+    return (h ^ (h >> 16)) & mask;
+}
+
+/**
+ * @brief Build the perfect hash from a list of unique extensions
+ *
+ * Buckets are placed largest first, each trying seeds until all of its
+ * extensions land on free slots. With twice as many slots as extensions
+ * this takes a few tries per bucket.
+ *
+ * @param table Table to fill; any previous contents are leaked
+ * @param entries Extensions and types, no extension repeated
+ * @param count Number of entries
+ * @return int 0 on success, -1 if memory ran out or no seed was found
+ */
+int mime_table_build(MimeTable* table, const MimeEntry* entries, size_t count) {
+    unsigned slot_count = 16;
+    while (slot_count < count * 2) slot_count <<= 1;
+    unsigned mask = slot_count - 1;
+    unsigned bucket_count = 1;
+    while (bucket_count < count / 2) bucket_count <<= 1;
+
+    MimeSlot* slots = calloc(slot_count, sizeof(MimeSlot));
+    unsigned* seeds = calloc(bucket_count, sizeof(unsigned));
+    unsigned* hashes = malloc((count + 1) * sizeof(unsigned));
+    unsigned* order = malloc((count + 1) * sizeof(unsigned));
+    unsigned* sizes = calloc(bucket_count, sizeof(unsigned));
+    int ok = slots && seeds && hashes && order && sizes;
+
+    for (size_t i = 0; ok && i < count; i++) {
+        hashes[i] = mime_hash(entries[i].ext, strlen(entries[i].ext));
+        sizes[hashes[i] & (bucket_count - 1)]++;
+        order[i] = i;
+    }
+
+    // Entries sorted by descending bucket size, grouped by bucket
+    for (size_t i = 1; ok && i < count; i++) {
+        unsigned cur = order[i];
+        unsigned cur_bucket = hashes[cur] & (bucket_count - 1);
+        size_t j = i;
+        while (j > 0) {
+            unsigned prev_bucket = hashes[order[j - 1]] & (bucket_count - 1);
+            if (sizes[prev_bucket] > sizes[cur_bucket] ||
+                (sizes[prev_bucket] == sizes[cur_bucket] && prev_bucket <= cur_bucket)) {
+                break;
+            }
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = cur;
+    }
+
+    for (size_t start = 0; ok && start < count; ) {
+        unsigned bucket = hashes[order[start]] & (bucket_count - 1);
+        size_t end = start + sizes[bucket];
+        unsigned seed = 0;
+        for (; seed < 1u << 24; seed++) {
+            size_t placed = start;
+            for (; placed < end; placed++) {
+                unsigned i = order[placed];
+                MimeSlot* slot = &slots[mime_slot(hashes[i], seed, mask)];
+                if (slot->ext) break;
+                slot->ext = entries[i].ext;
+                slot->type = entries[i].type;
+                slot->hash = hashes[i];
+                slot->len = strlen(entries[i].ext);
+            }
+            if (placed == end) break;
+            // Undo the partial placement and try the next seed
+            for (size_t k = start; k < placed; k++) {
+                slots[mime_slot(hashes[order[k]], seed, mask)].ext = NULL;
+            }
+        }
+        if (seed == 1u << 24) ok = 0;
+        seeds[bucket] = seed;
+        start = end;
+    }
+
+    free(hashes);
+    free(order);
+    free(sizes);
+    if (!ok) {
+        free(slots);
+        free(seeds);
+        return -1;
+    }
+    table->slots = slots;
+    table->slot_mask = mask;
+    table->seeds = seeds;
+    table->bucket_mask = bucket_count - 1;
+    return 0;
+}
+
+/**
+ * @brief Add an extension to a growing list, replacing an earlier mapping
+ * @param list List to extend, reallocated as needed
+ * @param count Entries in @p list
+ * @param cap Capacity of @p list
+ * @param ext Extension without the dot
+ * @param type Content-Type
+ * @return int 0 on success, -1 if memory ran out
+ */
+int mime_list_add(MimeEntry** list, size_t* count, size_t* cap, const char* ext, const char* type) {
+    for (size_t i = 0; i < *count; i++) {
+        if (strcasecmp((*list)[i].ext, ext) == 0) {
+            (*list)[i].type = type;
+            return 0;
+        }
+    }
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        MimeEntry* grown = realloc(*list, new_cap * sizeof(MimeEntry));
+        if (!grown) return -1;
+        *list = grown;
+        *cap = new_cap;
+    }
+    (*list)[*count].ext = ext;
+    (*list)[*count].type = type;
+    (*count)++;
+    return 0;
+}
+
+/**
+ * @brief Build the MIME table from the built-in types and a mime.types file
+ *
+ * The file uses the usual format: a type followed by its extensions on
+ * each line, with # starting a comment. Its mappings take precedence over
+ * the built-in ones.
+ *
+ * @param path mime.types file, NULL for the built-in types only
+ * @return int 0 on success, -1 with errno set if the file cannot be read
+ */
+int mime_init(const char* path) {
+    MimeEntry* list = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    int ok = 1;
+
+    for (size_t i = 0; ok && i < sizeof(builtin_mime_types) / sizeof(builtin_mime_types[0]); i++) {
+        ok = mime_list_add(&list, &count, &cap, builtin_mime_types[i].ext,
+                           builtin_mime_types[i].type) == 0;
+    }
+
+    if (ok && path) {
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            free(list);
+            return -1;
+        }
+        char* line = NULL;
+        size_t line_cap = 0;
+        while (ok && getline(&line, &line_cap, file) > 0) {
+            char* hash = strchr(line, '#');
+            if (hash) *hash = '\0';
+            char* save;
+            char* type = strtok_r(line, " \t\r\n", &save);
+            if (!type) continue;
+            // Copies stay referenced by file entries for the process lifetime
+            char* type_copy = NULL;
+            char* ext;
+            while (ok && (ext = strtok_r(NULL, " \t\r\n", &save))) {
+                if (strlen(ext) >= MIME_EXT_MAX) continue;
+                if (!type_copy && !(type_copy = strdup(type))) ok = 0;
+                char* copy = ok ? strdup(ext) : NULL;
+                for (char* p = copy; p && *p; p++) {
+                    if (*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+                }
+                ok = copy && mime_list_add(&list, &count, &cap, copy, type_copy) == 0;
+            }
+        }
+        free(line);
+        fclose(file);
+    }
+
+    if (ok) ok = mime_table_build(&mime_table, list, count) == 0;
+    free(list);
+    if (!ok) errno = ENOMEM;
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Get MIME type based on file extension
+ *
+ * Names without an extension are taken as text; unknown extensions are
+ * sent as application/octet-stream.
+ *
+ * @param filename File name to check
+ * @return const char* MIME type string
+ */
+const char* get_mime_type(const char* filename) {
+    // One backward pass finds the extension and hashes it
+    const char* end = filename + strlen(filename);
+    const char* ext = end;
+    while (ext > filename && ext[-1] != '.' && ext[-1] != '/') ext--;
+    if (ext == filename || ext[-1] != '.') return "text/plain";
+
+    size_t len = end - ext;
+    if (!mime_table.slots) return "application/octet-stream";
+    unsigned hash = mime_hash(ext, len);
+    const MimeSlot* slot = &mime_table.slots[mime_slot(hash, mime_table.seeds[hash & mime_table.bucket_mask],
+                                                       mime_table.slot_mask)];
+    if (slot->hash != hash || slot->len != len) return "application/octet-stream";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = ext[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != (unsigned char)slot->ext[i]) return "application/octet-stream";
+    }
+    return slot->type;
+}
+
+/**
+ * @brief Check whether a content type is worth compressing
+ * @param mime_type Type from get_mime_type()
+ * @return int 1 for text-like types, 0 for already compressed formats
+ */
+int compressible_type(const char* mime_type) {
+    static const char* const types[] = {
+        "application/javascript", "application/json", "application/xml",
+        "application/wasm", "application/yaml", "application/toml",
+        "image/svg+xml", "image/bmp", "font/ttf", "font/otf",
+    };
+    if (strncmp(mime_type, "text/", 5) == 0) return 1;
+    size_t len = strlen(mime_type);
+    if ((len > 5 && strcmp(mime_type + len - 5, "+json") == 0) ||
+        (len > 4 && strcmp(mime_type + len - 4, "+xml") == 0)) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(mime_type, types[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find which encodings of a file may be compressed on the fly
+ *
+ * Generated bodies live only in the per-worker memory cache, so nothing
+ * is compressed when that cache is off or the fork engine is running.
+ *
+ * @param entry Identity entry
+ * @return unsigned Bit per encoding, 0 if the file is not eligible
+ */
+unsigned compress_encodings(const FileEntry* entry) {
+    if (!config.compress || config.engine == ENGINE_FORK ||
+        config.file_cache_entries == 0 || config.mem_cache_size == 0) {
+        return 0;
+    }
+    if (entry->size < config.compress_min_size || entry->size > COMPRESS_MAX_SOURCE ||
+        !compressible_type(entry->mime_type)) {
+        return 0;
+    }
+    return config.compress & ~entry->variants;
+}
+
+/**
+ * @brief Hash a resolved path (FNV-1a)
+ * @param path NUL-terminated path
+ * @return unsigned Hash value
+ */
+unsigned path_hash(const char* path) {
+    unsigned h = 2166136261u;
+    while (*path) {
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Build the path of the file holding one representation
+ * @param path Resolved path of the requested file
+ * @param encoding Representation
+ * @param out Receives the path, PATH_MAX bytes
+ * @return int 0 on success, -1 if the path is too long
+ */
+int encoded_path(const char* path, ContentEncoding encoding, char* out) {
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(encodings[encoding].suffix);
+    if (len + suffix_len >= PATH_MAX) return -1;
+    memcpy(out, path, len);
+    memcpy(out + len, encodings[encoding].suffix, suffix_len + 1);
+    return 0;
+}
+
+/**
+ * @brief Find which precompressed siblings of a file exist
+ * @param path Resolved path of the file
+ * @return unsigned Bit per encoding whose sibling is a regular file
+ */
+unsigned find_variants(const char* path) {
+    unsigned variants = 0;
+    for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+        char sibling[PATH_MAX];
+        struct stat st;
+        if (encoded_path(path, enc, sibling) == 0 && stat(sibling, &st) == 0 &&
+            S_ISREG(st.st_mode)) {
+            variants |= 1u << enc;
+        }
+    }
+    return variants;
+}
+
+/**
+ * @brief Format an unsigned integer in decimal, two digits per division
+ * @param buf Output of at least 20 bytes, not NUL-terminated
+ * @param value Value to format
+ * @return size_t Digits written
+ */
+size_t format_decimal(char* buf, unsigned long long value) {
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    while (value >= 100) {
+        unsigned pair = (unsigned)(value % 100);
+        value /= 100;
+        p -= 2;
+        memcpy(p, &decimal_pairs[pair * 2], 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &decimal_pairs[value * 2], 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+/**
+ * @brief Start assembling a response header
+ * @param h Builder to initialize
+ * @param buf Buffer to write into
+ * @param size Size of @p buf
+ */
+void header_init(HeaderBuf* h, char* buf, size_t size) {
+    h->pos = buf;
+    h->end = buf + size;
+}
+
+/**
+ * @brief Append bytes to a response header
+ * @param h Builder
+ * @param data Bytes to append
+ * @param len Number of bytes
+ */
+void header_put(HeaderBuf* h, const char* data, size_t len) {
+    size_t room = h->end - h->pos;
+    if (len > room) len = room;
+    memcpy(h->pos, data, len);
+    h->pos += len;
+}
+
+/**
+ * @brief Append a NUL-terminated string to a response header
+ * @param h Builder
+ * @param str String to append
+ */
+void header_put_str(HeaderBuf* h, const char* str) {
+    header_put(h, str, strlen(str));
+}
+
+/**
+ * @brief Append a number in decimal to a response header
+ * @param h Builder
+ * @param value Value to append
+ */
+void header_put_decimal(HeaderBuf* h, unsigned long long value) {
+    char digits[20];
+    header_put(h, digits, format_decimal(digits, value));
+}
+
+/**
+ * @brief Get the length of what has been assembled
+ * @param h Builder
+ * @param buf Buffer the builder was initialized with
+ * @return size_t Bytes written
+ */
+size_t header_len(const HeaderBuf* h, const char* buf) {
+    return h->pos - buf;
+}
+
+/**
+ * @brief Append a Content-Range value such as "0-499/1234"
+ * @param h Builder
+ * @param range Range being sent
+ * @param size Complete length of the file
+ */
+void header_put_content_range(HeaderBuf* h, ByteRange range, off_t size) {
+    header_put_decimal(h, range.start);
+    header_put_str(h, "-");
+    header_put_decimal(h, range.start + range.len - 1);
+    header_put_str(h, "/");
+    header_put_decimal(h, size);
+}
+
+/**
+ * @brief Format an entry's Last-Modified and 200 response header
+ * @param entry Entry with its metadata and @c etag filled in
+ */
+void file_entry_format_header(FileEntry* entry) {
+    struct tm tm;
+    gmtime_r(&entry->mtime.tv_sec, &tm);
+    strftime(entry->last_modified, sizeof(entry->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    HeaderBuf h;
+    header_init(&h, entry->header, sizeof(entry->header));
+    header_put(&h, status_lines[200].line, status_lines[200].len);
+    header_put_str(&h, "Content-Type: ");
+    header_put_str(&h, entry->mime_type);
+    header_put_str(&h, "\r\nContent-Length: ");
+    header_put_decimal(&h, entry->size);
+    header_put_str(&h, "\r\nAccept-Ranges: bytes\r\n");
+    entry->validators_off = header_len(&h, entry->header);
+    if (entry->encoding != ENC_IDENTITY) {
+        header_put_str(&h, "Content-Encoding: ");
+        header_put_str(&h, encodings[entry->encoding].token);
+        header_put_str(&h, "\r\n");
+    }
+    if (entry->encoding != ENC_IDENTITY || entry->variants || compress_encodings(entry)) {
+        header_put_str(&h, "Vary: Accept-Encoding\r\n");
+    }
+    header_put_str(&h, "ETag: ");
+    header_put(&h, entry->etag, entry->etag_len);
+    header_put_str(&h, "\r\nLast-Modified: ");
+    header_put_str(&h, entry->last_modified);
+    header_put_str(&h, "\r\n");
+    entry->header_len = header_len(&h, entry->header);
+}
+
+/**
+ * @brief Open a regular file and build its response header
+ *
+ * For the identity representation the precompressed siblings are looked
+ * up once here, so negotiation on later hits costs no syscalls.
+ *
+ * @param path Resolved path
+ * @param encoding Representation to open
+ * @param load Read the file into memory if it is small enough
+ * @return FileEntry* New entry holding one reference, NULL if the file
+ *         cannot be opened or is not a regular file
+ */
+FileEntry* file_entry_open(const char* path, ContentEncoding encoding, int load) {
+    char real_path[PATH_MAX];
+    if (encoded_path(path, encoding, real_path) < 0) {
+        return NULL;
+    }
+    // O_NONBLOCK keeps a FIFO in the document root from blocking the
+    // open until a writer shows up; it has no effect on regular files
+    int fd = open(real_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t path_len = strlen(path);
+    size_t body_len = 0;
+    if (load && config.mem_cache_size > 0 && st.st_size <= config.mem_cache_max_file) {
+        body_len = st.st_size;
+    } else {
+        load = 0;
+    }
+    FileEntry* entry = malloc(sizeof(FileEntry) + path_len + 1 + body_len);
+    if (!entry) {
+        close(fd);
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->body = NULL;
+    if (load) {
+        char* body = entry->path + path_len + 1;
+        size_t got = 0;
+        while (got < body_len) {
+            ssize_t n = pread(fd, body + got, body_len - got, got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        // A file that changed while being read is sent from its descriptor
+        if (got == body_len) {
+            entry->body = body;
+            entry->fd = -1;
+            close(fd);
+        }
+    }
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mime_type = get_mime_type(path);
+    entry->encoding = encoding;
+    entry->variants = encoding == ENC_IDENTITY ? find_variants(path) : 0;
+    entry->compressing = 0;
+    entry->generated = 0;
+    entry->source_size = st.st_size;
+
+    // A file changed within the last second could change again without
+    // its timestamp moving on coarse filesystems, so its tag is only weak
+    unsigned long long mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    int weak = time(NULL) - st.st_mtim.tv_sec < 1;
+    entry->etag_len = snprintf(entry->etag, sizeof(entry->etag), "%s\"%lx-%lx-%llx\"",
+                               weak ? "W/" : "", (unsigned long)st.st_ino,
+                               (unsigned long)st.st_size, mtime_ns);
+    file_entry_format_header(entry);
+    entry->refs = 1;
+    entry->cached = 0;
+    entry->wd = -1;
+    entry->dir_wd = -1;
+    entry->validated = 0;
+    entry->hash = 0;
+    entry->hash_next = NULL;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+    memcpy(entry->path, path, path_len + 1);
+    return entry;
+}
+
+/**
+ * @brief Drop a reference to a file entry, closing it with the last one
+ * @param entry Entry to release
+ */
+void file_entry_release(FileEntry* entry) {
+    if (--entry->refs == 0) {
+        if (entry->fd >= 0) close(entry->fd);
+        free(entry);
+    }
+}
+
+/**
+ * @brief Set up an empty file cache
+ * @param cache Cache to initialize
+ * @param capacity Most entries to keep open, 0 disables the cache
+ */
+void file_cache_init(FileCache* cache, int capacity) {
+    memset(cache, 0, sizeof(*cache));
+    cache->inotify_fd = -1;
+    if (capacity <= 0) return;
+
+    unsigned buckets = 16;
+    while (buckets < (unsigned)capacity * 2) buckets <<= 1;
+    cache->buckets = calloc(buckets, sizeof(FileEntry*));
+    if (!cache->buckets) {
+        perror("calloc failed");
+        return;
+    }
+    cache->bucket_mask = buckets - 1;
+
+    if (config.file_cache_revalidate == 0) {
+        cache->watches[0] = calloc(buckets, sizeof(FileEntry*));
+        cache->watches[1] = calloc(buckets, sizeof(FileEntry*));
+        if (cache->watches[0] && cache->watches[1]) {
+            cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        if (cache->inotify_fd < 0) {
+            perror("inotify_init1 failed, revalidating cached files every second");
+        }
+    }
+}
+
+/**
+ * @brief Add a cached entry to the watch table chain of one of its watches
+ * @param cache Worker's file cache
+ * @param entry Entry being inserted
+ * @param kind 0 for the file's @c wd, 1 for the directory's @c dir_wd
+ */
+void file_cache_link_watch(FileCache* cache, FileEntry* entry, int kind) {
+    int wd = kind ? entry->dir_wd : entry->wd;
+    WatchLink* link = &entry->watch_links[kind];
+    link->pprev = NULL;
+    if (wd < 0 || !cache->watches[kind]) return;
+
+    FileEntry** head = &cache->watches[kind][wd & cache->bucket_mask];
+    link->next = *head;
+    link->pprev = head;
+    if (*head) (*head)->watch_links[kind].pprev = &link->next;
+    *head = entry;
+}
+
+/**
+ * @brief Take an entry out of a watch table chain
+ * @param entry Entry being evicted
+ * @param kind 0 for the file's @c wd, 1 for the directory's @c dir_wd
+ */
+void file_cache_unlink_watch(FileEntry* entry, int kind) {
+    WatchLink* link = &entry->watch_links[kind];
+    if (!link->pprev) return;
+    *link->pprev = link->next;
+    if (link->next) link->next->watch_links[kind].pprev = link->pprev;
+    link->pprev = NULL;
+}
+
+/**
+ * @brief Remove an inotify watch unless a cached entry still uses it
+ *
+ * Hard links, encodings of one file and files in one directory share
+ * watches.
+ *
+ * @param cache Worker's file cache
+ * @param wd Watch descriptor, ignored if negative
+ */
+void file_cache_unwatch(FileCache* cache, int wd) {
+    if (wd < 0) return;
+    for (int kind = 0; kind < 2; kind++) {
+        FileEntry* other = cache->watches[kind][wd & cache->bucket_mask];
+        for (; other; other = other->watch_links[kind].next) {
+            if ((kind ? other->dir_wd : other->wd) == wd) return;
+        }
+    }
+    inotify_rm_watch(cache->inotify_fd, wd);
+}
+
+/**
+ * @brief Remove an entry from the cache's table and LRU list
+ *
+ * Connections still sending the file keep it open until they finish.
+ *
+ * @param cache Cache holding the entry
+ * @param entry Entry to evict
+ */
+void file_cache_evict(FileCache* cache, FileEntry* entry) {
+    FileEntry** link = &cache->buckets[entry->hash & cache->bucket_mask];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+
+    file_cache_unlink_watch(entry, 0);
+    file_cache_unlink_watch(entry, 1);
+    file_cache_unwatch(cache, entry->wd);
+    file_cache_unwatch(cache, entry->dir_wd);
+
+    __atomic_store_n(&cache->count, cache->count - 1, __ATOMIC_RELAXED);
+    if (entry->body) {
+        __atomic_store_n(&cache->mem_bytes, cache->mem_bytes - entry->size, __ATOMIC_RELAXED);
+    }
+    entry->cached = 0;
+    file_entry_release(entry);
+}
+
+/**
+ * @brief Check a cached entry against the file currently at its path
+ * @param entry Cached entry
+ * @return int 1 if the file is unchanged, 0 if it changed or disappeared
+ */
+int file_entry_current(const FileEntry* entry) {
+    char real_path[PATH_MAX];
+    struct stat st;
+    if (encoded_path(entry->path, entry->encoding, real_path) < 0) return 0;
+    if (stat(real_path, &st) < 0) return 0;
+    if (entry->encoding == ENC_IDENTITY && find_variants(entry->path) != entry->variants) {
+        return 0;
+    }
+    return st.st_dev == entry->dev && st.st_ino == entry->ino &&
+           st.st_size == entry->size &&
+           st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+           st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/**
+ * @brief Watch a cached entry's file, and for the identity representation
+ *        its directory so precompressed siblings appearing are noticed
+ * @param cache Worker's file cache with inotify available
+ * @param entry New entry
+ * @return int 0 on success, -1 if the file cannot be watched
+ */
+int file_cache_watch(FileCache* cache, FileEntry* entry) {
+    char real_path[PATH_MAX];
+    if (encoded_path(entry->path, entry->encoding, real_path) < 0) return -1;
+    entry->wd = inotify_add_watch(cache->inotify_fd, real_path,
+                                  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (entry->wd < 0) return -1;
+    if (entry->encoding != ENC_IDENTITY) return 0;
+
+    char dir[PATH_MAX];
+    const char* slash = strrchr(entry->path, '/');
+    size_t dir_len = slash ? (size_t)(slash - entry->path) : 0;
+    if (dir_len == 0) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, entry->path, dir_len);
+        dir[dir_len] = '\0';
+    }
+    entry->dir_wd = inotify_add_watch(cache->inotify_fd, dir,
+                                      IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+    return entry->dir_wd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Check whether a directory event names a precompressed sibling
+ * @param entry Identity entry in the directory
+ * @param name File name from the event
+ * @return int 1 if @p name is the file's name plus an encoding suffix
+ */
+int is_sibling_name(const FileEntry* entry, const char* name) {
+    const char* slash = strrchr(entry->path, '/');
+    const char* base = slash ? slash + 1 : entry->path;
+    size_t base_len = strlen(base);
+    if (strncmp(name, base, base_len) != 0) return 0;
+    for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+        if (strcmp(name + base_len, encodings[enc].suffix) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find a cached representation without touching the filesystem
+ * @param cache Worker's file cache, with its table allocated
+ * @param path Resolved path
+ * @param encoding Representation wanted
+ * @return FileEntry* Cached entry, no reference taken, NULL if absent
+ */
+FileEntry* file_cache_find(FileCache* cache, const char* path, ContentEncoding encoding) {
+    unsigned hash = path_hash(path) + encoding;
+    FileEntry* entry = cache->buckets[hash & cache->bucket_mask];
+    while (entry && (entry->hash != hash || entry->encoding != encoding ||
+                     strcmp(entry->path, path) != 0)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/**
+ * @brief Count a hit and move the entry to the front of the LRU list
+ * @param cache Cache holding the entry
+ * @param entry Entry being returned to a caller
+ */
+void file_cache_touch(FileCache* cache, FileEntry* entry) {
+    __atomic_store_n(&cache->hits, cache->hits + 1, __ATOMIC_RELAXED);
+    if (cache->lru_head != entry) {
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+        else cache->lru_tail = entry->lru_prev;
+        entry->lru_prev = NULL;
+        entry->lru_next = cache->lru_head;
+        cache->lru_head->lru_prev = entry;
+        cache->lru_head = entry;
+    }
+}
+
+/**
+ * @brief Add a new entry to the cache, evicting least recently used ones
+ *        to stay within the entry and memory limits
+ * @param cache Worker's file cache
+ * @param entry Uncached entry; the cache takes over one reference
+ * @param now Current monotonic seconds
+ */
+void file_cache_insert(FileCache* cache, FileEntry* entry, time_t now) {
+    unsigned hash = path_hash(entry->path) + entry->encoding;
+    long mem = entry->body ? entry->size : 0;
+    while (cache->lru_tail && (cache->count >= config.file_cache_entries ||
+                               cache->mem_bytes + mem > config.mem_cache_size)) {
+        file_cache_evict(cache, cache->lru_tail);
+    }
+    entry->hash = hash;
+    entry->validated = now;
+    entry->cached = 1;
+    entry->hash_next = cache->buckets[hash & cache->bucket_mask];
+    cache->buckets[hash & cache->bucket_mask] = entry;
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    else cache->lru_tail = entry;
+    cache->lru_head = entry;
+    file_cache_link_watch(cache, entry, 0);
+    file_cache_link_watch(cache, entry, 1);
+    __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->mem_bytes, cache->mem_bytes + mem, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Watch and cache a freshly opened entry
+ *
+ * Connections that missed on the same file each open it in the pool, so
+ * the file may have been cached while this copy was opened; the cached
+ * entry is kept and this one dropped.
+ *
+ * @param cache Worker's file cache
+ * @param entry Uncached entry holding one reference for the caller
+ * @param now Current monotonic seconds
+ * @return FileEntry* @p entry or the entry already cached for its file,
+ *         holding the caller's reference
+ */
+FileEntry* file_cache_adopt(FileCache* cache, FileEntry* entry, time_t now) {
+    if (!cache->buckets) return entry;
+
+    FileEntry* cached = file_cache_find(cache, entry->path, entry->encoding);
+    // A body compressed on the fly gives way to a sibling, as in file_cache_get()
+    if (cached && cached->generated) {
+        file_cache_evict(cache, cached);
+    } else if (cached) {
+        file_entry_release(entry);
+        cached->refs++;
+        return cached;
+    }
+
+    // The watch is in place before the entry is shared, so no change is
+    // missed; a file that cannot be watched is served uncached
+    if (cache->inotify_fd >= 0 && file_cache_watch(cache, entry) < 0) {
+        file_cache_unwatch(cache, entry->wd);
+        entry->wd = -1;
+        return entry;
+    }
+
+    entry->refs++;
+    file_cache_insert(cache, entry, now);
+    return entry;
+}
+
+/**
+ * @brief Look up a file, opening and caching it on a miss
+ * @param cache Worker's file cache
+ * @param path Resolved path
+ * @param encoding Representation wanted
+ * @param now Current monotonic seconds
+ * @return FileEntry* Entry with a reference held for the caller, NULL if
+ *         the file cannot be served
+ */
+FileEntry* file_cache_get(FileCache* cache, const char* path, ContentEncoding encoding, time_t now) {
+    if (!cache->buckets) {
+        return file_entry_open(path, encoding, 0);
+    }
+
+    FileEntry* entry = file_cache_find(cache, path, encoding);
+
+    // A body compressed on the fly gives way to a sibling that appeared
+    if (entry && entry->generated) {
+        file_cache_evict(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry) {
+        int interval = config.file_cache_revalidate;
+        if (cache->inotify_fd < 0 && interval == 0) interval = 1;
+        if (interval > 0 && now - entry->validated >= interval) {
+            if (!file_entry_current(entry)) {
+                file_cache_evict(cache, entry);
+                return file_cache_get(cache, path, encoding, now);
+            }
+            entry->validated = now;
+        }
+        // A tag made weak because the file had only just changed is
+        // rebuilt once the file has been still for a second, or If-Range
+        // would never match on this worker
+        if (entry->etag[0] == 'W' && time(NULL) - entry->mtime.tv_sec >= 1) {
+            file_cache_evict(cache, entry);
+            return file_cache_get(cache, path, encoding, now);
+        }
+        file_cache_touch(cache, entry);
+        entry->refs++;
+        return entry;
+    }
+
+    __atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+    entry = file_entry_open(path, encoding, 1);
+    if (!entry) return NULL;
+    return file_cache_adopt(cache, entry, now);
+}
+
+/**
+ * @brief Evict the entries named by pending inotify events
+ *
+ * Replacing a file by rename() shows up as IN_ATTRIB on the old inode,
+ * since its link count drops. Directory events evict a file when one of
+ * its precompressed siblings is created or removed.
+ *
+ * @param cache Worker's file cache
+ */
+void file_cache_drain(FileCache* cache) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(cache->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return;
+        }
+
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->wd < 0) continue;
+
+            // Only the chains for the event's watch descriptor are walked
+            FileEntry* entry = cache->watches[0][ev->wd & cache->bucket_mask];
+            while (entry) {
+                FileEntry* next = entry->watch_links[0].next;
+                if (entry->wd == ev->wd) {
+                    if (ev->mask & IN_IGNORED) entry->wd = -1;
+                    file_cache_evict(cache, entry);
+                }
+                entry = next;
+            }
+            entry = cache->watches[1][ev->wd & cache->bucket_mask];
+            while (entry) {
+                FileEntry* next = entry->watch_links[1].next;
+                if (entry->dir_wd == ev->wd &&
+                    ((ev->mask & IN_IGNORED) ||
+                     (ev->len > 0 && is_sibling_name(entry, ev->name)))) {
+                    if (ev->mask & IN_IGNORED) entry->dir_wd = -1;
+                    file_cache_evict(cache, entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Push a task onto a worker's deque
+ *
+ * Called only by the owning worker.
+ *
+ * @param deque Worker's deque
+ * @param task Task to queue
+ * @return int 0 on success, -1 if the deque is full
+ */
+int task_deque_push(TaskDeque* deque, Task* task) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_DEQUE_SIZE) return -1;
+    __atomic_store_n(&deque->tasks[bottom & (TASK_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Steal the oldest task from a deque
+ * @param deque Deque of some worker
+ * @return Task* Stolen task, NULL if the deque was empty or another
+ *         thread won the race for the task
+ */
+Task* task_deque_steal(TaskDeque* deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    // The slot cannot be reused until top moves past it, so the task read
+    // here is the one the compare-and-swap claims
+    Task* task = __atomic_load_n(&deque->tasks[top & (TASK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * @brief Hand a task to the thread pool
+ * @param worker Submitting worker, which will run the completion
+ * @param task Task with @c run and @c complete set
+ * @return int 0 on success, -1 if the worker's deque is full
+ */
+int task_submit(Worker* worker, Task* task) {
+    task->worker = worker;
+    task->next = NULL;
+    if (task_deque_push(&worker->tasks, task) < 0) return -1;
+    sem_post(&task_pool.ready);
+    return 0;
+}
+
+/**
+ * @brief Return a finished task to its worker
+ *
+ * Only the push that finds the stack empty writes the eventfd; the worker
+ * takes the whole stack at once, so later pushes ride on that wakeup.
+ *
+ * @param task Task whose @c run has returned
+ */
+void task_finish(Task* task) {
+    Worker* worker = task->worker;
+    Task* head = __atomic_load_n(&worker->tasks_done, __ATOMIC_RELAXED);
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(&worker->tasks_done, &head, task, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        uint64_t one = 1;
+        while (write(worker->task_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+}
+
+/**
+ * @brief Pool thread: steal tasks from the workers' deques and run them
+ * @param arg Index of the thread, used to spread the first victim
+ * @return void* Never returns
+ */
+void* pool_main(void* arg) {
+    int victim = (int)(intptr_t)arg;
+    while (1) {
+        // Every post matches one pushed task, so a task is waiting somewhere
+        while (sem_wait(&task_pool.ready) < 0 && errno == EINTR) {}
+
+        Task* task = NULL;
+        while (!task) {
+            victim = (victim + 1) % task_pool.worker_count;
+            task = task_deque_steal(&task_pool.workers[victim].tasks);
+        }
+        task->run(task);
+        task_finish(task);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the thread pool over a set of workers
+ * @param workers Worker array whose deques the threads steal from
+ * @param worker_count Number of workers
+ * @param threads Number of pool threads
+ */
+void pool_start(Worker* workers, int worker_count, int threads) {
+    task_pool.workers = workers;
+    task_pool.worker_count = worker_count;
+    if (sem_init(&task_pool.ready, 0, 0) < 0) {
+        perror("sem_init failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, pool_main, (void*)(intptr_t)i);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * @brief Run the completions of every task the pool has finished
+ * @param worker Worker whose eventfd fired
+ */
+void task_collect(Worker* worker) {
+    uint64_t count;
+    while (read(worker->task_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+
+    // The stack is newest first; reverse it to complete in finishing order
+    Task* task = __atomic_exchange_n(&worker->tasks_done, NULL, __ATOMIC_ACQUIRE);
+    Task* ordered = NULL;
+    while (task) {
+        Task* next = task->next;
+        task->next = ordered;
+        ordered = task;
+        task = next;
+    }
+    while (ordered) {
+        Task* next = ordered->next;
+        ordered->complete(ordered);
+        ordered = next;
+    }
+}
+
+/**
+ * @brief Worst-case compressed size of a buffer
+ * @param encoding ENC_GZIP or ENC_ZSTD
+ * @param len Input length
+ * @return size_t Output capacity that always suffices
+ */
+size_t compress_bound(ContentEncoding encoding, size_t len) {
+#ifdef HAVE_ZSTD
+    if (encoding == ENC_ZSTD) return ZSTD_compressBound(len);
+#endif
+    // Stored deflate blocks plus the gzip header and trailer
+    (void)encoding;
+    return len + len / 1000 + 64;
+}
+
+/**
+ * @brief Compress a buffer in one shot at the highest useful level
+ *
+ * Runs on a compressor thread and the result is reused until the file
+ * changes, so compression ratio is worth more than speed here.
+ *
+ * @param encoding ENC_GZIP or ENC_ZSTD
+ * @param src Input
+ * @param len Input length
+ * @param dst Output, at least compress_bound() bytes
+ * @param cap Output capacity
+ * @return size_t Compressed length, 0 on failure or unsupported encoding
+ */
+size_t compress_buffer(ContentEncoding encoding, const char* src, size_t len,
+                       char* dst, size_t cap) {
+#ifdef HAVE_ZLIB
+    if (encoding == ENC_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // Window bits plus 16 selects the gzip wrapper
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        zs.next_in = (Bytef*)src;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*)dst;
+        zs.avail_out = cap;
+        int rc = deflate(&zs, Z_FINISH);
+        size_t out = zs.total_out;
+        deflateEnd(&zs);
+        return rc == Z_STREAM_END ? out : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (encoding == ENC_ZSTD) {
+        size_t out = ZSTD_compress(dst, cap, src, len, 19);
+        return ZSTD_isError(out) ? 0 : out;
+    }
+#endif
+    (void)encoding; (void)src; (void)len; (void)dst; (void)cap;
+    return 0;
+}
+
+/**
+ * @brief Build the in-memory entry for one compression job
+ * @param job Job taken from the queue
+ * @return FileEntry* Uncached entry holding one reference, NULL if the
+ *         file changed, cannot be read or does not get smaller
+ */
+FileEntry* compress_file(const CompressJob* job) {
+    // The path may have been replaced by a FIFO since the job was queued
+    int fd = open(job->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_dev != job->dev || st.st_ino != job->ino ||
+        st.st_size != job->size || st.st_mtim.tv_sec != job->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != job->mtime.tv_nsec) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = job->size;
+    char* src = malloc(len ? len : 1);
+    size_t got = 0;
+    while (src && got < len) {
+        ssize_t n = pread(fd, src + got, len - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    if (!src || got != len) {
+        free(src);
+        return NULL;
+    }
+
+    // Compress straight into the entry's allocation, then give back the slack
+    size_t path_len = strlen(job->path);
+    size_t cap = compress_bound(job->encoding, len);
+    FileEntry* entry = malloc(sizeof(FileEntry) + path_len + 1 + cap);
+    size_t out = entry ? compress_buffer(job->encoding, src, len,
+                                         entry->path + path_len + 1, cap) : 0;
+    free(src);
+    if (out == 0 || out >= len) {
+        free(entry);
+        return NULL;
+    }
+    FileEntry* shrunk = realloc(entry, sizeof(FileEntry) + path_len + 1 + out);
+    if (shrunk) entry = shrunk;
+
+    entry->fd = -1;
+    entry->body = entry->path + path_len + 1;
+    entry->size = out;
+    entry->mtime = job->mtime;
+    entry->dev = job->dev;
+    entry->ino = job->ino;
+    entry->mime_type = job->mime_type;
+    entry->encoding = job->encoding;
+    entry->variants = 0;
+    entry->compressing = 0;
+    entry->generated = 1;
+    entry->source_size = job->size;
+    // The identity tag with the coding appended, keeping any W/ prefix
+    entry->etag_len = snprintf(entry->etag, sizeof(entry->etag), "%.*s-%s\"",
+                               (int)job->etag_len - 1, job->etag,
+                               encodings[job->encoding].token);
+    file_entry_format_header(entry);
+    entry->refs = 1;
+    entry->cached = 0;
+    entry->wd = -1;
+    entry->dir_wd = -1;
+    entry->validated = 0;
+    entry->hash = 0;
+    entry->hash_next = NULL;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+    memcpy(entry->path, job->path, path_len + 1);
+    return entry;
+}
+
+/**
+ * @brief Check that a generated entry was compressed from a file's
+ *        current contents
+ * @param variant Generated entry
+ * @param file Identity entry
+ * @return int 1 if @p variant is still a valid encoding of @p file
+ */
+int compressed_from(const FileEntry* variant, const FileEntry* file) {
+    return variant->dev == file->dev && variant->ino == file->ino &&
+           variant->source_size == file->size &&
+           variant->mtime.tv_sec == file->mtime.tv_sec &&
+           variant->mtime.tv_nsec == file->mtime.tv_nsec;
+}
+
+/**
+ * @brief Put a finished compression into the worker's file cache
+ *
+ * A result replaces an older generated body of the same file, but never
+ * a precompressed sibling or one whose source has since changed.
+ *
+ * @param worker Worker that requested the compression
+ * @param entry Generated entry holding one reference, handed to the cache
+ */
+void compress_install(Worker* worker, FileEntry* entry) {
+    FileCache* cache = &worker->files;
+    FileEntry* file = file_cache_find(cache, entry->path, ENC_IDENTITY);
+    FileEntry* old = file_cache_find(cache, entry->path, entry->encoding);
+    if ((file && !compressed_from(entry, file)) || (old && !old->generated) ||
+        entry->size > config.mem_cache_size) {
+        file_entry_release(entry);
+        return;
+    }
+    // Cleared so the body is compressed again if it is evicted
+    if (file) file->compressing &= ~(1u << entry->encoding);
+    if (old) file_cache_evict(cache, old);
+    file_cache_insert(cache, entry, worker->now);
+}
+
+/**
+ * @brief Pool task body of a compression job
+ * @param task Embedded task of a CompressJob
+ */
+void compress_task_run(Task* task) {
+    CompressJob* job = (CompressJob*)task;
+    job->result = compress_file(job);
+}
+
+/**
+ * @brief Cache a compression job's result on its worker
+ * @param task Embedded task of a CompressJob
+ */
+void compress_task_complete(Task* task) {
+    CompressJob* job = (CompressJob*)task;
+    if (job->result) compress_install(task->worker, job->result);
+    free(job);
+}
+
+/**
+ * @brief Compressor thread: run queued jobs and hand results to workers
+ * @param arg Unused
+ * @return void* Never returns
+ */
+void* compressor_main(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&compress_queue.lock);
+        while (!compress_queue.head) {
+            pthread_cond_wait(&compress_queue.ready, &compress_queue.lock);
+        }
+        CompressJob* job = compress_queue.head;
+        compress_queue.head = job->next;
+        if (!compress_queue.head) compress_queue.tail = NULL;
+        compress_queue.length--;
+        pthread_mutex_unlock(&compress_queue.lock);
+
+        FileEntry* entry = compress_file(job);
+        if (entry) {
+            // Push onto the worker's stack; it collects on its next lookup
+            Worker* worker = job->worker;
+            FileEntry* head = __atomic_load_n(&worker->compressed, __ATOMIC_RELAXED);
+            do {
+                entry->hash_next = head;
+            } while (!__atomic_compare_exchange_n(&worker->compressed, &head, entry, 1,
+                                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the background compressor threads
+ * @param count Number of threads
+ */
+void compress_start(int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, compressor_main, NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/**
+ * @brief Queue an identity entry's file for compression
+ * @param worker Worker that will cache the result
+ * @param file Identity entry
+ * @param encoding Encoding to produce
+ * @return int 0 if queued, -1 if the queue is full or memory ran out
+ */
+int compress_submit(Worker* worker, const FileEntry* file, ContentEncoding encoding) {
+    size_t path_len = strlen(file->path);
+    CompressJob* job = malloc(sizeof(CompressJob) + path_len + 1);
+    if (!job) return -1;
+    job->next = NULL;
+    job->worker = worker;
+    job->encoding = encoding;
+    job->size = file->size;
+    job->mtime = file->mtime;
+    job->dev = file->dev;
+    job->ino = file->ino;
+    job->mime_type = file->mime_type;
+    memcpy(job->etag, file->etag, file->etag_len + 1);
+    job->etag_len = file->etag_len;
+    memcpy(job->path, file->path, path_len + 1);
+
+    // The pool engine's threads do the work instead of compressor threads
+    if (config.engine == ENGINE_POOL) {
+        job->task.run = compress_task_run;
+        job->task.complete = compress_task_complete;
+        job->result = NULL;
+        if (task_submit(worker, &job->task) < 0) {
+            free(job);
+            return -1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&compress_queue.lock);
+    if (compress_queue.length >= COMPRESS_QUEUE_MAX) {
+        pthread_mutex_unlock(&compress_queue.lock);
+        free(job);
+        return -1;
+    }
+    if (compress_queue.tail) compress_queue.tail->next = job;
+    else compress_queue.head = job;
+    compress_queue.tail = job;
+    compress_queue.length++;
+    pthread_cond_signal(&compress_queue.ready);
+    pthread_mutex_unlock(&compress_queue.lock);
+    return 0;
+}
+
+/**
+ * @brief Move finished compressions into the worker's file cache
+ * @param worker Worker whose stack to drain
+ */
+void compress_collect(Worker* worker) {
+    if (!__atomic_load_n(&worker->compressed, __ATOMIC_RELAXED)) return;
+
+    FileEntry* entry = __atomic_exchange_n(&worker->compressed, NULL, __ATOMIC_ACQUIRE);
+    while (entry) {
+        FileEntry* next = entry->hash_next;
+        entry->hash_next = NULL;
+        compress_install(worker, entry);
+        entry = next;
+    }
+}
+
+/**
+ * @brief Get a body compressed on the fly, requesting one if none is ready
+ *
+ * The first requests for a file are answered uncompressed while a
+ * compressor thread works, so a slow compression never holds up the
+ * event loop or the client.
+ *
+ * @param worker Current worker
+ * @param file Cached identity entry
+ * @param encoding Encoding wanted, one of compress_encodings(@p file)
+ * @return FileEntry* Entry with a reference held for the caller, NULL if
+ *         not available yet
+ */
+FileEntry* compressed_variant(Worker* worker, FileEntry* file, ContentEncoding encoding) {
+    FileCache* cache = &worker->files;
+    compress_collect(worker);
+
+    FileEntry* variant = file_cache_find(cache, file->path, encoding);
+    if (variant && variant->generated) {
+        if (compressed_from(variant, file)) {
+            file_cache_touch(cache, variant);
+            variant->refs++;
+            return variant;
+        }
+        file_cache_evict(cache, variant);
+    }
+
+    // A file that did not compress keeps its bit, so it is tried only once
+    // per identity entry
+    if (!(file->compressing & (1u << encoding)) && file->cached &&
+        compress_submit(worker, file, encoding) == 0) {
+        file->compressing |= 1u << encoding;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Point an arena at its inline space
+ * @param arena Arena to initialize
+ * @param space Inline space
+ * @param size Bytes of @p space
+ */
+void arena_init(Arena* arena, char* space, size_t size) {
+    arena->base = space;
+    arena->base_size = size;
+    arena->ptr = space;
+    arena->end = space + size;
+    arena->blocks = NULL;
+}
+
+/**
+ * @brief Allocate request-lifetime memory from an arena
+ *
+ * Blocks of ARENA_BLOCK_SIZE come from the pool's free list when it has
+ * one; a larger allocation gets a block of its own that is freed on reset.
+ *
+ * @param arena Arena to allocate from
+ * @param pool Pool supplying overflow blocks, NULL to use malloc
+ * @param size Bytes wanted
+ * @return void* Memory aligned for any type, NULL if out of memory
+ */
+void* arena_alloc(Arena* arena, ConnPool* pool, size_t size) {
+    size_t align = __alignof__(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    if (size > (size_t)(arena->end - arena->ptr)) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = NULL;
+        if (pool && block_size == ARENA_BLOCK_SIZE && pool->blocks) {
+            block = pool->blocks;
+            pool->blocks = block->next;
+        } else {
+            block = malloc(sizeof(ArenaBlock) + block_size);
+            if (!block) return NULL;
+            block->size = block_size;
+            if (pool && block_size == ARENA_BLOCK_SIZE) pool->block_count++;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->ptr = block->data;
+        arena->end = block->data + block->size;
+    }
+    void* mem = arena->ptr;
+    arena->ptr += size;
+    return mem;
+}
+
+/**
+ * @brief Release everything allocated from an arena at once
+ * @param arena Arena to rewind to its inline space
+ * @param pool Pool taking back the overflow blocks, NULL to free them
+ */
+void arena_reset(Arena* arena, ConnPool* pool) {
+    while (arena->blocks) {
+        ArenaBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        if (pool && block->size == ARENA_BLOCK_SIZE) {
+            block->next = pool->blocks;
+            pool->blocks = block;
+        } else {
+            free(block);
+        }
+    }
+    arena->ptr = arena->base;
+    arena->end = arena->base + arena->base_size;
+}
+
+/**
+ * @brief Allocate memory that lives until the connection's next request
+ * @param conn Client connection
+ * @param size Bytes wanted
+ * @return void* Memory from the connection's arena, NULL if out of memory
+ */
+void* conn_alloc(Connection* conn, size_t size) {
+    return arena_alloc(&conn->arena, conn->worker ? &conn->worker->conns : NULL, size);
+}
+
+/**
+ * @brief Take a connection object from a worker's pool
+ * @param pool Worker's pool, grown by a slab when empty
+ * @return Connection* Uninitialized connection, NULL if out of memory
+ */
+Connection* conn_pool_get(ConnPool* pool) {
+    if (!pool->free) {
+        Connection* slab = malloc(CONN_SLAB * sizeof(Connection));
+        if (!slab) return NULL;
+        for (int i = CONN_SLAB - 1; i >= 0; i--) {
+            slab[i].pool_next = pool->free;
+            pool->free = &slab[i];
+        }
+        pool->capacity += CONN_SLAB;
+    }
+    Connection* conn = pool->free;
+    pool->free = conn->pool_next;
+    pool->in_use++;
+    if (pool->in_use > pool->high_water) pool->high_water = pool->in_use;
+    return conn;
+}
+
+/**
+ * @brief Return a closed connection to its worker's pool
+ * @param pool Worker's pool
+ * @param conn Connection, whose arena blocks go back to the pool too
+ */
+void conn_pool_put(ConnPool* pool, Connection* conn) {
+    arena_reset(&conn->arena, pool);
+    conn->pool_next = pool->free;
+    pool->free = conn;
+    pool->in_use--;
+}
+
+/**
+ * @brief Map a chunk to carve buffers from, on huge pages where available
+ *
+ * Reserved hugetlb pages are tried first; otherwise the chunk is aligned
+ * to 2MB and offered to transparent huge pages.
+ *
+ * @param pool Pool the chunk is for
+ * @return char* Chunk of BUFFER_CHUNK_SIZE bytes, NULL if out of memory
+ */
+char* buffer_chunk_map(BufferPool* pool) {
+    char* chunk = mmap(NULL, BUFFER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (chunk != MAP_FAILED) {
+        pool->huge_chunks++;
+    } else {
+        char* region = mmap(NULL, 2 * BUFFER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) return NULL;
+        chunk = (char*)(((uintptr_t)region + BUFFER_CHUNK_SIZE - 1) &
+                        ~(uintptr_t)(BUFFER_CHUNK_SIZE - 1));
+        // Trim the mapping down to the aligned chunk
+        if (chunk > region) munmap(region, chunk - region);
+        if (chunk < region + BUFFER_CHUNK_SIZE) {
+            munmap(chunk + BUFFER_CHUNK_SIZE, region + BUFFER_CHUNK_SIZE - chunk);
+        }
+        madvise(chunk, BUFFER_CHUNK_SIZE, MADV_HUGEPAGE);
+    }
+    pool->chunks++;
+    return chunk;
+}
+
+/**
+ * @brief Take a buffer of one size class
+ * @param pool Worker's pool, NULL to use malloc (fork engine)
+ * @param class Index into config.buffer_sizes
+ * @return char* Buffer, NULL if out of memory
+ */
+char* buffer_get(BufferPool* pool, int class) {
+    size_t size = config.buffer_sizes[class];
+    if (!pool) return malloc(size);
+
+    char* buf = pool->free[class];
+    if (buf) {
+        memcpy(&pool->free[class], buf, sizeof(char*));
+    } else {
+        // Carved sizes are rounded to cache lines so buffers never share one
+        size_t carved = (size + 63) & ~(size_t)63;
+        if (!pool->carve || (size_t)(pool->carve_end - pool->carve) < carved) {
+            char* chunk = buffer_chunk_map(pool);
+            if (!chunk) return NULL;
+            pool->carve = chunk;
+            pool->carve_end = chunk + BUFFER_CHUNK_SIZE;
+        }
+        buf = pool->carve;
+        pool->carve += carved;
+        pool->capacity[class]++;
+    }
+    pool->in_use[class]++;
+    if (pool->in_use[class] > pool->high_water[class]) {
+        pool->high_water[class] = pool->in_use[class];
+    }
+    return buf;
+}
+
+/**
+ * @brief Return a buffer taken with buffer_get()
+ * @param pool Pool it came from, NULL if it was malloc'd
+ * @param class Size class it was taken with
+ * @param buf Buffer
+ */
+void buffer_put(BufferPool* pool, int class, char* buf) {
+    if (!pool) {
+        free(buf);
+        return;
+    }
+    memcpy(buf, &pool->free[class], sizeof(char*));
+    pool->free[class] = buf;
+    pool->in_use[class]--;
+}
+
+/**
+ * @brief Get the buffer pool a connection draws from
+ * @param conn Client connection
+ * @return BufferPool* Owning worker's pool, NULL in the fork engine
+ */
+BufferPool* conn_buffers(Connection* conn) {
+    return conn->worker ? &conn->worker->buffers : NULL;
+}
+
+/**
+ * @brief Make room to receive into, taking or growing the input buffer
+ *
+ * A connection reads into the smallest class first. A full buffer moves
+ * up a class at a time while the header limit allows a longer request.
+ *
+ * @param conn Client connection
+ * @return size_t Bytes that can be appended to @c in, 0 if none
+ */
+size_t conn_in_room(Connection* conn) {
+    BufferPool* pool = conn_buffers(conn);
+    if (!conn->in) {
+        conn->in = buffer_get(pool, 0);
+        if (!conn->in) return 0;
+        conn->in_class = 0;
+        conn->in_size = config.buffer_sizes[0];
+        conn->in[0] = '\0';
+    }
+    if (conn->in_len == conn->in_size - 1 && conn->in_class < config.buffer_classes - 1 &&
+        conn->in_len < (size_t)config.max_header_size) {
+        char* bigger = buffer_get(pool, conn->in_class + 1);
+        if (bigger) {
+            memcpy(bigger, conn->in, conn->in_len + 1);
+            buffer_put(pool, conn->in_class, conn->in);
+            conn->in = bigger;
+            conn->in_class++;
+            conn->in_size = config.buffer_sizes[conn->in_class];
+        }
+    }
+    return conn->in_size - 1 - conn->in_len;
+}
+
+/**
+ * @brief Make sure the connection holds an output buffer
+ * @param conn Client connection
+ * @return int 0 on success, -1 if out of memory
+ */
+int conn_out_buffer(Connection* conn) {
+    if (conn->out) return 0;
+    conn->out = buffer_get(conn_buffers(conn), config.buffer_classes - 1);
+    return conn->out ? 0 : -1;
+}
+
+/**
+ * @brief Return the connection's buffers to the pool when they are empty
+ *
+ * The output buffer is kept while a file body is being sent or an
+ * io_uring send may still read from it.
+ *
+ * @param conn Client connection
+ * @param closing Return both buffers regardless of their contents
+ */
+void conn_release_buffers(Connection* conn, int closing) {
+    BufferPool* pool = conn_buffers(conn);
+    if (conn->in && (closing || conn->in_len == 0)) {
+        buffer_put(pool, conn->in_class, conn->in);
+        conn->in = NULL;
+    }
+    if (conn->out && (closing || (conn->out_len == 0 && !conn->file && conn->chain_pending == 0))) {
+        buffer_put(pool, config.buffer_classes - 1, conn->out);
+        conn->out = NULL;
+    }
+}
+
+/**
+ * @brief Pool task body of a file open
+ * @param task Embedded task of an OpenTask
+ */
+void open_task_run(Task* task) {
+    OpenTask* open = (OpenTask*)task;
+    open->entry = file_entry_open(open->path, open->encoding, 1);
+    // Start reading a file sent from its descriptor, so the loop's first
+    // sends are less likely to wait on the disk
+    if (open->entry && open->entry->fd >= 0) {
+        posix_fadvise(open->entry->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief Release the entries a finished open still holds
+ * @param open Finished open
+ */
+void open_task_release(OpenTask* open) {
+    if (open->entry && !open->taken) file_entry_release(open->entry);
+    if (open->held) file_entry_release(open->held);
+    open->entry = NULL;
+    open->held = NULL;
+}
+
+/**
+ * @brief Drop the finished open a resumed request is done with
+ * @param conn Client connection
+ */
+void conn_release_opened(Connection* conn) {
+    if (!conn->opened) return;
+    open_task_release(conn->opened);
+    conn->opened = NULL;
+}
+
+/**
+ * @brief Queue the connection that waited for an open to be resumed
+ * @param task Embedded task of an OpenTask
+ */
+void open_task_complete(Task* task) {
+    OpenTask* open = (OpenTask*)task;
+    Connection* conn = open->conn;
+    if (conn->state == CONN_CLOSING) {
+        // The connection closed meanwhile and stayed out of the pool
+        // because the task lived in its arena
+        open_task_release(open);
+        conn->opening = NULL;
+        conn_pool_put(&task->worker->conns, conn);
+        return;
+    }
+    conn->opening = NULL;
+    conn->opened = open;
+    conn->resume_next = task->worker->resume_head;
+    task->worker->resume_head = conn;
+}
+
+/**
+ * @brief Get a file for a response, handing the open to the pool on a
+ *        cache miss under the pool engine
+ *
+ * When the open is handed off this returns NULL with @c conn->opening set;
+ * the request is processed again once it finishes and then picks up the
+ * result here. Only the lookup that asked for the open takes its result;
+ * one made earlier in the request gets back the entry it had before the
+ * request suspended, so a resume repeats no lookups. A request hands off
+ * at most two opens, for the identity file and a sibling, and opens
+ * anything further in place.
+ *
+ * @param conn Client connection
+ * @param path Resolved path
+ * @param encoding Representation wanted
+ * @return FileEntry* Entry with a reference held for the caller, NULL if
+ *         the file cannot be served or the open is in flight
+ */
+FileEntry* conn_open_file(Connection* conn, const char* path, ContentEncoding encoding) {
+    Worker* worker = conn->worker;
+    if (!worker) return file_entry_open(path, encoding, 0);
+    FileCache* cache = &worker->files;
+
+    OpenTask* open = conn->opened;
+    if (open) {
+        FileEntry* held = open->held;
+        if (held && held->encoding == encoding && strcmp(held->path, path) == 0) {
+            open->held = NULL;
+            return held;
+        }
+        if (!open->taken && open->encoding == encoding && strcmp(open->path, path) == 0) {
+            open->taken = 1;
+            return open->entry ? file_cache_adopt(cache, open->entry, worker->now) : NULL;
+        }
+    }
+
+    if (config.engine != ENGINE_POOL || conn->offloads >= POOL_OPENS_MAX ||
+        (cache->buckets && file_cache_find(cache, path, encoding))) {
+        return file_cache_get(cache, path, encoding, worker->now);
+    }
+
+    size_t path_len = strlen(path);
+    open = conn_alloc(conn, sizeof(OpenTask) + path_len + 1);
+    if (!open) return file_cache_get(cache, path, encoding, worker->now);
+    open->task.run = open_task_run;
+    open->task.complete = open_task_complete;
+    open->conn = conn;
+    open->encoding = encoding;
+    open->entry = NULL;
+    open->taken = 0;
+    open->held = NULL;
+    memcpy(open->path, path, path_len + 1);
+    if (task_submit(worker, &open->task) < 0) {
+        return file_cache_get(cache, path, encoding, worker->now);
+    }
+    conn_release_opened(conn);
+    __atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+    conn->opening = open;
+    conn->offloads++;
+    return NULL;
+}
+
+/**
+ * @brief Initialize connection state for a freshly accepted socket
+ * @param conn Connection to initialize
+ * @param worker Owning worker, NULL if none
+ * @param fd Client socket descriptor
+ * @param addr Client address information
+ */
+void conn_init(Connection* conn, Worker* worker, int fd, struct sockaddr_in* addr) {
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->worker = worker;
+    conn->addr = *addr;
+    conn->in = NULL;
+    conn->in_len = 0;
+    conn->in_size = 0;
+    conn->in_class = 0;
+    http_request_reset(&conn->req);
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_size = config.buffer_sizes[config.buffer_classes - 1];
+    conn->out_sent = 0;
+    conn->file_fd = -1;
+    conn->file = NULL;
+    conn->body = NULL;
+    conn->ranges = NULL;
+    conn->range_count = 0;
+    conn->range_next = 0;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    conn->pipe_len = 0;
+    conn->keep_alive = 1;
+    conn->h2 = NULL;
+    conn->head = 0;
+    conn->requests = 0;
+    conn->readable = 1;
+    conn->peer_closed = 0;
+    conn->body_remaining = 0;
+    conn->timer.next = NULL;
+    conn->timer.pprev = NULL;
+    conn->timer_requests = 0;
+    conn->request_start = 0;
+    conn->status = 0;
+    conn->body_bytes = 0;
+    conn->pending_ops = 0;
+    conn->recv_armed = 0;
+    conn->chain_pending = 0;
+    conn->chain_failed = 0;
+    conn->read_len = 0;
+    conn->opening = NULL;
+    conn->opened = NULL;
+    conn->offloads = 0;
+    conn->resume_next = NULL;
+    arena_init(&conn->arena, conn->arena_space, sizeof(conn->arena_space));
+    conn->held_count = 0;
+}
+
+/**
+ * @brief Append bytes to the connection's pending response
+ * @param conn Client connection
+ * @param data Bytes to queue
+ * @param len Number of bytes
+ * @return int 0 on success, -1 if the output buffer is full
+ */
+int conn_queue(Connection* conn, const char* data, size_t len) {
+    if (len > conn->out_size - conn->out_len || conn_out_buffer(conn) < 0) {
+        return -1;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+/**
+ * @brief Create the connection's splice() pipe if it does not exist yet
+ * @param conn Client connection
+ * @return int 0 on success, -1 on error
+ */
+int conn_open_pipe(Connection* conn) {
+    if (conn->pipe_fds[0] >= 0) return 0;
+    return pipe2(conn->pipe_fds, O_CLOEXEC);
+}
+
+/**
+ * @brief Move file body bytes to the socket through the splice() pipe
+ *
+ * The pipe is refilled from the file only once it has been fully drained,
+ * so a chunk never exceeds its capacity and the file-side splice cannot block.
+ *
+ * @param conn Client connection with a file body
+ * @return ssize_t Bytes moved to the socket, -1 on error (errno set)
+ */
+ssize_t conn_splice_body(Connection* conn) {
+    if (conn_open_pipe(conn) < 0) return -1;
+
+    if (conn->pipe_len == 0) {
+        size_t chunk = conn->file_remaining < PIPE_CHUNK ? conn->file_remaining : PIPE_CHUNK;
+        ssize_t n = splice(conn->file_fd, &conn->file_offset, conn->pipe_fds[1], NULL,
+                           chunk, SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n == 0) errno = EIO; // File shrank under us
+            return -1;
+        }
+        conn->file_remaining -= n;
+        conn->pipe_len = n;
+    }
+
+    // Like MSG_MORE in conn_flush(): the final chunk is pushed at once
+    unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+    if (conn->file_remaining > 0) flags |= SPLICE_F_MORE;
+    ssize_t n = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->pipe_len, flags);
+    if (n > 0) conn->pipe_len -= n;
+    return n;
+}
+
+/**
+ * @brief Stop sending the current file body and drop its entry
+ * @param conn Client connection
+ */
+void conn_release_file(Connection* conn) {
+    if (conn->file) {
+        file_entry_release(conn->file);
+        conn->file = NULL;
+    }
+    conn->file_fd = -1;
+    conn->body = NULL;
+    conn->range_count = 0;
+}
+
+/**
+ * @brief Describe the unsent headers and in-memory body of a response
+ * @param conn Client connection with an in-memory body
+ * @param iov Receives the output buffer and body segments
+ * @return size_t Total bytes described
+ */
+size_t conn_body_iov(Connection* conn, struct iovec iov[2]) {
+    iov[0].iov_base = conn->out + conn->out_sent;
+    iov[0].iov_len = conn->out_len - conn->out_sent;
+    iov[1].iov_base = (char*)conn->body + conn->file_offset;
+    iov[1].iov_len = conn->file_remaining;
+    return iov[0].iov_len + iov[1].iov_len;
+}
+
+/**
+ * @brief Count bytes written to a client socket
+ * @param conn Client connection
+ * @param n Bytes written
+ */
+void conn_count_sent(Connection* conn, size_t n) {
+    if (conn->worker) conn->worker->metrics.bytes_sent += n;
+}
+
+/**
+ * @brief Account bytes written from the output buffer and in-memory body
+ * @param conn Client connection
+ * @param n Bytes written, output buffer first
+ */
+void conn_sent(Connection* conn, size_t n) {
+    size_t head = conn->out_len - conn->out_sent;
+    conn_count_sent(conn, n);
+    if (n <= head) {
+        conn->out_sent += n;
+        return;
+    }
+    conn->out_sent = conn->out_len;
+    conn->file_offset += n - head;
+    conn->file_remaining -= n - head;
+}
+
+/**
+ * @brief Format the header preceding one part of a multipart/byteranges body
+ * @param buf Output buffer
+ * @param size Size of @p buf
+ * @param file File being served
+ * @param range Range the part carries
+ * @return int Header length
+ */
+int format_part_header(char* buf, size_t size, const FileEntry* file, ByteRange range) {
+    HeaderBuf h;
+    header_init(&h, buf, size);
+    header_put_str(&h, "\r\n--");
+    header_put_str(&h, range_boundary);
+    header_put_str(&h, "\r\nContent-Type: ");
+    header_put_str(&h, file->mime_type);
+    header_put_str(&h, "\r\nContent-Range: bytes ");
+    header_put_content_range(&h, range, file->size);
+    header_put_str(&h, "\r\n\r\n");
+    return header_len(&h, buf);
+}
+
+/**
+ * @brief Format the closing boundary of a multipart/byteranges body
+ * @param buf Output buffer
+ * @param size Size of @p buf
+ * @return int Trailer length
+ */
+int format_part_trailer(char* buf, size_t size) {
+    HeaderBuf h;
+    header_init(&h, buf, size);
+    header_put_str(&h, "\r\n--");
+    header_put_str(&h, range_boundary);
+    header_put_str(&h, "--\r\n");
+    return header_len(&h, buf);
+}
+
+/** Huffman code of each octet and of EOS (256), right-aligned (RFC 7541 appendix B) */
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+/** Length in bits of each code in huffman_codes */
+static const unsigned char huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/**
+ * Huffman decoding tree built by hpack_init(): the two children of each
+ * internal node, a positive value naming another node and -1 - symbol a leaf
+ */
+static short huffman_tree[256][2];
+
+/** Entries in the HPACK static table */
+#define HPACK_STATIC_COUNT 61
+
+/** HPACK static table (RFC 7541 appendix A), indexed from 1 */
+static const struct {
+    const char* name;   /**< Field name */
+    const char* value;  /**< Field value, empty if only the name is indexed */
+} hpack_static[HPACK_STATIC_COUNT + 1] = {
+    { "", "" },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/**
+ * @brief Build the Huffman decoding tree from the code table
+ *
+ * Called once at startup, before any worker decodes a header block.
+ */
+void hpack_init(void) {
+    int nodes = 1;
+    for (int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for (int bit = huffman_lengths[sym] - 1; bit > 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (!huffman_tree[node][b]) huffman_tree[node][b] = nodes++;
+            node = huffman_tree[node][b];
+        }
+        huffman_tree[node][huffman_codes[sym] & 1] = -1 - sym;
+    }
+}
+
+/**
+ * @brief Decode a Huffman-coded HPACK string
+ * @param src Coded bytes
+ * @param len Length of @p src
+ * @param dst Output buffer
+ * @param size Size of @p dst
+ * @return long Decoded length, -1 if the code is invalid, -2 if it does not fit
+ */
+long huffman_decode(const unsigned char* src, size_t len, char* dst, size_t size) {
+    size_t n = 0;
+    int node = 0;
+    int depth = 0;  // Bits read since the last symbol
+    int ones = 1;   // All of them were 1s
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (src[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            ones &= b;
+            if (next >= 0) {
+                node = next;
+                continue;
+            }
+            if (next == -1 - 256) return -1; // EOS must not appear in a string
+            if (n == size) return -2;
+            dst[n++] = (char)(-1 - next);
+            node = 0;
+            depth = 0;
+            ones = 1;
+        }
+    }
+    // Padding is a prefix of EOS: fewer than 8 bits, all 1s
+    if (depth > 7 || !ones) return -1;
+    return n;
+}
+
+/**
+ * @brief Decode an HPACK integer (RFC 7541 section 5.1)
+ * @param p Cursor into the header block, advanced past the integer
+ * @param end End of the header block
+ * @param prefix Bits of the first byte holding the integer
+ * @param value Receives the integer
+ * @return int 0 on success, -1 if truncated or too large
+ */
+int hpack_decode_int(const unsigned char** p, const unsigned char* end, int prefix, uint32_t* value) {
+    if (*p >= end) return -1;
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t v = *(*p)++ & max;
+    if (v == max) {
+        int shift = 0;
+        unsigned char b;
+        do {
+            if (*p >= end || shift > 21) return -1;
+            b = *(*p)++;
+            v += (uint32_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+/**
+ * @brief Decode an HPACK string literal (RFC 7541 section 5.2)
+ * @param p Cursor into the header block, advanced past the string
+ * @param end End of the header block
+ * @param dst Output buffer
+ * @param size Size of @p dst
+ * @return long String length, -1 if malformed, -2 if it does not fit
+ */
+long hpack_decode_string(const unsigned char** p, const unsigned char* end, char* dst, size_t size) {
+    if (*p >= end) return -1;
+    int huffman = **p & 0x80;
+    uint32_t len;
+    if (hpack_decode_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p)) return -1;
+    const unsigned char* src = *p;
+    *p += len;
+    if (huffman) return huffman_decode(src, len, dst, size);
+    if (len > size) return -2;
+    memcpy(dst, src, len);
+    return len;
+}
+
+/**
+ * @brief Empty an HPACK dynamic table and give it the default size limit
+ * @param table Table to reset
+ */
+void hpack_table_init(HpackTable* table) {
+    table->data_len = 0;
+    table->count = 0;
+    table->size = 0;
+    table->max_size = H2_TABLE_SIZE;
+}
+
+/**
+ * @brief Evict the oldest entries until a table fits a size
+ * @param table Dynamic table
+ * @param limit Size the table must not exceed
+ */
+void hpack_table_evict(HpackTable* table, size_t limit) {
+    int drop = 0;
+    size_t bytes = 0;
+    while (table->size > limit) {
+        size_t len = table->entries[drop].name_len + table->entries[drop].value_len;
+        table->size -= len + 32;
+        bytes += len;
+        drop++;
+    }
+    if (drop == 0) return;
+
+    table->data_len -= bytes;
+    memmove(table->data, table->data + bytes, table->data_len);
+    table->count -= drop;
+    memmove(table->entries, table->entries + drop, table->count * sizeof(table->entries[0]));
+    for (int i = 0; i < table->count; i++) table->entries[i].off -= bytes;
+}
+
+/**
+ * @brief Insert a header field into a dynamic table, evicting as needed
+ *
+ * A field larger than the whole table empties it, as RFC 7541 section
+ * 4.4 requires. The name and value must not point into the table.
+ *
+ * @param table Dynamic table
+ * @param name Field name
+ * @param name_len Length of @p name
+ * @param value Field value
+ * @param value_len Length of @p value
+ */
+void hpack_table_add(HpackTable* table, const char* name, size_t name_len,
+                     const char* value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    if (size > table->max_size) {
+        hpack_table_evict(table, 0);
+        return;
+    }
+    hpack_table_evict(table, table->max_size - size);
+
+    table->entries[table->count].off = table->data_len;
+    table->entries[table->count].name_len = name_len;
+    table->entries[table->count].value_len = value_len;
+    table->count++;
+    memcpy(table->data + table->data_len, name, name_len);
+    memcpy(table->data + table->data_len + name_len, value, value_len);
+    table->data_len += name_len + value_len;
+    table->size += size;
+}
+
+/**
+ * @brief Change a dynamic table's size limit
+ * @param table Dynamic table
+ * @param max_size New limit
+ */
+void hpack_table_resize(HpackTable* table, size_t max_size) {
+    hpack_table_evict(table, max_size);
+    table->max_size = max_size;
+}
+
+/**
+ * @brief Look up an index in the static table and a dynamic table
+ * @param table Dynamic table, whose index 1 is HPACK_STATIC_COUNT + 1
+ * @param index HPACK index
+ * @param name Receives the field name
+ * @param name_len Receives the length of @p name
+ * @param value Receives the field value
+ * @param value_len Receives the length of @p value
+ * @return int 0 on success, -1 if no entry has the index
+ */
+int hpack_lookup(const HpackTable* table, uint32_t index, const char** name, size_t* name_len,
+                 const char** value, size_t* value_len) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = hpack_static[index].name;
+        *name_len = strlen(*name);
+        *value = hpack_static[index].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT;
+    if (index > (uint32_t)table->count) return -1;
+    int i = table->count - index;
+    *name = table->data + table->entries[i].off;
+    *name_len = table->entries[i].name_len;
+    *value = *name + *name_len;
+    *value_len = table->entries[i].value_len;
+    return 0;
+}
+
+/**
+ * @brief Decode one header field representation
+ *
+ * Literal fields are decoded into @p field, the name followed by the
+ * value, and added to the table when the representation asks for it; a
+ * field too large for @p field still updates the table like RFC 7541
+ * requires, so the block can be decoded to the end.
+ *
+ * @param table Dynamic table of the block's sender
+ * @param p Cursor into the header block, advanced past the field
+ * @param end End of the header block
+ * @param field Buffer of H2_TABLE_SIZE bytes for literal fields
+ * @param name Receives the field name
+ * @param name_len Receives the length of @p name
+ * @param value Receives the field value
+ * @param value_len Receives the length of @p value
+ * @return int 0 on success, 1 if the field is too large, -1 on a compression error
+ */
+int hpack_decode_field(HpackTable* table, const unsigned char** p, const unsigned char* end,
+                       char* field, const char** name, size_t* name_len,
+                       const char** value, size_t* value_len) {
+    unsigned char first = **p;
+    uint32_t index;
+
+    if (first & 0x80) {
+        if (hpack_decode_int(p, end, 7, &index) < 0) return -1;
+        return hpack_lookup(table, index, name, name_len, value, value_len);
+    }
+
+    // Literal with incremental indexing (01), without indexing (0000) or
+    // never indexed (0001)
+    int indexing = (first & 0xc0) == 0x40;
+    if (hpack_decode_int(p, end, indexing ? 6 : 4, &index) < 0) return -1;
+
+    long len;
+    if (index > 0) {
+        const char* indexed;
+        const char* unused;
+        size_t unused_len;
+        if (hpack_lookup(table, index, &indexed, name_len, &unused, &unused_len) < 0) return -1;
+        // Copied, since adding the field may evict the entry it names
+        memcpy(field, indexed, *name_len);
+    } else {
+        len = hpack_decode_string(p, end, field, H2_TABLE_SIZE);
+        if (len == -1) return -1;
+        if (len == -2) {
+            if (hpack_decode_string(p, end, field, 0) == -1) return -1;
+            if (indexing) hpack_table_evict(table, 0);
+            return 1;
+        }
+        *name_len = len;
+    }
+
+    len = hpack_decode_string(p, end, field + *name_len, H2_TABLE_SIZE - *name_len);
+    if (len == -1) return -1;
+    if (len == -2) {
+        if (indexing) hpack_table_evict(table, 0);
+        return 1;
+    }
+    *name = field;
+    *value = field + *name_len;
+    *value_len = len;
+    if (indexing) hpack_table_add(table, field, *name_len, field + *name_len, len);
+    return 0;
+}
+
+/**
+ * @brief Encode an HPACK integer
+ * @param p Output position
+ * @param first Bits of the first byte above the prefix
+ * @param prefix Bits of the first byte holding the integer
+ * @param value Integer to encode
+ * @return unsigned char* Position after the integer
+ */
+unsigned char* hpack_put_int(unsigned char* p, unsigned char first, int prefix, uint32_t value) {
+    uint32_t max = (1u << prefix) - 1;
+    if (value < max) {
+        *p++ = first | value;
+        return p;
+    }
+    *p++ = first | max;
+    value -= max;
+    while (value >= 0x80) {
+        *p++ = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+/**
+ * @brief Encode a string literal without Huffman coding
+ * @param p Output position
+ * @param str String
+ * @param len Length of @p str
+ * @return unsigned char* Position after the string
+ */
+unsigned char* hpack_put_string(unsigned char* p, const char* str, size_t len) {
+    p = hpack_put_int(p, 0, 7, len);
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/**
+ * @brief Encode a response header field
+ *
+ * A field already in the static or dynamic table is sent as its index.
+ * Otherwise the field is sent literally, naming a table entry where one
+ * has the name, and added to the dynamic table, except for Content-Range
+ * whose value is particular to one response.
+ *
+ * @param table Our dynamic table
+ * @param p Output position, with room for the field plus eight bytes
+ * @param name Lowercase field name
+ * @param name_len Length of @p name
+ * @param value Field value
+ * @param value_len Length of @p value
+ * @return unsigned char* Position after the field
+ */
+unsigned char* hpack_encode_field(HpackTable* table, unsigned char* p, const char* name, size_t name_len,
+                                  const char* value, size_t value_len) {
+    uint32_t name_index = 0;
+
+    for (int i = table->count - 1; i >= 0; i--) {
+        const char* entry = table->data + table->entries[i].off;
+        if (table->entries[i].name_len != name_len || memcmp(entry, name, name_len) != 0) continue;
+        uint32_t index = HPACK_STATIC_COUNT + table->count - i;
+        if (table->entries[i].value_len == value_len &&
+            memcmp(entry + name_len, value, value_len) == 0) {
+            return hpack_put_int(p, 0x80, 7, index);
+        }
+        if (!name_index) name_index = index;
+    }
+    for (uint32_t i = 1; i <= HPACK_STATIC_COUNT; i++) {
+        if (strlen(hpack_static[i].name) != name_len ||
+            memcmp(hpack_static[i].name, name, name_len) != 0) {
+            continue;
+        }
+        if (strlen(hpack_static[i].value) == value_len &&
+            memcmp(hpack_static[i].value, value, value_len) == 0) {
+            return hpack_put_int(p, 0x80, 7, i);
+        }
+        name_index = i;
+        break;
+    }
+
+    int indexing = !(name_len == 13 && memcmp(name, "content-range", 13) == 0);
+    p = indexing ? hpack_put_int(p, 0x40, 6, name_index) : hpack_put_int(p, 0x00, 4, name_index);
+    if (!name_index) p = hpack_put_string(p, name, name_len);
+    p = hpack_put_string(p, value, value_len);
+    if (indexing) hpack_table_add(table, name, name_len, value, value_len);
+    return p;
+}
+
+/**
+ * @brief Take an HTTP/2 session from a worker's pool
+ * @param pool Worker's pool, NULL to allocate
+ * @return H2Session* Uninitialized session, NULL if out of memory
+ */
+H2Session* h2_session_get(ConnPool* pool) {
+    if (pool && pool->sessions) {
+        H2Session* s = pool->sessions;
+        pool->sessions = s->pool_next;
+        return s;
+    }
+    H2Session* s = malloc(sizeof(H2Session));
+    if (s && pool) pool->session_count++;
+    return s;
+}
+
+/**
+ * @brief Return an HTTP/2 session to a worker's pool
+ * @param pool Worker's pool, NULL to free the session
+ * @param s Session
+ */
+void h2_session_put(ConnPool* pool, H2Session* s) {
+    if (!pool) {
+        free(s);
+        return;
+    }
+    s->pool_next = pool->sessions;
+    pool->sessions = s;
+}
+
+/**
+ * @brief Prepare a session for a connection that just sent the preface
+ * @param s Session
+ */
+void h2_session_init(H2Session* s) {
+    s->free = NULL;
+    for (int i = H2_MAX_STREAMS - 1; i >= 0; i--) {
+        s->streams[i].id = 0;
+        s->streams[i].file = NULL;
+        s->streams[i].next = s->free;
+        s->free = &s->streams[i];
+    }
+    s->sending = NULL;
+    s->sending_tail = NULL;
+    s->stream_count = 0;
+    s->last_stream_id = 0;
+    s->window = H2_WINDOW_DEFAULT;
+    s->initial_window = H2_WINDOW_DEFAULT;
+    s->recv_unacked = 0;
+    s->recv_stream = 0;
+    s->recv_stream_unacked = 0;
+    s->settings_seen = 0;
+    s->draining = 0;
+    s->goaway_sent = 0;
+    s->failed = 0;
+    s->frame_open = 0;
+    s->block_stream = 0;
+    s->block_len = 0;
+    hpack_table_init(&s->decoder);
+    hpack_table_init(&s->encoder);
+    s->encoder_resized = 0;
+}
+
+/**
+ * @brief Open a stream for a request
+ * @param s Session with a free stream slot
+ * @param id Stream identifier
+ * @return H2Stream* Stream with nothing queued
+ */
+H2Stream* h2_stream_open(H2Session* s, uint32_t id) {
+    H2Stream* st = s->free;
+    s->free = st->next;
+    st->id = id;
+    st->window = s->initial_window;
+    st->file = NULL;
+    st->offset = 0;
+    st->remaining = 0;
+    st->range_count = 0;
+    st->range_next = 0;
+    st->pending_len = 0;
+    st->pending_sent = 0;
+    st->next = NULL;
+    s->stream_count++;
+    return st;
+}
+
+/**
+ * @brief Free a stream that is not on the send queue
+ * @param s Session
+ * @param st Stream
+ */
+void h2_stream_close(H2Session* s, H2Stream* st) {
+    if (st->file) {
+        file_entry_release(st->file);
+        st->file = NULL;
+    }
+    st->id = 0;
+    st->next = s->free;
+    s->free = st;
+    s->stream_count--;
+}
+
+/**
+ * @brief Append a stream to the end of the send queue
+ * @param s Session
+ * @param st Stream with body left to send
+ */
+void h2_sending_push(H2Session* s, H2Stream* st) {
+    st->next = NULL;
+    if (s->sending_tail) {
+        s->sending_tail->next = st;
+    } else {
+        s->sending = st;
+    }
+    s->sending_tail = st;
+}
+
+/**
+ * @brief Find a stream on the send queue
+ *
+ * Streams are answered as soon as their request header block arrives, so
+ * every open stream is on the queue.
+ *
+ * @param s Session
+ * @param id Stream identifier
+ * @param prev Receives the stream before it, NULL if it is first
+ * @return H2Stream* Stream, NULL if it is not open
+ */
+H2Stream* h2_stream_find(H2Session* s, uint32_t id, H2Stream** prev) {
+    *prev = NULL;
+    for (H2Stream* st = s->sending; st; st = st->next) {
+        if (st->id == id) return st;
+        *prev = st;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Take a stream off the send queue and free it
+ * @param s Session
+ * @param st Stream
+ * @param prev Stream before it on the queue, NULL if it is first
+ */
+void h2_stream_remove(H2Session* s, H2Stream* st, H2Stream* prev) {
+    if (prev) {
+        prev->next = st->next;
+    } else {
+        s->sending = st->next;
+    }
+    if (s->sending_tail == st) s->sending_tail = prev;
+    h2_stream_close(s, st);
+}
+
+/**
+ * @brief Store a 31 or 32-bit value in network byte order
+ * @param p Output position
+ * @param value Value
+ */
+void h2_put32(unsigned char* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * @brief Load a 32-bit value in network byte order
+ * @param p Input position
+ * @return uint32_t Value
+ */
+uint32_t h2_get32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Format a frame header
+ * @param p Output position, H2_FRAME_HEADER bytes
+ * @param len Payload length
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param stream Stream identifier, 0 for the connection
+ */
+void h2_put_frame_header(unsigned char* p, size_t len, int type, int flags, uint32_t stream) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p + 5, stream);
+}
+
+/**
+ * @brief Append a whole frame to the output buffer
+ * @param conn HTTP/2 connection with no file body attached
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param stream Stream identifier, 0 for the connection
+ * @param payload Frame payload
+ * @param len Length of @p payload
+ * @return int 0 on success, -1 if the output buffer is full
+ */
+int h2_queue_frame(Connection* conn, int type, int flags, uint32_t stream,
+                   const unsigned char* payload, size_t len) {
+    unsigned char header[H2_FRAME_HEADER];
+    if (H2_FRAME_HEADER + len > conn->out_size - conn->out_len) return -1;
+    h2_put_frame_header(header, len, type, flags, stream);
+    if (conn_queue(conn, (const char*)header, sizeof(header)) < 0) return -1;
+    return conn_queue(conn, (const char*)payload, len);
+}
+
+/**
+ * @brief Queue an RST_STREAM frame
+ * @param conn HTTP/2 connection
+ * @param stream Stream to reset
+ * @param code Error code
+ */
+void h2_queue_rst(Connection* conn, uint32_t stream, H2Error code) {
+    unsigned char payload[4];
+    h2_put32(payload, code);
+    h2_queue_frame(conn, H2_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+/**
+ * @brief Queue a GOAWAY frame naming the last stream that will be answered
+ * @param conn HTTP/2 connection
+ * @param code Error code
+ */
+void h2_queue_goaway(Connection* conn, H2Error code) {
+    unsigned char payload[8];
+    h2_put32(payload, conn->h2->last_stream_id);
+    h2_put32(payload + 4, code);
+    h2_queue_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    conn->h2->goaway_sent = 1;
+}
+
+/**
+ * @brief Queue a WINDOW_UPDATE frame
+ * @param conn HTTP/2 connection
+ * @param stream Stream, 0 for the connection
+ * @param increment Bytes the client may send in addition
+ * @return int 0 on success, -1 if the output buffer is full
+ */
+int h2_queue_window_update(Connection* conn, uint32_t stream, uint32_t increment) {
+    unsigned char payload[4];
+    h2_put32(payload, increment);
+    return h2_queue_frame(conn, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+/**
+ * @brief Move a stream on to the next part of a multipart/byteranges body
+ * @param st Stream whose pending bytes and current range are all framed
+ * @return int 1 if more of the body follows, 0 if it is complete
+ */
+int h2_stream_next_part(H2Stream* st) {
+    if (st->range_count == 0) return 0;
+
+    st->pending_sent = 0;
+    if (st->range_next < st->range_count) {
+        ByteRange range = st->ranges[st->range_next++];
+        st->pending_len = format_part_header(st->pending, sizeof(st->pending), st->file, range);
+        st->offset = range.start;
+        st->remaining = range.len;
+        return 1;
+    }
+    st->pending_len = format_part_trailer(st->pending, sizeof(st->pending));
+    st->range_count = 0;
+    return 1;
+}
+
+/**
+ * @brief Queue the next DATA frame of a stream's response
+ *
+ * Pending bytes and in-memory bodies are copied behind the frame header.
+ * A body sent from a file descriptor becomes the connection's file body
+ * for the length of the frame, so sendfile() or splice() carry it.
+ *
+ * @param conn HTTP/2 connection with no file body attached
+ * @param st Stream with body left to send
+ * @return int -1 if flow control or the output buffer holds the stream back,
+ *         0 if a frame was queued, 1 if its payload was attached as the file body
+ */
+int h2_stream_frame(Connection* conn, H2Stream* st) {
+    H2Session* s = conn->h2;
+    if (st->pending_sent == st->pending_len && st->remaining == 0) h2_stream_next_part(st);
+
+    size_t room = conn->out_size - conn->out_len;
+    long limit = s->window < st->window ? s->window : st->window;
+    if (limit > H2_FRAME_MAX) limit = H2_FRAME_MAX;
+    if (limit <= 0 || room <= H2_FRAME_HEADER || conn_out_buffer(conn) < 0) return -1;
+    room -= H2_FRAME_HEADER;
+
+    size_t pending = st->pending_len - st->pending_sent;
+    size_t copy = pending;
+    if (copy > (size_t)limit) copy = limit;
+    if (copy > room) copy = room;
+    size_t file = 0;
+    if (copy == pending && st->remaining > 0) {
+        file = limit - copy;
+        if (st->file->body && file > room - copy) file = room - copy;
+        if ((off_t)file > st->remaining) file = st->remaining;
+    }
+    size_t len = copy + file;
+    if (len == 0) return -1;
+
+    int last = copy == pending && (off_t)file == st->remaining && st->range_count == 0;
+    unsigned char* frame = (unsigned char*)conn->out + conn->out_len;
+    h2_put_frame_header(frame, len, H2_DATA, last ? H2_FLAG_END_STREAM : 0, st->id);
+    memcpy(frame + H2_FRAME_HEADER, st->pending + st->pending_sent, copy);
+    conn->out_len += H2_FRAME_HEADER + copy;
+    st->pending_sent += copy;
+    s->window -= len;
+    st->window -= len;
+    if (file == 0) return 0;
+
+    off_t offset = st->offset;
+    st->offset += file;
+    st->remaining -= file;
+    if (st->file->body) {
+        memcpy(conn->out + conn->out_len, st->file->body + offset, file);
+        conn->out_len += file;
+        return 0;
+    }
+    st->file->refs++;
+    conn->file = st->file;
+    conn->file_fd = st->file->fd;
+    conn->body = NULL;
+    conn->file_offset = offset;
+    conn->file_remaining = file;
+    return 1;
+}
+
+/**
+ * @brief Close the connection once a draining session has no streams left
+ *
+ * @param conn HTTP/2 connection
+ */
+void h2_check_drained(Connection* conn) {
+    H2Session* s = conn->h2;
+    if (!s->draining || s->stream_count > 0) return;
+    if (!s->goaway_sent && !conn->file) h2_queue_goaway(conn, H2_NO_ERROR);
+    conn->keep_alive = 0;
+}
+
+/**
+ * @brief Queue DATA frames for the streams with body left to send
+ *
+ * Streams take turns a frame at a time, as far as flow control and the
+ * output buffer allow. Queuing stops once a frame's payload is attached
+ * as the file body, since nothing may follow it in the output buffer
+ * until it has been sent.
+ *
+ * @param conn HTTP/2 connection with no file body attached
+ */
+void h2_queue_data(Connection* conn) {
+    H2Session* s = conn->h2;
+    int blocked = 0;
+
+    while (s->sending && blocked < s->stream_count && s->window > 0) {
+        H2Stream* st = s->sending;
+        s->sending = st->next;
+        if (!s->sending) s->sending_tail = NULL;
+
+        int result = h2_stream_frame(conn, st);
+        if (st->pending_sent == st->pending_len && st->remaining == 0 && st->range_count == 0) {
+            h2_stream_close(s, st);
+        } else {
+            h2_sending_push(s, st);
+        }
+        if (result < 0) {
+            blocked++;
+        } else {
+            blocked = 0;
+        }
+        if (result > 0) break;
+    }
+    h2_check_drained(conn);
+}
+
+/**
+ * @brief Continue an HTTP/2 connection's output once a frame payload is sent
+ * @param conn HTTP/2 connection
+ * @return int 1 if more frames were queued, 0 if the output is idle
+ */
+int h2_next_part(Connection* conn) {
+    conn_release_file(conn);
+    h2_queue_data(conn);
+    return conn->out_len > 0 || conn->file;
+}
+
+/**
+ * @brief Drop a connection's HTTP/2 session and the streams still open on it
+ * @param conn HTTP/2 connection
+ */
+void h2_session_release(Connection* conn) {
+    H2Session* s = conn->h2;
+    while (s->sending) {
+        H2Stream* st = s->sending;
+        s->sending = st->next;
+        h2_stream_close(s, st);
+    }
+    h2_session_put(conn->worker ? &conn->worker->conns : NULL, s);
+    conn->h2 = NULL;
+}
+
+/**
+ * @brief Start sending the next part of a multipart/byteranges body
+ *
+ * Called once the previous part's bytes have all been sent. Queues the
+ * next part header and points the file body at its range, or queues the
+ * closing boundary after the last part.
+ *
+ * @param conn Client connection
+ * @return int 1 if more of the response was queued, 0 if it is complete
+ */
+int conn_next_part(Connection* conn) {
+    if (conn->h2) return h2_next_part(conn);
+    if (conn->range_count == 0) return 0;
+
+    if (conn->range_next < conn->range_count) {
+        ByteRange range = conn->ranges[conn->range_next++];
+        char header[256];
+        int header_len = format_part_header(header, sizeof(header), conn->file, range);
+        conn_queue(conn, header, header_len);
+        conn->file_offset = range.start;
+        conn->file_remaining = range.len;
+        return 1;
+    }
+
+    char trailer[64];
+    int trailer_len = format_part_trailer(trailer, sizeof(trailer));
+    conn_queue(conn, trailer, trailer_len);
+    conn->range_count = 0;
+    return 1;
+}
+
+/**
+ * @brief Write as much of the pending response as the socket accepts
+ * @param conn Client connection
+ * @return int 1 when the response is fully sent, 0 if the socket would block,
+ *         -1 on error
+ */
+int conn_flush(Connection* conn) {
+    while (1) {
+        if (conn->body) {
+            // Headers and a cached body leave in a single writev()
+            struct iovec iov[2];
+            if (conn_body_iov(conn, iov) == 0) {
+                conn->out_len = 0;
+                conn->out_sent = 0;
+                if (conn_next_part(conn)) continue;
+                conn_release_file(conn);
+                return 1;
+            }
+            ssize_t n = writev(conn->fd, iov, 2);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            conn_sent(conn, n);
+            continue;
+        }
+
+        if (config.zerocopy == ZC_COPY && conn->file_fd >= 0 && conn->file_remaining > 0 &&
+            conn->out_sent == 0 && conn->out_len < conn->out_size) {
+            // Fill the rest of the output buffer from the file body, so the
+            // headers and the first body bytes go out in the same write
+            if (conn_out_buffer(conn) < 0) {
+                conn_release_file(conn);
+                return -1;
+            }
+            size_t chunk = conn->out_size - conn->out_len;
+            if ((off_t)chunk > conn->file_remaining) chunk = conn->file_remaining;
+            ssize_t n = pread(conn->file_fd, conn->out + conn->out_len, chunk, conn->file_offset);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                conn_release_file(conn);
+                return -1;
+            }
+            conn->out_len += n;
+            conn->file_offset += n;
+            conn->file_remaining -= n;
+        }
+
+        if (conn->out_sent < conn->out_len) {
+            // MSG_MORE holds back a partial segment only while body bytes
+            // follow, so the headers share a packet with the start of the
+            // body; the last write goes without it and, with TCP_NODELAY
+            // set at accept, is not held for the client's delayed ACK
+            int more = conn->file_fd >= 0 && (conn->file_remaining > 0 || conn->pipe_len > 0);
+            ssize_t n = send(conn->fd, conn->out + conn->out_sent,
+                             conn->out_len - conn->out_sent, more ? MSG_MORE : 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            conn->out_sent += n;
+            conn_count_sent(conn, n);
+            continue;
+        }
+
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        if (conn->file_fd < 0) {
+            return 1;
+        }
+        if (conn->file_remaining == 0 && conn->pipe_len == 0) {
+            if (conn_next_part(conn)) continue;
+            conn_release_file(conn);
+            return 1;
+        }
+
+        if (config.zerocopy == ZC_COPY) {
+            continue; // The output buffer is refilled from the file above
+        }
+
+        ssize_t n;
+        if (config.zerocopy == ZC_SENDFILE) {
+            n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_remaining);
+            if (n == 0) errno = EIO; // File shrank under us
+            if (n > 0) conn->file_remaining -= n;
+        } else {
+            n = conn_splice_body(conn);
+        }
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            conn_release_file(conn);
+            return -1;
+        }
+        conn_count_sent(conn, n);
+    }
+}
+
+/**
+ * @brief Release a connection's resources and close its socket
+ * @param conn Client connection
+ */
+void conn_close(Connection* conn) {
+    if (conn->h2) h2_session_release(conn);
+    conn_release_file(conn);
+    // An open still in flight sees CONN_CLOSING when it completes
+    conn_release_opened(conn);
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    }
+    close(conn->fd);
+    conn_release_buffers(conn, 1);
+    conn->state = CONN_CLOSING;
+}
+
+/**
+ * @brief Read the monotonic clock in nanoseconds
+ * @return uint64_t Nanoseconds since an arbitrary start point
+ */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Read the monotonic clock in whole seconds
+ * @return time_t Seconds since an arbitrary start point
+ */
+time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/** Date header of the fork engine, whose processes have no worker */
+static DateCache process_date;
+
+/**
+ * @brief Reformat a Date header line if the wall clock second has changed
+ * @param date Cache to refresh
+ * @param now Current wall clock second
+ */
+void date_cache_update(DateCache* date, time_t now) {
+    if (date->len && date->second == now) return;
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    date->len = strftime(date->line, sizeof(date->line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    date->second = now;
+}
+
+/**
+ * @brief Refresh a worker's clocks when its event loop wakes up
+ *
+ * Every response queued until the next wakeup shares the Date line, so
+ * it is formatted at most once a second however busy the worker is.
+ *
+ * @param worker Worker whose loop woke up
+ */
+void worker_update_clock(Worker* worker) {
+    worker->now = monotonic_seconds();
+    date_cache_update(&worker->date, time(NULL));
+}
+
+/**
+ * @brief Start an empty timer wheel
+ * @param wheel Wheel to initialize
+ * @param now Current tick
+ */
+void timer_wheel_init(TimerWheel* wheel, unsigned long now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+/**
+ * @brief File a timer in the slot covering its expiry
+ *
+ * A timer already due goes in the current level 0 slot, which is only
+ * safe while cascading: that slot is processed right afterwards.
+ *
+ * @param wheel Wheel to insert into
+ * @param timer Timer with @c expires set
+ */
+void timer_wheel_place(TimerWheel* wheel, Timer* timer) {
+    unsigned long delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+    unsigned long tick = delta ? timer->expires : wheel->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> ((level + 1) * TIMER_SLOT_BITS)) {
+        level++;
+    }
+    int slot = (tick >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+
+    Timer** head = &wheel->slots[level][slot];
+    timer->level = level;
+    timer->slot = slot;
+    timer->next = *head;
+    if (*head) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * @brief Disarm a timer; does nothing if it is not armed
+ * @param wheel Wheel holding the timer
+ * @param timer Timer to cancel
+ */
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    if (!timer->pprev) return;
+
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    if (!wheel->slots[timer->level][timer->slot]) {
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+/**
+ * @brief Arm a timer, replacing any deadline it already had
+ * @param wheel Wheel to insert into
+ * @param timer Timer to arm
+ * @param kind TimeoutKind recorded for the expiry counters
+ * @param expires Tick to fire on, at least the next one
+ */
+void timer_arm(TimerWheel* wheel, Timer* timer, TimeoutKind kind, unsigned long expires) {
+    unsigned long span = 1UL << (TIMER_LEVELS * TIMER_SLOT_BITS);
+
+    timer_cancel(wheel, timer);
+    if (expires <= wheel->now) expires = wheel->now + 1;
+    if (expires - wheel->now >= span) expires = wheel->now + span - 1;
+    timer->expires = expires;
+    timer->kind = kind;
+    timer_wheel_place(wheel, timer);
+    wheel->count++;
+}
+
+/**
+ * @brief Advance the wheel to the current tick
+ * @param wheel Wheel to advance
+ * @param now Current tick
+ * @return Timer* Timers that fired, linked by @c next and no longer armed
+ */
+Timer* timer_wheel_advance(TimerWheel* wheel, unsigned long now) {
+    Timer* expired = NULL;
+
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+
+        // Each level that wraps pulls the next slot of the level above down
+        int index = wheel->now & (TIMER_SLOTS - 1);
+        for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+            index = (wheel->now >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+            Timer* list = wheel->slots[level][index];
+            wheel->slots[level][index] = NULL;
+            wheel->occupied[level] &= ~(1ULL << index);
+            while (list) {
+                Timer* timer = list;
+                list = timer->next;
+                timer_wheel_place(wheel, timer);
+            }
+        }
+
+        int slot = wheel->now & (TIMER_SLOTS - 1);
+        Timer* list = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~(1ULL << slot);
+        while (list) {
+            Timer* timer = list;
+            list = timer->next;
+            timer->pprev = NULL;
+            timer->next = expired;
+            expired = timer;
+            wheel->count--;
+        }
+    }
+    return expired;
+}
+
+/**
+ * @brief Get the ticks until the wheel next has work to do
+ * @param wheel Wheel to inspect
+ * @return long Ticks until the next due slot or cascade, -1 if nothing is armed
+ */
+long timer_wheel_next(const TimerWheel* wheel) {
+    if (wheel->count == 0) return -1;
+
+    int slot = wheel->now & (TIMER_SLOTS - 1);
+    uint64_t ahead = slot == TIMER_SLOTS - 1 ? 0 : wheel->occupied[0] >> (slot + 1);
+    if (ahead) return __builtin_ctzll(ahead) + 1;
+    return TIMER_SLOTS - slot;
+}
+
+/**
+ * @brief Arm the deadline for the phase a connection is in
+ *
+ * The header deadline covers a whole request header, so it is armed once
+ * per request and a client trickling bytes cannot extend it. Body and
+ * write deadlines restart whenever the client makes progress, and the
+ * idle deadline runs from the moment the connection goes quiet.
+ *
+ * @param worker Worker owning the connection
+ * @param conn Client connection
+ * @param read Request bytes arrived since the last update
+ * @param wrote Response bytes were accepted since the last update
+ */
+void conn_update_timer(Worker* worker, Connection* conn, int read, int wrote) {
+    TimeoutKind kind;
+    int seconds;
+    int restart = 0;
+
+    // A pool open in flight keeps the deadline of the request it serves
+    if (conn->opening) return;
+
+    if (conn->state == CONN_WRITING || (conn->h2 && conn->h2->stream_count > 0)) {
+        // HTTP/2 streams waiting for flow control credit wait on the
+        // client like a stalled write, and any frame from it is progress
+        kind = TIMEOUT_WRITE;
+        seconds = config.write_timeout;
+        restart = wrote || (conn->h2 && read);
+    } else if (conn->body_remaining > 0) {
+        kind = TIMEOUT_BODY;
+        seconds = config.body_timeout;
+        restart = read;
+    } else if (conn->in_len > 0 || conn->requests == 0) {
+        kind = TIMEOUT_HEADER;
+        seconds = config.header_timeout;
+        restart = conn->timer_requests != conn->requests;
+        conn->timer_requests = conn->requests;
+    } else {
+        kind = TIMEOUT_IDLE;
+        seconds = config.idle_timeout;
+    }
+
+    if (!conn->timer.pprev || conn->timer.kind != kind || restart) {
+        timer_arm(&worker->timers, &conn->timer, kind, worker->now + seconds);
+    }
+}
+
+/**
+ * @brief Get the connection a timer is embedded in
+ * @param timer Connection timer
+ * @return Connection* Owning connection
+ */
+Connection* conn_from_timer(Timer* timer) {
+    return (Connection*)((char*)timer - offsetof(Connection, timer));
+}
+
+/**
+ * @brief Parse a quality value ("1", "0.5", "0.000")
+ * @param p Characters after "q="
+ * @param end End of the element
+ * @return int Quality in thousandths, 0-1000
+ */
+int parse_qvalue(const char* p, const char* end) {
+    if (p == end || (*p != '0' && *p != '1')) return 1000;
+    int q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; scale > 0 && p < end && *p >= '0' && *p <= '9'; scale /= 10) {
+            q += (*p++ - '0') * scale;
+        }
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+/**
+ * @brief Pick the representation to send from an Accept-Encoding value
+ *
+ * The highest-quality coding the client accepts among the available
+ * siblings wins; ties go to the order of the encodings table. Codings not
+ * listed take the quality of "*", and q=0 rules a coding out.
+ *
+ * @param buf Buffer the value refers to
+ * @param value Accept-Encoding field value
+ * @param variants Bit per encoding with a sibling
+ * @return ContentEncoding Chosen encoding, ENC_IDENTITY if none applies
+ */
+ContentEncoding negotiate_encoding(const char* buf, Slice value, unsigned variants) {
+    int quality[ENC_COUNT];
+    int any = -1;
+    const char* p = buf + value.off;
+    const char* end = p + value.len;
+
+    for (int enc = 0; enc < ENC_COUNT; enc++) quality[enc] = -1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char* token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t token_len = p - token;
+
+        int q = 1000;
+        while (p < end && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (p < end && (*p == ' ' || *p == '\t')) p++;
+                if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                    const char* elem_end = p;
+                    while (elem_end < end && *elem_end != ',' && *elem_end != ';') elem_end++;
+                    q = parse_qvalue(p + 2, elem_end);
+                }
+                continue;
+            }
+            p++;
+        }
+
+        if (token_len == 1 && *token == '*') {
+            any = q;
+            continue;
+        }
+        for (int enc = 0; enc < ENC_COUNT; enc++) {
+            if (strlen(encodings[enc].token) == token_len &&
+                strncasecmp(token, encodings[enc].token, token_len) == 0) {
+                quality[enc] = q;
+            }
+        }
+        if (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0) quality[ENC_GZIP] = q;
+    }
+
+    ContentEncoding best = ENC_IDENTITY;
+    int best_q = 0;
+    for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+        int q = quality[enc] >= 0 ? quality[enc] : (any >= 0 ? any : 0);
+        if ((variants & (1u << enc)) && q > best_q) {
+            best = enc;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Queue the Date and Connection headers and the blank line ending
+ *        the headers
+ * @param conn Client connection
+ */
+void conn_queue_connection(Connection* conn) {
+    static const char keep_alive[] = "Connection: keep-alive\r\n\r\n";
+    static const char close_conn[] = "Connection: close\r\n\r\n";
+
+    const DateCache* date = &process_date;
+    if (conn->worker) {
+        date = &conn->worker->date;
+    } else {
+        date_cache_update(&process_date, time(NULL));
+    }
+    conn_queue(conn, date->line, date->len);
+
+    if (conn->keep_alive) {
+        conn_queue(conn, keep_alive, sizeof(keep_alive) - 1);
+    } else {
+        conn_queue(conn, close_conn, sizeof(close_conn) - 1);
+    }
+}
+
+/**
+ * @brief Check an If-None-Match list against an entity tag
+ *
+ * Uses the weak comparison If-None-Match calls for: tags match when their
+ * opaque parts are equal, whether or not either is marked W/.
+ *
+ * @param list Field value
+ * @param len Length of @p list
+ * @param etag Entity tag to look for
+ * @param etag_len Length of @p etag
+ * @return int 1 if the list contains the tag or "*", 0 otherwise
+ */
+int etag_list_matches(const char* list, size_t len, const char* etag, size_t etag_len) {
+    const char* end = list + len;
+
+    if (etag_len >= 2 && etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;
+        etag_len -= 2;
+    }
+    while (list < end) {
+        while (list < end && (*list == ' ' || *list == '\t' || *list == ',')) list++;
+        if (list == end) break;
+        if (*list == '*') return 1;
+        if (end - list >= 2 && list[0] == 'W' && list[1] == '/') list += 2;
+
+        const char* start = list;
+        if (list < end && *list == '"') {
+            list++;
+            while (list < end && *list != '"') list++;
+            if (list < end) list++;
+        }
+        if ((size_t)(list - start) == etag_len && memcmp(start, etag, etag_len) == 0) {
+            return 1;
+        }
+        while (list < end && *list != ',') list++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluate the request's conditional headers against a file
+ *
+ * If-None-Match takes precedence; If-Modified-Since is only consulted
+ * without it. A date identical to the file's Last-Modified, which is what
+ * browsers send back, matches without being parsed.
+ *
+ * @param req Parsed request
+ * @param buf Buffer the request refers to
+ * @param file File about to be served
+ * @return int 1 if the client's copy is current (304), 0 otherwise
+ */
+int request_not_modified(const HTTPRequest* req, const char* buf, const FileEntry* file) {
+    const HTTPHeader* inm = find_header(req, buf, "If-None-Match");
+    if (inm) {
+        return etag_list_matches(buf + inm->value.off, inm->value.len,
+                                 file->etag, file->etag_len);
+    }
+
+    const HTTPHeader* ims = find_header(req, buf, "If-Modified-Since");
+    if (!ims) return 0;
+    if (slice_equals(buf, ims->value, file->last_modified)) return 1;
+
+    char date[64];
+    struct tm tm;
+    if (ims->value.len >= sizeof(date)) return 0;
+    memcpy(date, buf + ims->value.off, ims->value.len);
+    date[ims->value.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    const char* rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!rest || *rest) return 0;
+    return file->mtime.tv_sec <= timegm(&tm);
+}
+
+/**
+ * @brief Queue a 304 Not Modified response carrying the file's validators
+ * @param conn Client connection
+ * @param file File the client already has
+ */
+void send_not_modified(Connection* conn, const FileEntry* file) {
+    conn_queue(conn, status_lines[304].line, status_lines[304].len);
+    conn_queue(conn, file->header + file->validators_off, file->header_len - file->validators_off);
+    conn_queue_connection(conn);
+    conn->status = 304;
+    conn->body_bytes = 0;
+}
+
+/**
+ * @brief Queue HTTP response for a client
+ * @param conn Client connection
+ * @param status_code HTTP status code, one listed in status_lines
+ * @param content_type Response content type
+ * @param content Response body content
+ * @param content_length Length of response body
+ */
+void send_response(Connection* conn, int status_code, const char* content_type,
+                   const char* content, size_t content_length) {
+    if (status_code < 0 || status_code >= STATUS_CODE_MAX || !status_lines[status_code].line) {
+        status_code = 500;
+    }
+
+    char header[512];
+    HeaderBuf h;
+    header_init(&h, header, sizeof(header));
+    header_put(&h, status_lines[status_code].line, status_lines[status_code].len);
+    header_put_str(&h, "Content-Type: ");
+    header_put_str(&h, content_type);
+    header_put_str(&h, "\r\nContent-Length: ");
+    header_put_decimal(&h, content_length);
+    header_put_str(&h, "\r\n");
+    if (status_code == 501) {
+        header_put_str(&h, allow_header);
+    }
+
+    conn_queue(conn, header, header_len(&h, header));
+    conn_queue_connection(conn);
+    // A HEAD response describes the body it leaves out
+    if (!conn->head) conn_queue(conn, content, content_length);
+    conn->status = status_code;
+    conn->body_bytes = conn->head ? 0 : content_length;
+}
+
+/**
+ * @brief Queue HTTP error response
+ * @param conn Client connection
+ * @param status_code HTTP status code
+ * @param message Error message
+ */
+void send_error(Connection* conn, int status_code, const char* message) {
+    char body[512];
+    HeaderBuf h;
+    header_init(&h, body, sizeof(body));
+    header_put_str(&h, "<html><body><h1>");
+    header_put_decimal(&h, status_code);
+    header_put_str(&h, " ");
+    header_put_str(&h, message);
+    header_put_str(&h, "</h1><p>");
+    header_put_str(&h, message);
+    header_put_str(&h, "</p></body></html>");
+
+    send_response(conn, status_code, "text/html", body, header_len(&h, body));
+}
+
+/**
+ * @brief Queue the answer to an OPTIONS request
+ *
+ * Every resource, and the server as a whole ("*"), supports the same
+ * methods, so the answer needs no lookup.
+ *
+ * @param conn Client connection
+ */
+void send_options(Connection* conn) {
+    static const char empty[] = "Content-Length: 0\r\n";
+
+    conn_queue(conn, status_lines[200].line, status_lines[200].len);
+    conn_queue(conn, allow_header, sizeof(allow_header) - 1);
+    conn_queue(conn, empty, sizeof(empty) - 1);
+    conn_queue_connection(conn);
+    conn->status = 200;
+    conn->body_bytes = 0;
+}
+
+/**
+ * @brief Parse a Range header value against a file size
+ *
+ * Unsatisfiable ranges are dropped as long as another one remains. A
+ * value that is malformed, uses another unit or lists more than
+ * MAX_RANGES ranges is ignored, and the whole file is sent.
+ *
+ * @param p Field value
+ * @param len Length of @p p
+ * @param size File size
+ * @param ranges Receives the satisfiable ranges, last byte clipped to the file
+ * @return int Number of ranges, 0 to ignore the header, -1 if none is satisfiable
+ */
+int parse_ranges(const char* p, size_t len, off_t size, ByteRange* ranges) {
+    const char* end = p + len;
+    int count = 0;
+    int seen = 0;
+
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) return 0;
+    p += 6;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+
+        long long first = -1, last = -1;
+        if (*p >= '0' && *p <= '9') {
+            for (first = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (first > (LLONG_MAX - 9) / 10) return 0;
+                first = first * 10 + (*p - '0');
+            }
+        }
+        if (p == end || *p != '-') return 0;
+        p++;
+        if (p < end && *p >= '0' && *p <= '9') {
+            for (last = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (last > (LLONG_MAX - 9) / 10) return 0;
+                last = last * 10 + (*p - '0');
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return 0;
+        if (first < 0 && last < 0) return 0;
+        if (first >= 0 && last >= 0 && last < first) return 0;
+        if (++seen > MAX_RANGES) return 0;
+
+        if (first < 0) {
+            // Suffix range: the final "last" bytes
+            if (last == 0 || size == 0) continue;
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else {
+            if (first >= size) continue;
+            if (last < 0 || last >= size) last = size - 1;
+        }
+        ranges[count].start = first;
+        ranges[count].len = last - first + 1;
+        count++;
+    }
+
+    if (seen == 0) return 0;
+    return count > 0 ? count : -1;
+}
+
+/**
+ * @brief Evaluate If-Range, which only lets a Range through for the
+ *        representation the client already holds part of
+ * @param req Parsed request
+ * @param buf Buffer the request refers to
+ * @param file File about to be served
+ * @return int 1 if ranges may be served, 0 to send the whole file
+ */
+int if_range_allows(const HTTPRequest* req, const char* buf, const FileEntry* file) {
+    const HTTPHeader* if_range = find_header(req, buf, "If-Range");
+    if (!if_range) return 1;
+
+    // Entity tags need the strong comparison, so a weak tag never matches
+    if (if_range->value.len > 0 && buf[if_range->value.off] == '"') {
+        return file->etag[0] == '"' && if_range->value.len == file->etag_len &&
+               memcmp(buf + if_range->value.off, file->etag, file->etag_len) == 0;
+    }
+    return slice_equals(buf, if_range->value, file->last_modified);
+}
+
+/**
+ * @brief Queue a 206 response for the requested ranges of a file
+ *
+ * One range is sent as a plain body starting at its offset; several are
+ * sent as multipart/byteranges, one part at a time by conn_next_part().
+ *
+ * @param conn Client connection
+ * @param file File being served, reference owned by the caller
+ * @param ranges Satisfiable ranges, in the connection's arena
+ * @param count Number of ranges
+ */
+void send_ranges(Connection* conn, const FileEntry* file, ByteRange* ranges, int count) {
+    char header[512];
+    HeaderBuf h;
+    header_init(&h, header, sizeof(header));
+    header_put(&h, status_lines[206].line, status_lines[206].len);
+
+    if (count == 1) {
+        header_put_str(&h, "Content-Type: ");
+        header_put_str(&h, file->mime_type);
+        header_put_str(&h, "\r\nContent-Length: ");
+        header_put_decimal(&h, ranges[0].len);
+        header_put_str(&h, "\r\nContent-Range: bytes ");
+        header_put_content_range(&h, ranges[0], file->size);
+        header_put_str(&h, "\r\nAccept-Ranges: bytes\r\n");
+        conn->file_offset = ranges[0].start;
+        conn->file_remaining = ranges[0].len;
+        conn->body_bytes = ranges[0].len;
+    } else {
+        char part[256];
+        long long length = format_part_trailer(part, sizeof(part));
+        for (int i = 0; i < count; i++) {
+            length += format_part_header(part, sizeof(part), file, ranges[i]) + ranges[i].len;
+        }
+        header_put_str(&h, "Content-Type: multipart/byteranges; boundary=");
+        header_put_str(&h, range_boundary);
+        header_put_str(&h, "\r\nContent-Length: ");
+        header_put_decimal(&h, length);
+        header_put_str(&h, "\r\nAccept-Ranges: bytes\r\n");
+        conn->ranges = ranges;
+        conn->range_count = count;
+        conn->range_next = 0;
+        conn->file_remaining = 0;
+        conn->body_bytes = length;
+    }
+    conn->status = 206;
+
+    conn_queue(conn, header, header_len(&h, header));
+    conn_queue(conn, file->header + file->validators_off, file->header_len - file->validators_off);
+    conn_queue_connection(conn);
+    if (count > 1) conn_next_part(conn);
+}
+
+/**
+ * @brief Queue a 416 response for a Range no byte of the file satisfies
+ * @param conn Client connection
+ * @param file File that was requested
+ */
+void send_range_not_satisfiable(Connection* conn, const FileEntry* file) {
+    char header[256];
+    HeaderBuf h;
+    header_init(&h, header, sizeof(header));
+    header_put(&h, status_lines[416].line, status_lines[416].len);
+    header_put_str(&h, "Content-Range: bytes */");
+    header_put_decimal(&h, file->size);
+    header_put_str(&h, "\r\nContent-Length: 0\r\n");
+    conn_queue(conn, header, header_len(&h, header));
+    conn_queue_connection(conn);
+    conn->status = 416;
+    conn->body_bytes = 0;
+}
+
+/**
+ * @brief Queue file response for a client
+ * @param conn Client connection
+ * @param filepath Path to file to serve
+ */
+void serve_file(Connection* conn, const char* filepath) {
+    // Security: Prevent directory traversal
+    if (strstr(filepath, "..")) {
+        send_error(conn, 403, "Forbidden");
+        return;
+    }
+
+    // Default to index.html for root
+    if (strcmp(filepath, "/") == 0) {
+        filepath = "/index.html";
+    }
+
+    // The parser bounds the target by --max-uri, which leaves room for the dot
+    char fullpath[PATH_MAX];
+    size_t path_len = strlen(filepath);
+    if (path_len > sizeof(fullpath) - 2) {
+        send_error(conn, 414, "URI Too Long");
+        return;
+    }
+    fullpath[0] = '.';
+    memcpy(fullpath + 1, filepath, path_len + 1);
+
+    FileEntry* file = conn_open_file(conn, fullpath, ENC_IDENTITY);
+    if (!file) {
+        // An open handed to the pool resumes the request when it finishes
+        if (!conn->opening) send_error(conn, 404, "Not Found");
+        return;
+    }
+
+    // Swap in a precompressed sibling, or a body compressed on the fly,
+    // if the client accepts one
+    const HTTPHeader* accept = find_header(&conn->req, conn->in, "Accept-Encoding");
+    unsigned available = file->variants | compress_encodings(file);
+    if (available && accept) {
+        ContentEncoding encoding = negotiate_encoding(conn->in, accept->value, available);
+        if (encoding != ENC_IDENTITY) {
+            FileEntry* variant;
+            if (!(file->variants & (1u << encoding))) {
+                variant = compressed_variant(conn->worker, file, encoding);
+            } else {
+                variant = conn_open_file(conn, fullpath, encoding);
+                if (conn->opening) {
+                    // Kept for the resumed request, which gets it back
+                    // from conn_open_file() without a second lookup
+                    conn->opening->held = file;
+                    return;
+                }
+            }
+            if (variant) {
+                file_entry_release(file);
+                file = variant;
+            }
+        }
+    }
+
+    if (request_not_modified(&conn->req, conn->in, file)) {
+        send_not_modified(conn, file);
+        file_entry_release(file);
+        return;
+    }
+
+    // HEAD answers from the entry's prebuilt header; Range only applies to GET
+    if (conn->head) {
+        conn_queue(conn, file->header, file->header_len);
+        conn_queue_connection(conn);
+        conn->status = 200;
+        conn->body_bytes = 0;
+        file_entry_release(file);
+        return;
+    }
+
+    // Without memory for the ranges the whole file is sent, as a server may
+    const HTTPHeader* range = find_header(&conn->req, conn->in, "Range");
+    ByteRange* ranges = NULL;
+    int range_count = 0;
+    if (range && if_range_allows(&conn->req, conn->in, file) &&
+        (ranges = conn_alloc(conn, MAX_RANGES * sizeof(ByteRange)))) {
+        range_count = parse_ranges(conn->in + range->value.off, range->value.len,
+                                   file->size, ranges);
+    }
+    if (range_count < 0) {
+        send_range_not_satisfiable(conn, file);
+        file_entry_release(file);
+        return;
+    }
+
+    // File content is sent by the engine as the socket drains
+    conn->file = file;
+    conn->file_fd = file->fd;
+    conn->body = file->body;
+    if (range_count > 0) {
+        send_ranges(conn, file, ranges, range_count);
+        return;
+    }
+
+    // Queue headers
+    conn_queue(conn, file->header, file->header_len);
+    conn_queue_connection(conn);
+    conn->file_offset = 0;
+    conn->file_remaining = file->size;
+    conn->status = 200;
+    conn->body_bytes = file->size;
+}
+
+/**
+ * @brief Get the reason phrase for a status code the server emits
+ * @param status_code HTTP status code
+ * @return const char* Reason phrase
+ */
+const char* status_text(int status_code) {
+    if (status_code < 0 || status_code >= STATUS_CODE_MAX || !status_lines[status_code].line) {
+        return status_lines[500].text;
+    }
+    return status_lines[status_code].text;
+}
+
+/** Where the logger thread writes and which rings it drains */
+static struct {
+    int fd;             /**< Log file descriptor, -1 when logging is off */
+    Worker* workers;    /**< Workers whose rings are drained */
+    int worker_count;   /**< Entries in @c workers */
+} access_logger = { -1, NULL, 0 };
+
+/**
+ * @brief Copy a request field into a fixed-size record field, truncating
+ * @param dst Destination field
+ * @param size Size of @c dst
+ * @param src Source bytes
+ * @param len Number of source bytes
+ */
+void access_copy(char* dst, size_t size, const char* src, size_t len) {
+    if (len >= size) len = size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/**
+ * @brief Fill an access record for the response just queued
+ *
+ * Runs before the request is consumed, so its slices still point into
+ * the input buffer, with the method and path already NUL-terminated.
+ *
+ * @param conn Client connection
+ * @param latency_us Microseconds since the request's first byte
+ * @param rec Record to fill
+ */
+void access_record_fill(const Connection* conn, unsigned long latency_us, AccessRecord* rec) {
+    const HTTPRequest* req = &conn->req;
+
+    rec->time = time(NULL);
+    rec->addr = conn->addr.sin_addr;
+    rec->status = conn->status;
+    rec->bytes = conn->body_bytes;
+    rec->latency_us = latency_us;
+    rec->method[0] = rec->target[0] = rec->referer[0] = rec->user_agent[0] = '\0';
+    rec->version_minor = -1;
+    rec->http2 = conn->h2 != NULL;
+    if (req->error_status != 0) return;
+
+    rec->version_minor = req->version_minor;
+    access_copy(rec->method, sizeof(rec->method), conn->in + req->method.off, req->method.len);
+    access_copy(rec->target, sizeof(rec->target), conn->in + req->path.off, req->path.len);
+    size_t len = strlen(rec->target);
+    if (req->query.len > 0 && len + 1 < sizeof(rec->target)) {
+        // The query follows the path's '?', which now holds the path's NUL
+        access_copy(rec->target + len, sizeof(rec->target) - len,
+                    conn->in + req->query.off - 1, req->query.len + 1);
+        rec->target[len] = '?';
+    }
+    if (config.log_format != LOG_COMMON) {
+        const HTTPHeader* referer = find_header(req, conn->in, "Referer");
+        const HTTPHeader* agent = find_header(req, conn->in, "User-Agent");
+        if (referer) {
+            access_copy(rec->referer, sizeof(rec->referer),
+                        conn->in + referer->value.off, referer->value.len);
+        }
+        if (agent) {
+            access_copy(rec->user_agent, sizeof(rec->user_agent),
+                        conn->in + agent->value.off, agent->value.len);
+        }
+    }
+}
+
+/**
+ * @brief Append a field to a log line, escaping what the format cannot hold
+ *
+ * Text formats escape quotes, backslashes and non-printable bytes as \xHH
+ * the way nginx does; JSON escapes them as \u00HH. An empty field is
+ * written as "-" in the text formats.
+ *
+ * @param out Line buffer, with room for six bytes per input byte
+ * @param s NUL-terminated field
+ * @param json Escape for a JSON string rather than a quoted log field
+ * @return size_t Bytes written
+ */
+size_t access_escape(char* out, const char* s, int json) {
+    static const char hex[] = "0123456789abcdef";
+    char* p = out;
+
+    if (!*s && !json) *p++ = '-';
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+            *p++ = c;
+        } else if (json && (c == '"' || c == '\\')) {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (json) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[c >> 4];
+            p[5] = hex[c & 15];
+            p += 6;
+        } else {
+            p[0] = '\\';
+            p[1] = 'x';
+            p[2] = hex[c >> 4];
+            p[3] = hex[c & 15];
+            p += 4;
+        }
+    }
+    return p - out;
+}
+
+/**
+ * @brief Format an access record as one log line
+ * @param rec Record to format
+ * @param out Buffer of at least ACCESS_LOG_LINE_MAX bytes
+ * @return size_t Line length including the newline
+ */
+size_t access_format(const AccessRecord* rec, char* out) {
+    // Records arrive in roughly time order, so the timestamp rarely changes
+    static __thread time_t stamp_time = -1;
+    static __thread char stamp[32];
+    char addr[INET_ADDRSTRLEN];
+    char* p = out;
+
+    if (rec->time != stamp_time) {
+        struct tm tm;
+        gmtime_r(&rec->time, &tm);
+        strftime(stamp, sizeof(stamp), config.log_format == LOG_JSON ? "%Y-%m-%dT%H:%M:%SZ"
+                                                                    : "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        stamp_time = rec->time;
+    }
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+
+    if (config.log_format == LOG_JSON) {
+        p += sprintf(p, "{\"time\":\"%s\",\"remote_addr\":\"%s\",\"method\":\"", stamp, addr);
+        p += access_escape(p, rec->method, 1);
+        p += sprintf(p, "\",\"target\":\"");
+        p += access_escape(p, rec->target, 1);
+        p += sprintf(p, "\",\"protocol\":\"");
+        if (rec->http2) {
+            p += sprintf(p, "HTTP/2.0");
+        } else if (rec->version_minor >= 0) {
+            p += sprintf(p, "HTTP/1.%d", rec->version_minor);
+        }
+        p += sprintf(p, "\",\"status\":%d,\"bytes\":%lld,\"referer\":\"", rec->status, rec->bytes);
+        p += access_escape(p, rec->referer, 1);
+        p += sprintf(p, "\",\"user_agent\":\"");
+        p += access_escape(p, rec->user_agent, 1);
+        p += sprintf(p, "\",\"latency_us\":%lu}\n", rec->latency_us);
+        return p - out;
+    }
+
+    p += sprintf(p, "%s - - [%s] \"", addr, stamp);
+    if (rec->version_minor >= 0) {
+        p += access_escape(p, rec->method, 0);
+        *p++ = ' ';
+        p += access_escape(p, rec->target, 0);
+        p += rec->http2 ? sprintf(p, " HTTP/2.0") : sprintf(p, " HTTP/1.%d", rec->version_minor);
+    } else {
+        *p++ = '-';
+    }
+    p += sprintf(p, "\" %d %lld", rec->status, rec->bytes);
+    if (config.log_format == LOG_COMBINED) {
+        p += sprintf(p, " \"");
+        p += access_escape(p, rec->referer, 0);
+        p += sprintf(p, "\" \"");
+        p += access_escape(p, rec->user_agent, 0);
+        *p++ = '"';
+    }
+    p += sprintf(p, " %lu\n", rec->latency_us);
+    return p - out;
+}
+
+/**
+ * @brief Write a whole buffer to the access log
+ * @param buf Bytes to write
+ * @param len Number of bytes
+ */
+void access_write(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(access_logger.fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("access log write failed");
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Log the response just queued for the request at the start of @c in
+ *
+ * Event loop workers only copy the record into their ring; formatting and
+ * writing happen on the logger thread. A forked child has no logger and
+ * writes its line directly, relying on O_APPEND to keep lines whole.
+ *
+ * @param conn Client connection
+ * @param latency_us Microseconds since the request's first byte
+ */
+void access_log(Connection* conn, unsigned long latency_us) {
+    if (access_logger.fd < 0) return;
+
+    if (!conn->worker) {
+        AccessRecord rec;
+        char line[ACCESS_LOG_LINE_MAX];
+        access_record_fill(conn, latency_us, &rec);
+        access_write(line, access_format(&rec, line));
+        return;
+    }
+
+    AccessLog* log = &conn->worker->log;
+    unsigned long head = log->head;
+    if (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING) {
+        log->dropped++;
+        return;
+    }
+    access_record_fill(conn, latency_us, &log->records[head & (ACCESS_LOG_RING - 1)]);
+    __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Logger thread: drain every worker's ring into batched writes
+ * @param arg Unused
+ * @return void* Never returns
+ */
+void* logger_main(void* arg) {
+    (void)arg;
+    char* batch = malloc(ACCESS_LOG_BATCH);
+    if (!batch) {
+        perror("malloc failed");
+        return NULL;
+    }
+
+    while (1) {
+        size_t len = 0;
+        int drained = 0;
+        for (int i = 0; i < access_logger.worker_count; i++) {
+            AccessLog* log = &access_logger.workers[i].log;
+            unsigned long tail = log->tail;
+            unsigned long head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+            for (; tail != head; tail++) {
+                if (ACCESS_LOG_BATCH - len < ACCESS_LOG_LINE_MAX) {
+                    access_write(batch, len);
+                    len = 0;
+                }
+                len += access_format(&log->records[tail & (ACCESS_LOG_RING - 1)], batch + len);
+                drained++;
+            }
+            __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+        }
+        if (len > 0) access_write(batch, len);
+
+        // Nothing waiting: let records accumulate into the next batch
+        if (!drained) {
+            struct timespec pause = { 0, 2 * 1000 * 1000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Open the access log and, for the event loop engines, start the logger
+ * @param workers Worker array whose rings to drain, NULL for the fork engine
+ * @param worker_count Number of workers
+ */
+void access_log_start(Worker* workers, int worker_count) {
+    if (!config.access_log) return;
+
+    if (strcmp(config.access_log, "-") == 0) {
+        access_logger.fd = STDOUT_FILENO;
+    } else {
+        access_logger.fd = open(config.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (access_logger.fd < 0) {
+            perror(config.access_log);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!workers) return;
+
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].log.records = malloc(ACCESS_LOG_RING * sizeof(AccessRecord));
+        if (!workers[i].log.records) {
+            perror("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    access_logger.workers = workers;
+    access_logger.worker_count = worker_count;
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, logger_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/** Workers whose counters a scrape sums */
+static struct {
+    Worker* workers;    /**< Worker array */
+    int worker_count;   /**< Entries in @c workers */
+} metrics_registry = { NULL, 0 };
+
+/**
+ * @brief Map a latency to its histogram bucket
+ * @param us Latency in microseconds
+ * @return int Bucket index
+ */
+int latency_bucket(unsigned long us) {
+    if (us < LATENCY_SUB) return us;
+    int shift = 63 - __builtin_clzl(us) - LATENCY_SUB_BITS;
+    int bucket = ((shift + 1) << LATENCY_SUB_BITS) + ((us >> shift) & (LATENCY_SUB - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @brief Get the largest latency a histogram bucket holds
+ * @param bucket Bucket index
+ * @return unsigned long Upper bound in microseconds, inclusive
+ */
+unsigned long latency_bucket_upper(int bucket) {
+    if (bucket < LATENCY_SUB) return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    return ((unsigned long)(LATENCY_SUB + (bucket & (LATENCY_SUB - 1)) + 1) << shift) - 1;
+}
+
+/**
+ * @brief Count the response just queued and its latency
+ * @param conn Client connection, ignored in the fork engine
+ * @param latency_us Microseconds since the request's first byte
+ */
+void metrics_record(Connection* conn, unsigned long latency_us) {
+    if (!conn->worker) return;
+
+    Metrics* metrics = &conn->worker->metrics;
+    if (conn->status > 0 && conn->status < STATUS_CODE_MAX) metrics->requests[conn->status]++;
+    metrics->latency[latency_bucket(latency_us)]++;
+    metrics->latency_sum_us += latency_us;
+}
+
+/**
+ * @brief Read a counter another worker may be updating
+ * @param counter Counter to read
+ * @return unsigned long Current value
+ */
+unsigned long counter_read(const unsigned long* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Write the HELP and TYPE lines of a metric family
+ * @param out Exposition being built
+ * @param name Metric name
+ * @param type counter, gauge, histogram or summary
+ * @param help Description
+ */
+void metrics_family(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Write one per-worker sample of every worker
+ * @param out Exposition being built
+ * @param name Metric name
+ * @param type Metric type
+ * @param help Description
+ * @param offset Offset of the counter within Worker
+ */
+void metrics_per_worker(FILE* out, const char* name, const char* type, const char* help,
+                        size_t offset) {
+    metrics_family(out, name, type, help);
+    for (int i = 0; i < metrics_registry.worker_count; i++) {
+        const Worker* worker = &metrics_registry.workers[i];
+        fprintf(out, "%s{worker=\"%d\"} %lu\n", name, worker->id,
+                counter_read((const unsigned long*)((const char*)worker + offset)));
+    }
+}
+
+/**
+ * @brief Write one sample per worker and buffer size class
+ * @param out Exposition being built
+ * @param name Metric name
+ * @param type Metric type
+ * @param help Description
+ * @param offset Offset of the per-class counter array within Worker
+ */
+void metrics_per_class(FILE* out, const char* name, const char* type, const char* help,
+                       size_t offset) {
+    metrics_family(out, name, type, help);
+    for (int i = 0; i < metrics_registry.worker_count; i++) {
+        const Worker* worker = &metrics_registry.workers[i];
+        const unsigned long* counters = (const unsigned long*)((const char*)worker + offset);
+        for (int class = 0; class < config.buffer_classes; class++) {
+            fprintf(out, "%s{worker=\"%d\",size=\"%d\"} %lu\n", name, worker->id,
+                    config.buffer_sizes[class], counter_read(&counters[class]));
+        }
+    }
+}
+
+/**
+ * @brief Write every metric in the Prometheus text format
+ *
+ * Counters are per worker; the latency histogram is summed across workers
+ * into a cumulative histogram with power-of-two bounds and a summary whose
+ * quantiles come from the full-resolution buckets.
+ *
+ * @param out Exposition being built
+ */
+void metrics_write(FILE* out) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    unsigned long latency[LATENCY_BUCKETS] = { 0 };
+    unsigned long latency_count = 0;
+    unsigned long latency_sum_us = 0;
+
+    metrics_family(out, "minihttp_requests_total", "counter", "Responses by status code.");
+    for (int i = 0; i < metrics_registry.worker_count; i++) {
+        const Worker* worker = &metrics_registry.workers[i];
+        for (int code = 100; code < STATUS_CODE_MAX; code++) {
+            unsigned long count = counter_read(&worker->metrics.requests[code]);
+            if (count) {
+                fprintf(out, "minihttp_requests_total{worker=\"%d\",code=\"%d\"} %lu\n",
+                        worker->id, code, count);
+            }
+        }
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            latency[b] += counter_read(&worker->metrics.latency[b]);
+        }
+        latency_sum_us += counter_read(&worker->metrics.latency_sum_us);
+    }
+
+    metrics_per_worker(out, "minihttp_sent_bytes_total", "counter",
+                       "Bytes written to client sockets.", offsetof(Worker, metrics.bytes_sent));
+    metrics_per_worker(out, "minihttp_connections_accepted_total", "counter",
+                       "Connections accepted.", offsetof(Worker, metrics.accepted));
+    metrics_per_worker(out, "minihttp_accept_errors_total", "counter",
+                       "Failed accept() calls.", offsetof(Worker, metrics.accept_errors));
+    metrics_per_worker(out, "minihttp_connections_active", "gauge",
+                       "Connections currently open.", offsetof(Worker, metrics.active));
+    metrics_per_worker(out, "minihttp_connection_pool_in_use", "gauge",
+                       "Connection objects taken from the slab pool.", offsetof(Worker, conns.in_use));
+    metrics_per_worker(out, "minihttp_connection_pool_capacity", "gauge",
+                       "Connection objects carved from slabs.", offsetof(Worker, conns.capacity));
+    metrics_per_worker(out, "minihttp_connection_pool_high_water", "gauge",
+                       "Most connection objects in use at once.", offsetof(Worker, conns.high_water));
+    metrics_per_worker(out, "minihttp_arena_blocks", "gauge",
+                       "Request arena overflow blocks allocated.", offsetof(Worker, conns.block_count));
+    metrics_per_class(out, "minihttp_buffer_pool_in_use", "gauge",
+                      "Connection buffers handed out, by size class.", offsetof(Worker, buffers.in_use));
+    metrics_per_class(out, "minihttp_buffer_pool_capacity", "gauge",
+                      "Connection buffers carved, by size class.", offsetof(Worker, buffers.capacity));
+    metrics_per_class(out, "minihttp_buffer_pool_high_water", "gauge",
+                      "Most connection buffers in use at once, by size class.",
+                      offsetof(Worker, buffers.high_water));
+    metrics_per_worker(out, "minihttp_buffer_pool_chunks", "gauge",
+                       "2MB chunks mapped for connection buffers.", offsetof(Worker, buffers.chunks));
+    metrics_per_worker(out, "minihttp_buffer_pool_huge_chunks", "gauge",
+                       "Buffer chunks backed by reserved huge pages.",
+                       offsetof(Worker, buffers.huge_chunks));
+    metrics_per_worker(out, "minihttp_file_cache_hits_total", "counter",
+                       "File lookups served from the open file cache.", offsetof(Worker, files.hits));
+    metrics_per_worker(out, "minihttp_file_cache_misses_total", "counter",
+                       "File lookups that had to open the file.", offsetof(Worker, files.misses));
+    metrics_per_worker(out, "minihttp_file_cache_memory_bytes", "gauge",
+                       "File bytes held in memory by the cache.", offsetof(Worker, files.mem_bytes));
+    metrics_per_worker(out, "minihttp_http2_connections_total", "counter",
+                       "Connections that switched to HTTP/2.", offsetof(Worker, metrics.h2_connections));
+    metrics_per_worker(out, "minihttp_http2_streams_total", "counter",
+                       "HTTP/2 streams answered.", offsetof(Worker, metrics.h2_streams));
+    metrics_per_worker(out, "minihttp_http2_sessions", "gauge",
+                       "HTTP/2 session states allocated.", offsetof(Worker, conns.session_count));
+    metrics_per_worker(out, "minihttp_access_log_dropped_total", "counter",
+                       "Access log records lost to a full ring.", offsetof(Worker, log.dropped));
+
+    metrics_family(out, "minihttp_timeouts_total", "counter", "Connections closed by a timeout.");
+    for (int i = 0; i < metrics_registry.worker_count; i++) {
+        const Worker* worker = &metrics_registry.workers[i];
+        for (int kind = 0; kind < TIMEOUT_COUNT; kind++) {
+            fprintf(out, "minihttp_timeouts_total{worker=\"%d\",kind=\"%s\"} %lu\n",
+                    worker->id, timeout_names[kind], counter_read(&worker->timeouts[kind]));
+        }
+    }
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) latency_count += latency[b];
+
+    metrics_family(out, "minihttp_request_duration_seconds", "histogram",
+                   "Time from a request's first byte to its response being queued.");
+    unsigned long cumulative = 0;
+    int b = 0;
+    for (int k = LATENCY_SUB_BITS; k <= 25; k++) {
+        unsigned long bound = 1UL << k;
+        for (; b < LATENCY_BUCKETS && latency_bucket_upper(b) < bound; b++) cumulative += latency[b];
+        fprintf(out, "minihttp_request_duration_seconds_bucket{le=\"%g\"} %lu\n", bound / 1e6, cumulative);
+    }
+    fprintf(out, "minihttp_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n", latency_count);
+    fprintf(out, "minihttp_request_duration_seconds_sum %.6f\n", latency_sum_us / 1e6);
+    fprintf(out, "minihttp_request_duration_seconds_count %lu\n", latency_count);
+
+    metrics_family(out, "minihttp_request_latency_seconds", "summary",
+                   "Request latency quantiles since startup, within 1/8 of the value.");
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        unsigned long rank = (unsigned long)(quantiles[q] * latency_count + 0.5);
+        unsigned long seen = 0;
+        int bucket = 0;
+        if (rank == 0) rank = 1;
+        while (bucket < LATENCY_BUCKETS - 1 && seen + latency[bucket] < rank) seen += latency[bucket++];
+        fprintf(out, "minihttp_request_latency_seconds{quantile=\"%g\"} %.6f\n", quantiles[q],
+                latency_count ? latency_bucket_upper(bucket) / 1e6 : 0.0);
+    }
+    fprintf(out, "minihttp_request_latency_seconds_sum %.6f\n", latency_sum_us / 1e6);
+    fprintf(out, "minihttp_request_latency_seconds_count %lu\n", latency_count);
+}
+
+/**
+ * @brief Queue the metrics exposition as an in-memory body
+ *
+ * The text goes into an uncached entry of its own, so the engines send it
+ * like any file held in memory and free it once sent.
+ *
+ * @param conn Client connection
+ */
+void serve_metrics(Connection* conn) {
+    char* text = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&text, &len);
+    if (!out) {
+        send_error(conn, 500, "Internal Server Error");
+        return;
+    }
+    metrics_write(out);
+    fclose(out);
+
+    FileEntry* entry = malloc(sizeof(FileEntry) + 1 + len);
+    if (!entry) {
+        free(text);
+        send_error(conn, 500, "Internal Server Error");
+        return;
+    }
+    memset(entry, 0, sizeof(FileEntry));
+    entry->fd = -1;
+    entry->path[0] = '\0';
+    entry->body = entry->path + 1;
+    memcpy(entry->body, text, len);
+    free(text);
+    entry->size = len;
+    entry->refs = 1;
+    entry->wd = -1;
+    entry->dir_wd = -1;
+
+    char header[256];
+    HeaderBuf h;
+    header_init(&h, header, sizeof(header));
+    header_put(&h, status_lines[200].line, status_lines[200].len);
+    header_put_str(&h, "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: ");
+    header_put_decimal(&h, len);
+    header_put_str(&h, "\r\nCache-Control: no-store\r\n");
+    conn_queue(conn, header, header_len(&h, header));
+    conn_queue_connection(conn);
+    conn->status = 200;
+    if (conn->head) {
+        file_entry_release(entry);
+        conn->body_bytes = 0;
+        return;
+    }
+    conn->file = entry;
+    conn->body = entry->body;
+    conn->file_offset = 0;
+    conn->file_remaining = len;
+    conn->body_bytes = len;
+}
+
+/**
+ * @brief Queue the response to the parsed request at the start of the
+ *        input buffer
+ * @param conn Client connection whose parser returned PARSE_DONE or PARSE_ERROR
+ */
+void respond_request(Connection* conn) {
+    HTTPRequest* req = &conn->req;
+
+    if (req->error_status != 0) {
+        conn->head = 0;
+        send_error(conn, req->error_status, status_text(req->error_status));
+        return;
+    }
+
+    // Terminate method and path in place; the bytes after them are
+    // delimiters of the request being consumed
+    char* method = conn->in + req->method.off;
+    char* path = conn->in + req->path.off;
+    method[req->method.len] = '\0';
+    path[req->path.len] = '\0';
+
+    conn->head = strcmp(method, "HEAD") == 0;
+    if (conn->head || strcmp(method, "GET") == 0) {
+        // Forked children see only their own connection, so they have no metrics
+        if (config.metrics_path && conn->worker && strcmp(path, config.metrics_path) == 0) {
+            serve_metrics(conn);
+        } else {
+            serve_file(conn, path);
+        }
+    } else if (strcmp(method, "OPTIONS") == 0) {
+        send_options(conn);
+    } else {
+        send_error(conn, 501, "Not Implemented");
+    }
+}
+
+/**
+ * @brief Queue the response to the parsed request at the start of the
+ *        input buffer and consume it
+ * @param conn Client connection whose parser returned PARSE_DONE or PARSE_ERROR
+ */
+void process_request(Connection* conn) {
+    HTTPRequest* req = &conn->req;
+    size_t req_len = req->length;
+    // A request resumed after a pool open has already been counted and logged
+    int resumed = conn->opened != NULL;
+
+    if (!resumed) {
+        // Nothing of the previous request is still in use: a request is
+        // only processed once the response before it has been sent
+        arena_reset(&conn->arena, conn->worker ? &conn->worker->conns : NULL);
+        conn->requests++;
+    }
+    if (req->error_status != 0) {
+        conn->keep_alive = 0;
+    } else if (!resumed) {
+        // HTTP/1.1 defaults to persistent connections, HTTP/1.0 must opt in
+        if (req->version_minor >= 1) {
+            conn->keep_alive = !req->conn_close;
+        } else {
+            conn->keep_alive = req->conn_keep_alive && !req->conn_close;
+        }
+        if (conn->requests >= config.max_requests) {
+            conn->keep_alive = 0;
+        }
+        // A short body is read and discarded to keep the connection;
+        // anything else is left unread, so the connection cannot be reused
+        if (req->chunked || req->content_length > MAX_BODY_DISCARD) {
+            conn->keep_alive = 0;
+        } else if (req->content_length > 0) {
+            conn->body_remaining = req->content_length;
+        }
+    }
+    respond_request(conn);
+
+    // Left in the buffer until the pool finishes opening its file
+    if (conn->opening) return;
+    conn_release_opened(conn);
+    conn->offloads = 0;
+    unsigned long latency_us = conn->request_start ? (monotonic_ns() - conn->request_start) / 1000 : 0;
+    metrics_record(conn, latency_us);
+    access_log(conn, latency_us);
+
+    // Consume the request, keeping any pipelined bytes that follow it
+    conn->in_len -= req_len;
+    memmove(conn->in, conn->in + req_len, conn->in_len);
+    conn->in[conn->in_len] = '\0';
+    http_request_reset(req);
+
+    conn->state = CONN_WRITING;
+}
+
+/**
+ * @brief Write the request line and Host field of a rebuilt request
+ * @param req Request buffer
+ * @param front Bytes written so far, advanced past the line
+ * @param back End of the free space, where the pseudo-header values start
+ * @param pseudo Values of :method, :scheme, :authority and :path, NULL if absent
+ * @param pseudo_len Their lengths
+ * @return int 0 on success, 1 if a required pseudo-header is missing, 431 if out of room
+ */
+int h2_request_line(char* req, size_t* front, size_t back, const char* pseudo[4], const size_t pseudo_len[4]) {
+    static const char version[] = " HTTP/1.1\r\n";
+
+    if (!pseudo[0] || !pseudo[1] || !pseudo[3] || pseudo_len[3] == 0) return 1;
+    size_t len = pseudo_len[0] + 1 + pseudo_len[3] + sizeof(version) - 1;
+    if (pseudo[2]) len += 6 + pseudo_len[2] + 2;
+    if (len > back - *front) return 431;
+
+    char* p = req + *front;
+    memcpy(p, pseudo[0], pseudo_len[0]);
+    p += pseudo_len[0];
+    *p++ = ' ';
+    memcpy(p, pseudo[3], pseudo_len[3]);
+    p += pseudo_len[3];
+    memcpy(p, version, sizeof(version) - 1);
+    p += sizeof(version) - 1;
+    if (pseudo[2]) {
+        memcpy(p, "host: ", 6);
+        memcpy(p + 6, pseudo[2], pseudo_len[2]);
+        p += 6 + pseudo_len[2];
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    *front = p - req;
+    return 0;
+}
+
+/**
+ * @brief Decode a request header block into an HTTP/1.1 request
+ *
+ * The request is rebuilt in the session's request buffer for
+ * parse_http_request(), the pseudo-header fields becoming the request
+ * line and a Host field. Their values are parked at the end of the buffer
+ * until the first regular field, by which time RFC 9113 requires all of
+ * them to have arrived. A malformed request is still decoded to the end,
+ * to keep the dynamic table in step with the client's.
+ *
+ * @param s Session holding the complete header block
+ * @param len Receives the length of the rebuilt request
+ * @return int 0 on success, 1 if the request is malformed, 431 if it is
+ *         too large, -1 on a compression error
+ */
+int h2_decode_request(H2Session* s, size_t* len) {
+    static const char* const pseudo_names[4] = { ":method", ":scheme", ":authority", ":path" };
+    static const char* const hop_by_hop[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+    };
+    const unsigned char* p = (const unsigned char*)s->block;
+    const unsigned char* end = p + s->block_len;
+    char* req = s->request;
+    size_t front = 0;
+    size_t back = sizeof(s->request);
+    const char* pseudo[4] = { NULL, NULL, NULL, NULL };
+    size_t pseudo_len[4] = { 0, 0, 0, 0 };
+    int fields = 0;
+    int regular = 0;
+    int result = 0;
+
+    while (p < end) {
+        if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size updates may only open a block
+            uint32_t size;
+            if (fields > 0 || hpack_decode_int(&p, end, 5, &size) < 0 || size > H2_TABLE_SIZE) {
+                return -1;
+            }
+            hpack_table_resize(&s->decoder, size);
+            continue;
+        }
+
+        const char* name;
+        const char* value;
+        size_t name_len;
+        size_t value_len;
+        int field = hpack_decode_field(&s->decoder, &p, end, s->field, &name, &name_len,
+                                       &value, &value_len);
+        fields++;
+        if (field < 0) return -1;
+        if (field > 0 && result == 0) result = 431;
+        if (result != 0) continue;
+
+        for (size_t i = 0; i < value_len; i++) {
+            if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') result = 1;
+        }
+        if (result != 0) continue;
+
+        if (name_len > 0 && name[0] == ':') {
+            int k = 0;
+            while (k < 4 && (strlen(pseudo_names[k]) != name_len ||
+                             memcmp(pseudo_names[k], name, name_len) != 0)) {
+                k++;
+            }
+            if (regular || k == 4 || pseudo[k]) {
+                result = 1;
+            } else if (value_len > back - front) {
+                result = 431;
+            } else {
+                back -= value_len;
+                memcpy(req + back, value, value_len);
+                pseudo[k] = req + back;
+                pseudo_len[k] = value_len;
+            }
+            continue;
+        }
+
+        // Field names must be lowercase tokens; connection-specific fields
+        // are malformed in HTTP/2
+        result = name_len == 0;
+        for (size_t i = 0; i < name_len; i++) {
+            unsigned char c = name[i];
+            if (!tchar_table[c] || (c >= 'A' && c <= 'Z')) result = 1;
+        }
+        for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+            if (strlen(hop_by_hop[i]) == name_len && memcmp(hop_by_hop[i], name, name_len) == 0) {
+                result = 1;
+            }
+        }
+        if (name_len == 2 && memcmp(name, "te", 2) == 0 &&
+            (value_len != 8 || memcmp(value, "trailers", 8) != 0)) {
+            result = 1;
+        }
+        if (result != 0) continue;
+
+        if (!regular) {
+            regular = 1;
+            result = h2_request_line(req, &front, back, pseudo, pseudo_len);
+            back = sizeof(s->request);
+            if (result != 0) continue;
+        }
+        if (name_len + value_len + 4 > back - front) {
+            result = 431;
+            continue;
+        }
+        memcpy(req + front, name, name_len);
+        req[front + name_len] = ':';
+        req[front + name_len + 1] = ' ';
+        memcpy(req + front + name_len + 2, value, value_len);
+        front += name_len + 2 + value_len;
+        req[front++] = '\r';
+        req[front++] = '\n';
+    }
+
+    if (result != 0) return result;
+    if (!regular && (result = h2_request_line(req, &front, back, pseudo, pseudo_len)) != 0) {
+        return result;
+    }
+    if (front + 3 > sizeof(s->request)) return 431;
+    req[front++] = '\r';
+    req[front++] = '\n';
+    req[front] = '\0';
+    *len = front;
+    return 0;
+}
+
+/**
+ * @brief Fail an HTTP/2 connection
+ *
+ * Open streams are dropped, GOAWAY tells the client why, and the
+ * connection closes once it has been sent. Input is ignored from here on.
+ *
+ * @param conn HTTP/2 connection
+ * @param code Error code
+ */
+void h2_fail(Connection* conn, H2Error code) {
+    H2Session* s = conn->h2;
+    if (s->failed) return;
+    s->failed = 1;
+    s->draining = 1;
+    while (s->sending) {
+        H2Stream* st = s->sending;
+        s->sending = st->next;
+        h2_stream_close(s, st);
+    }
+    s->sending_tail = NULL;
+    h2_queue_goaway(conn, code);
+    conn->keep_alive = 0;
+}
+
+/**
+ * @brief Queue the HEADERS frame of a stream's response
+ *
+ * Translates the HTTP/1.1 response head the handlers queued into the
+ * session's response buffer. Bytes queued after the head (a short body,
+ * or the first part header of a multipart body) become the stream's
+ * pending body.
+ *
+ * @param conn HTTP/2 connection
+ * @param st Stream being answered, holding its file body
+ * @param len Bytes in the session's response buffer
+ */
+void h2_queue_headers(Connection* conn, H2Stream* st, size_t len) {
+    static const char* const dropped[] = { "connection", "keep-alive", "transfer-encoding" };
+    H2Session* s = conn->h2;
+    const char* resp = s->response;
+    const char* head_end = len > 12 ? memmem(resp, len, "\r\n\r\n", 4) : NULL;
+    size_t body_len = head_end ? len - (size_t)(head_end + 4 - resp) : 0;
+
+    if (!head_end || body_len > sizeof(st->pending)) {
+        h2_queue_rst(conn, st->id, H2_INTERNAL_ERROR);
+        h2_stream_close(s, st);
+        return;
+    }
+    memcpy(st->pending, head_end + 4, body_len);
+    st->pending_len = body_len;
+    if (st->file && st->remaining == 0 && st->range_count == 0) {
+        file_entry_release(st->file);
+        st->file = NULL;
+    }
+    int end_stream = st->pending_len == 0 && !st->file;
+
+    unsigned char frame[H2_FRAME_HEADER + 2 * H2_RESPONSE_MAX];
+    unsigned char* p = frame + H2_FRAME_HEADER;
+    if (s->encoder_resized) {
+        p = hpack_put_int(p, 0x20, 5, s->encoder.max_size);
+        s->encoder_resized = 0;
+    }
+
+    // :status is in the static table for the common codes
+    int status = (resp[9] - '0') * 100 + (resp[10] - '0') * 10 + (resp[11] - '0');
+    int index = 0;
+    switch (status) {
+    case 200: index = 8; break;
+    case 204: index = 9; break;
+    case 206: index = 10; break;
+    case 304: index = 11; break;
+    case 400: index = 12; break;
+    case 404: index = 13; break;
+    case 500: index = 14; break;
+    }
+    if (index) {
+        *p++ = 0x80 | index;
+    } else {
+        p = hpack_put_int(p, 0x00, 4, 8);
+        p = hpack_put_string(p, resp + 9, 3);
+    }
+
+    const char* line = (const char*)memchr(resp, '\n', head_end + 2 - resp) + 1;
+    while (line < head_end + 2) {
+        const char* eol = memchr(line, '\r', head_end + 2 - line);
+        const char* colon = memchr(line, ':', eol - line);
+        char name[64];
+        size_t name_len = colon ? (size_t)(colon - line) : sizeof(name);
+        int keep = name_len < sizeof(name);
+        for (size_t i = 0; keep && i < name_len; i++) {
+            name[i] = line[i] >= 'A' && line[i] <= 'Z' ? line[i] + ('a' - 'A') : line[i];
+        }
+        for (size_t i = 0; keep && i < sizeof(dropped) / sizeof(dropped[0]); i++) {
+            if (strlen(dropped[i]) == name_len && memcmp(dropped[i], name, name_len) == 0) keep = 0;
+        }
+        if (keep) {
+            const char* value = colon + 1;
+            while (value < eol && *value == ' ') value++;
+            p = hpack_encode_field(&s->encoder, p, name, name_len, value, eol - value);
+        }
+        line = eol + 2;
+    }
+
+    size_t block_len = p - frame - H2_FRAME_HEADER;
+    int flags = H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0);
+    h2_put_frame_header(frame, block_len, H2_HEADERS, flags, st->id);
+    if (conn_queue(conn, (const char*)frame, p - frame) < 0) {
+        // The encoder's table already holds the fields, so the connection
+        // cannot go on without this frame
+        h2_stream_close(s, st);
+        h2_fail(conn, H2_INTERNAL_ERROR);
+        return;
+    }
+    if (end_stream) {
+        h2_stream_close(s, st);
+    } else {
+        h2_sending_push(s, st);
+    }
+}
+
+/**
+ * @brief Answer a decoded request on a new stream
+ *
+ * The connection briefly takes the session's request and response buffers
+ * as its own, so the HTTP/1.1 handlers parse and answer the request as
+ * they would on a plain connection. The file body they attach moves to
+ * the stream. Opens are done in place rather than on the pool, since a
+ * waiting request would hold up every stream behind it.
+ *
+ * @param conn HTTP/2 connection
+ * @param st Newly opened stream
+ * @param len Length of the request rebuilt in the session's request buffer
+ * @param status Error status to answer with, 0 to parse the request
+ */
+void h2_respond(Connection* conn, H2Stream* st, size_t len, int status) {
+    H2Session* s = conn->h2;
+    char* in = conn->in;
+    size_t in_len = conn->in_len;
+    char* out = conn->out;
+    size_t out_len = conn->out_len;
+    size_t out_size = conn->out_size;
+
+    conn->in = s->request;
+    conn->in_len = len;
+    conn->out = s->response;
+    conn->out_len = 0;
+    conn->out_size = sizeof(s->response);
+    conn->h2 = NULL;
+    http_request_reset(&conn->req);
+    if (status != 0) {
+        conn->req.error_status = status;
+    } else if (parse_http_request(&conn->req, conn->in, len) != PARSE_DONE &&
+               conn->req.error_status == 0) {
+        conn->req.error_status = 400;
+    }
+
+    arena_reset(&conn->arena, conn->worker ? &conn->worker->conns : NULL);
+    conn->requests++;
+    // A stream cannot suspend for a pool open: the handlers run on the
+    // session's borrowed buffers, which the next frame reuses. With the
+    // request's pool opens used up, conn_open_file() opens in place.
+    conn->offloads = POOL_OPENS_MAX;
+    respond_request(conn);
+    conn->offloads = 0;
+    conn->h2 = s;
+    unsigned long latency_us = conn->request_start ? (monotonic_ns() - conn->request_start) / 1000 : 0;
+    metrics_record(conn, latency_us);
+    access_log(conn, latency_us);
+
+    st->file = conn->file;
+    st->offset = conn->file_offset;
+    st->remaining = conn->file_remaining;
+    st->range_count = conn->range_count;
+    st->range_next = conn->range_next;
+    if (st->range_count > 0) memcpy(st->ranges, conn->ranges, st->range_count * sizeof(ByteRange));
+    conn->file = NULL;
+    conn->file_fd = -1;
+    conn->body = NULL;
+    conn->range_count = 0;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+
+    size_t head_len = conn->out_len;
+    conn->in = in;
+    conn->in_len = in_len;
+    conn->out = out;
+    conn->out_len = out_len;
+    conn->out_size = out_size;
+    http_request_reset(&conn->req);
+    h2_queue_headers(conn, st, head_len);
+}
+
+/**
+ * @brief Act on a complete header block
+ * @param conn HTTP/2 connection
+ */
+void h2_on_header_block(Connection* conn) {
+    H2Session* s = conn->h2;
+    uint32_t id = s->block_stream;
+    size_t len = 0;
+
+    s->block_stream = 0;
+    int result = h2_decode_request(s, &len);
+    if (result < 0) {
+        h2_fail(conn, H2_COMPRESSION_ERROR);
+        return;
+    }
+    // Trailers, or a block on a stream already answered: nothing to add
+    if (id <= s->last_stream_id) return;
+    if (id % 2 == 0) {
+        h2_fail(conn, H2_PROTOCOL_ERROR);
+        return;
+    }
+    // Streams the client opens after a GOAWAY are ignored
+    if (s->draining) return;
+    s->last_stream_id = id;
+
+    if (result == 1) {
+        h2_queue_rst(conn, id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (s->stream_count == H2_MAX_STREAMS) {
+        h2_queue_rst(conn, id, H2_REFUSED_STREAM);
+        return;
+    }
+    H2Stream* st = h2_stream_open(s, id);
+    if (conn->worker) conn->worker->metrics.h2_streams++;
+    h2_respond(conn, st, len, result);
+
+    if (conn->requests >= config.max_requests && !s->draining) {
+        s->draining = 1;
+        h2_queue_goaway(conn, H2_NO_ERROR);
+    }
+}
+
+/**
+ * @brief Apply the client's SETTINGS
+ * @param conn HTTP/2 connection
+ * @param payload Frame payload
+ * @param len Payload length, a multiple of 6
+ * @return H2Error H2_NO_ERROR, or the connection error to fail with
+ */
+H2Error h2_on_settings(Connection* conn, const unsigned char* payload, size_t len) {
+    H2Session* s = conn->h2;
+
+    for (size_t i = 0; i < len; i += 6) {
+        unsigned id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = h2_get32(payload + i + 2);
+        switch (id) {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            if (value > H2_TABLE_SIZE) value = H2_TABLE_SIZE;
+            if (value != s->encoder.max_size) {
+                hpack_table_resize(&s->encoder, value);
+                s->encoder_resized = 1;
+            }
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) return H2_PROTOCOL_ERROR;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            // The change applies to the windows of the open streams too
+            if (value > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+            for (H2Stream* st = s->sending; st; st = st->next) {
+                st->window += (long)value - s->initial_window;
+                if (st->window > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+            }
+            s->initial_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            // Frames are never sent larger than the 16384 bytes every
+            // client accepts, so only the range is checked
+            if (value < H2_FRAME_MAX || value > 16777215) return H2_PROTOCOL_ERROR;
+            break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * @brief Apply a WINDOW_UPDATE
+ * @param conn HTTP/2 connection
+ * @param stream Stream, 0 for the connection
+ * @param increment Window size increment
+ * @return H2Error H2_NO_ERROR, or the connection error to fail with
+ */
+H2Error h2_on_window_update(Connection* conn, uint32_t stream, uint32_t increment) {
+    H2Session* s = conn->h2;
+
+    if (stream == 0) {
+        if (increment == 0) return H2_PROTOCOL_ERROR;
+        if (s->window + (long)increment > H2_WINDOW_MAX) return H2_FLOW_CONTROL_ERROR;
+        s->window += increment;
+        return H2_NO_ERROR;
+    }
+    if (stream > s->last_stream_id && !s->draining) return H2_PROTOCOL_ERROR;
+
+    // Updates for streams already answered are ignored
+    H2Stream* prev;
+    H2Stream* st = h2_stream_find(s, stream, &prev);
+    if (!st) return H2_NO_ERROR;
+    if (increment == 0 || st->window + (long)increment > H2_WINDOW_MAX) {
+        h2_queue_rst(conn, stream, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        h2_stream_remove(s, st, prev);
+        return H2_NO_ERROR;
+    }
+    st->window += increment;
+    return H2_NO_ERROR;
+}
+
+/**
+ * @brief Give back the stream window taken by discarded request body bytes
+ *
+ * Without this a client sending a body larger than the initial window
+ * on one stream would stall, since the body is never read.
+ *
+ * @param conn HTTP/2 connection
+ */
+void h2_refill_stream_window(Connection* conn) {
+    H2Session* s = conn->h2;
+    if (s->recv_stream_unacked > 0 &&
+        h2_queue_window_update(conn, s->recv_stream, s->recv_stream_unacked) == 0) {
+        s->recv_stream_unacked = 0;
+    }
+}
+
+/**
+ * @brief Start on the frame at the front of the unprocessed input
+ *
+ * Control frames are handled whole. DATA, HEADERS, CONTINUATION, GOAWAY
+ * and unknown frames only need their fixed fields here; the rest of their
+ * payload is taken by h2_process() as it arrives.
+ *
+ * @param conn HTTP/2 connection
+ * @param in Frame header and whatever follows it
+ * @param avail Bytes available at @p in, at least H2_FRAME_HEADER
+ * @return size_t Bytes consumed, 0 if more input is needed or the
+ *         connection failed
+ */
+size_t h2_frame_begin(Connection* conn, const unsigned char* in, size_t avail) {
+    H2Session* s = conn->h2;
+    size_t len = (size_t)in[0] << 16 | in[1] << 8 | in[2];
+    int type = in[3];
+    int flags = in[4];
+    uint32_t stream = h2_get32(in + 5) & 0x7fffffff;
+    const unsigned char* payload = in + H2_FRAME_HEADER;
+    H2Error error = H2_NO_ERROR;
+
+    // The preface ends with SETTINGS, and header blocks are contiguous
+    if ((!s->settings_seen && type != H2_SETTINGS) || type == H2_PUSH_PROMISE ||
+        (s->block_stream ? type != H2_CONTINUATION || stream != s->block_stream
+                         : type == H2_CONTINUATION)) {
+        error = H2_PROTOCOL_ERROR;
+    } else if (len > H2_FRAME_MAX) {
+        error = H2_FRAME_SIZE_ERROR;
+    }
+
+    if (!error && (type == H2_DATA || type == H2_HEADERS || type == H2_CONTINUATION ||
+                   type == H2_GOAWAY || type > H2_CONTINUATION)) {
+        size_t prefix = 0;
+        if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) prefix = 1;
+        if (type == H2_HEADERS && (flags & H2_FLAG_PRIORITY)) prefix += 5;
+        if (type == H2_GOAWAY) prefix = 8;
+        if (len < prefix) {
+            h2_fail(conn, type == H2_GOAWAY ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        if (avail < H2_FRAME_HEADER + prefix) return 0;
+        size_t pad = (type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED) ? payload[0] : 0;
+
+        if (pad > len - prefix) {
+            error = H2_PROTOCOL_ERROR;
+        } else if (type == H2_DATA) {
+            // Request bodies are not used, but they count against the
+            // connection's flow control window all the same
+            if (stream == 0 || (stream > s->last_stream_id && !s->draining)) error = H2_PROTOCOL_ERROR;
+            s->recv_unacked += len;
+            if (stream != s->recv_stream) {
+                h2_refill_stream_window(conn);
+                s->recv_stream = stream;
+                s->recv_stream_unacked = 0;
+            }
+            // The last frame of a body needs no window after it
+            if (flags & H2_FLAG_END_STREAM) s->recv_stream_unacked = 0;
+            else s->recv_stream_unacked += len;
+        } else if (type == H2_HEADERS) {
+            if (stream == 0) error = H2_PROTOCOL_ERROR;
+            s->block_stream = stream;
+            s->block_len = 0;
+        } else if (type == H2_GOAWAY) {
+            if (stream != 0) error = H2_PROTOCOL_ERROR;
+            s->draining = 1;
+        }
+        if (error) {
+            h2_fail(conn, error);
+            return 0;
+        }
+        s->frame_open = 1;
+        s->frame_type = type;
+        s->frame_flags = flags;
+        s->frame_left = len - prefix - pad;
+        s->frame_skip = pad;
+        return H2_FRAME_HEADER + prefix;
+    }
+
+    if (!error && len > H2_CONTROL_MAX) error = H2_FRAME_SIZE_ERROR;
+    if (error) {
+        h2_fail(conn, error);
+        return 0;
+    }
+    if (avail < H2_FRAME_HEADER + len) return 0;
+
+    H2Stream* st;
+    H2Stream* prev;
+    switch (type) {
+    case H2_PRIORITY:
+        if (stream == 0) {
+            error = H2_PROTOCOL_ERROR;
+        } else if (len != 5) {
+            h2_queue_rst(conn, stream, H2_FRAME_SIZE_ERROR);
+        }
+        break;
+    case H2_RST_STREAM:
+        if (stream == 0 || (stream > s->last_stream_id && !s->draining)) {
+            error = H2_PROTOCOL_ERROR;
+        } else if (len != 4) {
+            error = H2_FRAME_SIZE_ERROR;
+        } else if ((st = h2_stream_find(s, stream, &prev))) {
+            h2_stream_remove(s, st, prev);
+        }
+        break;
+    case H2_SETTINGS:
+        if (stream != 0) {
+            error = H2_PROTOCOL_ERROR;
+        } else if (len % 6 != 0 || ((flags & H2_FLAG_ACK) && len != 0)) {
+            error = H2_FRAME_SIZE_ERROR;
+        } else if (!(flags & H2_FLAG_ACK) && (error = h2_on_settings(conn, payload, len)) == H2_NO_ERROR) {
+            s->settings_seen = 1;
+            h2_queue_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, payload, 0);
+        }
+        break;
+    case H2_PING:
+        if (stream != 0) {
+            error = H2_PROTOCOL_ERROR;
+        } else if (len != 8) {
+            error = H2_FRAME_SIZE_ERROR;
+        } else if (!(flags & H2_FLAG_ACK)) {
+            h2_queue_frame(conn, H2_PING, H2_FLAG_ACK, 0, payload, len);
+        }
+        break;
+    case H2_WINDOW_UPDATE:
+        if (len != 4) {
+            error = H2_FRAME_SIZE_ERROR;
+        } else {
+            error = h2_on_window_update(conn, stream, h2_get32(payload) & 0x7fffffff);
+        }
+        break;
+    }
+    if (error) {
+        h2_fail(conn, error);
+        return 0;
+    }
+    return H2_FRAME_HEADER + len;
+}
+
+/**
+ * @brief Process the frames received on an HTTP/2 connection
+ *
+ * Consumes every complete frame, and every piece of a large one, as long
+ * as the output buffer has room for what they may queue, then queues DATA
+ * for the streams that can send.
+ *
+ * @param conn HTTP/2 connection in CONN_READING state
+ */
+void h2_process(Connection* conn) {
+    H2Session* s = conn->h2;
+    const unsigned char* in = (const unsigned char*)conn->in;
+    size_t pos = 0;
+
+    while (!s->failed && conn->out_size - conn->out_len >= PIPELINE_RESERVE) {
+        if (!s->frame_open) {
+            if (conn->in_len - pos < H2_FRAME_HEADER) break;
+            size_t used = h2_frame_begin(conn, in + pos, conn->in_len - pos);
+            if (used == 0) break;
+            pos += used;
+            continue;
+        }
+
+        size_t take = conn->in_len - pos;
+        if (take > s->frame_left) take = s->frame_left;
+        if (s->frame_type == H2_HEADERS || s->frame_type == H2_CONTINUATION) {
+            if (take > sizeof(s->block) - s->block_len) {
+                h2_fail(conn, H2_ENHANCE_YOUR_CALM);
+                break;
+            }
+            memcpy(s->block + s->block_len, in + pos, take);
+            s->block_len += take;
+        }
+        pos += take;
+        s->frame_left -= take;
+        size_t skip = conn->in_len - pos;
+        if (skip > s->frame_skip) skip = s->frame_skip;
+        pos += skip;
+        s->frame_skip -= skip;
+        if (s->frame_left > 0 || s->frame_skip > 0) break;
+
+        s->frame_open = 0;
+        if ((s->frame_type == H2_HEADERS || s->frame_type == H2_CONTINUATION) &&
+            (s->frame_flags & H2_FLAG_END_HEADERS)) {
+            h2_on_header_block(conn);
+        }
+    }
+
+    if (s->failed) pos = conn->in_len;
+    if (pos > 0) {
+        conn->in_len -= pos;
+        memmove(conn->in, conn->in + pos, conn->in_len);
+        conn->in[conn->in_len] = '\0';
+    }
+    if (!s->failed) {
+        if (s->recv_unacked >= H2_WINDOW_UPDATE_AT &&
+            h2_queue_window_update(conn, 0, s->recv_unacked) == 0) {
+            s->recv_unacked = 0;
+        }
+        if (s->recv_stream_unacked >= H2_WINDOW_UPDATE_AT) h2_refill_stream_window(conn);
+        h2_queue_data(conn);
+    }
+    // A connection to close goes through CONN_WRITING even with nothing to send
+    if (conn->out_len > 0 || conn->file || !conn->keep_alive) conn->state = CONN_WRITING;
+}
+
+/** Connection preface an HTTP/2 client opens with (RFC 9113 section 3.4) */
+static const char h2_preface[H2_PREFACE_LEN + 1] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/**
+ * @brief Switch a connection that sent the HTTP/2 preface to HTTP/2
+ * @param conn Client connection whose input starts with the whole preface
+ */
+void h2_start(Connection* conn) {
+    H2Session* s = h2_session_get(conn->worker ? &conn->worker->conns : NULL);
+    if (!s) {
+        perror("malloc failed");
+        conn->keep_alive = 0;
+        conn->state = CONN_WRITING;
+        return;
+    }
+    h2_session_init(s);
+    conn->h2 = s;
+    conn->in_len -= H2_PREFACE_LEN;
+    memmove(conn->in, conn->in + H2_PREFACE_LEN, conn->in_len);
+    conn->in[conn->in_len] = '\0';
+
+    // Our SETTINGS: the stream limit and the header size limit; the
+    // other settings keep their defaults
+    unsigned char settings[12];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    h2_put32(settings + 8, config.max_header_size);
+    h2_queue_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (conn->worker) conn->worker->metrics.h2_connections++;
+}
+
+/**
+ * @brief Drop buffered bytes of a request body the server does not use
+ * @param conn Client connection
+ */
+void conn_discard_body(Connection* conn) {
+    size_t len = conn->body_remaining < (off_t)conn->in_len ? (size_t)conn->body_remaining
+                                                           : conn->in_len;
+    conn->in_len -= len;
+    memmove(conn->in, conn->in + len, conn->in_len);
+    conn->in[conn->in_len] = '\0';
+    conn->body_remaining -= len;
+}
+
+/**
+ * @brief Queue responses for every complete request that fits behind the
+ *        responses already pending
+ *
+ * Responses leave in request order: a request is only processed once any
+ * file body queued before it has been sent and any pool open it waits on
+ * has finished, and nothing after a non-persistent response is processed.
+ *
+ * @param conn Client connection
+ */
+void process_pipeline(Connection* conn) {
+    // Nothing may be queued behind a frame payload attached as the file body
+    if (conn->h2) {
+        if (!conn->file) h2_process(conn);
+        return;
+    }
+    // A client with prior knowledge of HTTP/2 opens with the preface
+    if (config.http2 && conn->requests == 0 && conn->in_len > 0 &&
+        memcmp(conn->in, h2_preface, conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN) == 0) {
+        if (conn->in_len < H2_PREFACE_LEN) return;
+        h2_start(conn);
+        if (conn->h2) h2_process(conn);
+        return;
+    }
+
+    while (conn->keep_alive && !conn->file && !conn->opening && conn->in_len > 0 &&
+           conn->out_size - conn->out_len >= PIPELINE_RESERVE) {
+        if (conn->body_remaining > 0) {
+            conn_discard_body(conn);
+            if (conn->body_remaining > 0) break;
+        }
+        if (parse_http_request(&conn->req, conn->in, conn->in_len) == PARSE_NEED_MORE) {
+            break;
+        }
+        process_request(conn);
+    }
+}
+
+/**
+ * @brief Put a descriptor into non-blocking mode
+ * @param fd Descriptor to modify
+ * @return int 0 on success, -1 on error
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief Turn off Nagle's algorithm on a client socket
+ *
+ * On a persistent connection the last partial segment of a response
+ * would otherwise wait for the client's delayed ACK. Headers and body
+ * are still grouped with MSG_MORE where they go out in separate calls.
+ *
+ * @param fd Connected socket
+ */
+void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/**
+ * @brief Handle individual client connection (fork engine)
+ * @param client_sock Client socket descriptor
+ * @param client_addr Client address information
+ */
+void handle_client(int client_sock, struct sockaddr_in* client_addr) {
+    Connection conn;
+    conn_init(&conn, NULL, client_sock, client_addr);
+
+    // Every wait goes through poll() with the deadline of the phase the
+    // connection is in; sendfile() and splice() ignore SO_SNDTIMEO
+    set_nonblocking(client_sock);
+    set_nodelay(client_sock);
+    time_t request_start = monotonic_seconds();
+
+    while (1) {
+        process_pipeline(&conn);
+
+        if (conn.state == CONN_WRITING) {
+            int result = conn_flush(&conn);
+            if (result == 0) {
+                struct pollfd pfd = { client_sock, POLLOUT, 0 };
+                if (poll(&pfd, 1, config.write_timeout * 1000) <= 0) break;
+                continue;
+            }
+            if (result < 0 || !conn.keep_alive) break;
+            conn.state = CONN_READING;
+            request_start = monotonic_seconds();
+            continue;
+        }
+
+        // The header deadline covers the whole header, however it trickles in
+        int seconds;
+        if (conn.body_remaining > 0) {
+            seconds = config.body_timeout;
+        } else if (conn.in_len > 0 || conn.requests == 0) {
+            seconds = config.header_timeout - (int)(monotonic_seconds() - request_start);
+        } else {
+            seconds = config.idle_timeout;
+        }
+        struct pollfd pfd = { client_sock, POLLIN, 0 };
+        if (seconds <= 0 || poll(&pfd, 1, seconds * 1000) <= 0) break;
+
+        size_t room = conn_in_room(&conn);
+        if (room == 0) break;
+        ssize_t bytes_read = read(client_sock, conn.in + conn.in_len, room);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (bytes_read <= 0) break;
+        if (conn.in_len == 0 && conn.body_remaining == 0 && conn.requests > 0) {
+            request_start = monotonic_seconds();
+        }
+        if (conn.in_len == 0) conn.request_start = monotonic_ns();
+        conn.in_len += bytes_read;
+        conn.in[conn.in_len] = '\0';
+    }
+
+    conn_close(&conn);
+    exit(0); // Important for forked process
+}
+
+/**
+ * @brief Signal handler for zombie processes
+ * @param sig Signal number
+ */
+void zombie_handler(int sig) {
+    (void)sig;
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+}
+
+/**
+ * @brief Read available request bytes into the input buffer
+ * @param conn Client connection
+ *
+ * Edge-triggered: reads until the socket would block, the buffer is full
+ * or the peer closes. Bytes are read in any state so pipelined requests
+ * queue up while earlier responses are still being written.
+ */
+void conn_read_available(Connection* conn) {
+    size_t room;
+    while (conn->readable && (room = conn_in_room(conn)) > 0) {
+        ssize_t bytes_read = read(conn->fd, conn->in + conn->in_len, room);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn->state = CONN_CLOSING;
+            conn->readable = 0;
+            break;
+        }
+        if (bytes_read == 0) {
+            conn->peer_closed = 1;
+            conn->readable = 0;
+            break;
+        }
+
+        if (conn->in_len == 0) conn->request_start = monotonic_ns();
+        conn->in_len += bytes_read;
+        conn->in[conn->in_len] = '\0';
+    }
+}
+
+/**
+ * @brief Advance a connection's state machine as far as it can go
+ * @param conn Client connection
+ */
+void conn_advance(Connection* conn) {
+    while (conn->state != CONN_CLOSING) {
+        if (conn->state == CONN_READING) {
+            process_pipeline(conn);
+            if (conn->state == CONN_READING) {
+                // Discarding a request body, or taking in HTTP/2 frames,
+                // made room for more input the edge will not announce again
+                if ((conn->body_remaining > 0 || conn->h2) && conn->readable &&
+                    conn->in_len < conn->in_size - 1) {
+                    conn_read_available(conn);
+                    continue;
+                }
+                if (conn->peer_closed && !conn->opening) conn->state = CONN_CLOSING;
+                break;
+            }
+        }
+
+        // Also entered right after a request completes, since the EPOLLOUT
+        // edge may already have been consumed
+        int result = conn_flush(conn);
+        if (result == 0) break;
+        // keep_alive already describes a request still waiting on the pool
+        if (result < 0 || (!conn->keep_alive && !conn->opening)) {
+            conn->state = CONN_CLOSING;
+            break;
+        }
+
+        // Responses sent; pick up requests that arrived meanwhile
+        conn->state = CONN_READING;
+        conn_read_available(conn);
+    }
+}
+
+/**
+ * @brief Close a connection owned by the epoll engine and free it
+ * @param worker Worker owning the connection
+ * @param conn Client connection
+ */
+void epoll_close_conn(Worker* worker, Connection* conn) {
+    timer_cancel(&worker->timers, &conn->timer);
+    worker->metrics.active--;
+    conn_close(conn);
+    // A pool open in flight lives in the connection's arena; its
+    // completion returns the connection instead
+    if (!conn->opening) conn_pool_put(&worker->conns, conn);
+}
+
+/**
+ * @brief Drive a connection's state machine after an epoll notification
+ * @param worker Worker owning the connection
+ * @param conn Client connection
+ * @param events Ready events reported by epoll
+ */
+void conn_on_event(Worker* worker, Connection* conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        conn->state = CONN_CLOSING;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        conn->readable = 1;
+        conn_read_available(conn);
+    }
+
+    conn_advance(conn);
+
+    if (conn->state == CONN_CLOSING) {
+        epoll_close_conn(worker, conn);
+    } else {
+        conn_update_timer(worker, conn, events & EPOLLIN, events & EPOLLOUT);
+        conn_release_buffers(conn, 0);
+    }
+}
+
+/**
+ * @brief Finish the requests whose pool opens have completed
+ * @param worker Worker owning the connections
+ */
+void epoll_resume_conns(Worker* worker) {
+    while (worker->resume_head) {
+        Connection* conn = worker->resume_head;
+        worker->resume_head = conn->resume_next;
+        conn->resume_next = NULL;
+
+        process_request(conn);
+        conn_advance(conn);
+        if (conn->state == CONN_CLOSING) {
+            epoll_close_conn(worker, conn);
+        } else {
+            conn_update_timer(worker, conn, 0, 0);
+            conn_release_buffers(conn, 0);
+        }
+    }
+}
+
+/**
+ * @brief Accept all pending connections and register them with epoll
+ * @param worker Worker owning the listener
+ */
+void accept_connections(Worker* worker) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept4(worker->listen_sock, (struct sockaddr*)&client_addr,
+                                  &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                worker->metrics.accept_errors++;
+                perror("accept failed");
+            }
+            return;
+        }
+        set_nodelay(client_sock);
+
+        Connection* conn = conn_pool_get(&worker->conns);
+        if (!conn) {
+            perror("malloc failed");
+            close(client_sock);
+            continue;
+        }
+        conn_init(conn, worker, client_sock, &client_addr);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close(client_sock);
+            conn_pool_put(&worker->conns, conn);
+            continue;
+        }
+        worker->metrics.accepted++;
+        worker->metrics.active++;
+        conn_update_timer(worker, conn, 0, 0);
+    }
+}
+
+/**
+ * @brief Serve clients from an edge-triggered epoll loop
+ * @param worker Worker whose listener and epoll instance to drive
+ */
+void run_epoll_engine(Worker* worker) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    worker->epfd = epfd;
+    worker_update_clock(worker);
+
+    set_nonblocking(worker->listen_sock);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker->listen_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    if (worker->files.inotify_fd >= 0) {
+        ev.data.ptr = &worker->files;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker->files.inotify_fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (config.engine == ENGINE_POOL) {
+        worker->task_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.data.ptr = &worker->task_fd;
+        if (worker->task_fd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, worker->task_fd, &ev) < 0) {
+            perror("eventfd failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Sleep until the timer wheel next has a slot due
+        long ticks = timer_wheel_next(&worker->timers);
+        int n = epoll_wait(epfd, events, MAX_EVENTS, ticks < 0 ? -1 : (int)ticks * 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        worker_update_clock(worker);
+
+        int tasks_done = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(worker);
+            } else if (events[i].data.ptr == &worker->files) {
+                file_cache_drain(&worker->files);
+            } else if (events[i].data.ptr == &worker->task_fd) {
+                tasks_done = 1;
+            } else {
+                conn_on_event(worker, events[i].data.ptr, events[i].events);
+            }
+        }
+
+        // Resuming may close a connection, which must not happen while a
+        // later entry in this batch can still point at it
+        if (tasks_done) {
+            task_collect(worker);
+            epoll_resume_conns(worker);
+        }
+
+        Timer* timer = timer_wheel_advance(&worker->timers, worker->now);
+        while (timer) {
+            Timer* next = timer->next;
+            worker->timeouts[timer->kind]++;
+            epoll_close_conn(worker, conn_from_timer(timer));
+            timer = next;
+        }
+    }
+
+    close(epfd);
+}
+
+#if HAVE_IO_URING
+
+/**
+ * @enum UringOp
+ * @brief Operation tag stored in the low bits of an SQE's user_data
+ */
+typedef enum {
+    UOP_ACCEPT = 0,     /**< Multishot accept on the listener */
+    UOP_RECV = 1,       /**< Multishot recv into the provided buffer ring */
+    UOP_SEND = 2,       /**< Send of the connection's output buffer */
+    UOP_READ = 3,       /**< File body read linked to the following send */
+    UOP_TICK = 4,       /**< Once-a-second timeout driving the timer wheel */
+    UOP_SPLICE_IN = 5,  /**< File body splice into the connection's pipe */
+    UOP_SPLICE_OUT = 6, /**< Pipe splice into the socket */
+    UOP_NOTIFY = 7      /**< Multishot poll on the file cache's inotify descriptor */
+} UringOp;
+
+#define UOP_MASK 7
+
+/**
+ * @struct Uring
+ * @brief Minimal io_uring instance with a provided buffer ring for recv
+ */
+typedef struct {
+    int fd;                         /**< Ring descriptor */
+    unsigned* sq_head;              /**< Submission queue head (kernel) */
+    unsigned* sq_tail;              /**< Submission queue tail (us) */
+    unsigned sq_mask;               /**< Submission queue index mask */
+    unsigned* sq_array;             /**< Submission index array */
+    struct io_uring_sqe* sqes;      /**< Submission queue entries */
+    unsigned sq_pending;            /**< SQEs queued but not yet submitted */
+    unsigned* cq_head;              /**< Completion queue head (us) */
+    unsigned* cq_tail;              /**< Completion queue tail (kernel) */
+    unsigned cq_mask;               /**< Completion queue index mask */
+    struct io_uring_cqe* cqes;      /**< Completion queue entries */
+    void* ring_mem;                 /**< Mapped SQ/CQ rings */
+    size_t ring_size;               /**< Size of @c ring_mem */
+    size_t sqes_size;               /**< Size of the @c sqes mapping */
+    struct io_uring_buf_ring* br;   /**< Provided buffer ring */
+    char* bufs;                     /**< Backing memory for provided buffers */
+} Uring;
+
+/**
+ * @brief Tear down a ring and its mappings
+ * @param ring Ring to release
+ */
+void uring_destroy(Uring* ring) {
+    if (ring->br) munmap(ring->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(ring->bufs);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_mem) munmap(ring->ring_mem, ring->ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * @brief Create a ring and register the recv provided buffer ring
+ * @param ring Ring to initialize
+ * @return int 0 on success, -1 if the kernel lacks the required support
+ */
+int uring_init(Uring* ring) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    // SINGLE_ISSUER also proves a 6.0+ kernel, which multishot recv needs
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        uring_destroy(ring);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        ring->ring_mem = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    char* base = ring->ring_mem;
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    // Provided buffer ring: recv picks a free buffer only when data arrives
+    ring->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ring->br == MAP_FAILED || !ring->bufs) {
+        if (ring->br == MAP_FAILED) ring->br = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_destroy(ring);
+        return -1;
+    }
+
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+        struct io_uring_buf* buf = &ring->br->bufs[bid];
+        buf->addr = (unsigned long)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+        buf->len = URING_BUF_SIZE;
+        buf->bid = bid;
+    }
+    __atomic_store_n(&ring->br->tail, URING_BUF_COUNT, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Hand a consumed provided buffer back to the kernel
+ * @param ring Ring owning the buffer
+ * @param bid Buffer id reported in the CQE
+ */
+void uring_recycle_buf(Uring* ring, unsigned short bid) {
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf* buf = &ring->br->bufs[tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Submit queued SQEs and optionally wait for completions
+ * @param ring Ring to enter
+ * @param wait_nr Completions to wait for
+ * @return int 0 on success, -1 on error
+ */
+int uring_submit(Uring* ring, unsigned wait_nr) {
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring->sq_pending -= (unsigned)ret < ring->sq_pending ? (unsigned)ret : ring->sq_pending;
+            return 0;
+        }
+        if (errno == EINTR) continue;
+        // Completion queue full: reap before submitting more
+        if (errno == EBUSY || errno == EAGAIN) return 0;
+        return -1;
+    }
+}
+
+/**
+ * @brief Get a zeroed SQE, flushing the submission queue if it is full
+ * @param ring Ring to queue on
+ * @param op Operation tag for user_data
+ * @param conn Connection the operation belongs to, NULL for the listener
+ * @return struct io_uring_sqe* Entry to fill in
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* ring, UringOp op, Connection* conn) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+        uring_submit(ring, 0);
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long)conn | op;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    if (conn) conn->pending_ops++;
+    return sqe;
+}
+
+/**
+ * @brief Queue a multishot accept on the worker's listener
+ * @param ring Ring to queue on
+ * @param listen_sock Listening socket
+ */
+void uring_arm_accept(Uring* ring, int listen_sock) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_ACCEPT, NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * @brief Queue a multishot recv drawing from the provided buffer ring
+ * @param ring Ring to queue on
+ * @param conn Client connection
+ */
+void uring_arm_recv(Uring* ring, Connection* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_RECV, conn);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    conn->recv_armed = 1;
+}
+
+/**
+ * @brief Queue a send of the unsent part of the output buffer
+ * @param ring Ring to queue on
+ * @param conn Client connection
+ * @param flags SQE flags (IOSQE_IO_LINK when chained)
+ */
+void uring_queue_send(Uring* ring, Connection* conn, unsigned flags) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_SEND, conn);
+    sqe->fd = conn->fd;
+    sqe->flags = flags;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    // A send linked to a body splice holds its last partial segment back
+    if (flags & IOSQE_IO_LINK) sqe->msg_flags |= MSG_MORE;
+    if (conn->body) {
+        // Headers and a cached body leave in a single sendmsg()
+        conn_body_iov(conn, conn->iov);
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = 2;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (unsigned long)&conn->msg;
+        sqe->len = 1;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (unsigned long)(conn->out + conn->out_sent);
+        sqe->len = conn->out_len - conn->out_sent;
+    }
+    conn->chain_pending++;
+}
+
+/**
+ * @brief Queue a splice between two descriptors
+ * @param ring Ring to queue on
+ * @param conn Client connection
+ * @param op UOP_SPLICE_IN (file -> pipe) or UOP_SPLICE_OUT (pipe -> socket)
+ * @param len Bytes to move
+ * @param flags SQE flags (IOSQE_IO_LINK when chained)
+ */
+void uring_queue_splice(Uring* ring, Connection* conn, UringOp op, size_t len, unsigned flags) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, op, conn);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->flags = flags;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    // A pipe splice either drains an earlier chunk or follows the one
+    // being spliced in; either way more body follows if file bytes remain
+    if (op == UOP_SPLICE_OUT &&
+        conn->file_remaining > (conn->pipe_len > 0 ? 0 : (off_t)len)) {
+        sqe->splice_flags |= SPLICE_F_MORE;
+    }
+    if (op == UOP_SPLICE_IN) {
+        sqe->splice_fd_in = conn->file_fd;
+        sqe->splice_off_in = conn->file_offset;
+        sqe->fd = conn->pipe_fds[1];
+        sqe->off = -1;
+    } else {
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = -1;
+        sqe->fd = conn->fd;
+        sqe->off = -1;
+    }
+    conn->chain_pending++;
+}
+
+/**
+ * @brief Queue the next part of a response as one linked chain
+ *
+ * With zero-copy enabled the headers are sent, then the next body chunk is
+ * spliced file -> pipe -> socket, all linked in one submission. In copy
+ * mode the free tail of the output buffer is filled by a file read linked
+ * to the send of the whole buffer. A short step breaks the link and the
+ * remainder is picked up by the next call.
+ *
+ * @param ring Ring to queue on
+ * @param conn Client connection in CONN_WRITING state
+ * @return int 1 if something was queued, 0 if the response is complete
+ */
+int uring_continue_send(Uring* ring, Connection* conn) {
+    if (conn->out_sent == conn->out_len) {
+        conn->out_len = 0;
+        conn->out_sent = 0;
+    }
+    // A body part is finished once its bytes and everything queued before
+    // them have left; then the next multipart part starts or the file is done
+    if (conn->file && conn->file_remaining == 0 && conn->pipe_len == 0 && conn->out_len == 0 &&
+        !conn_next_part(conn)) {
+        conn_release_file(conn);
+    }
+
+    if (conn->body) {
+        uring_queue_send(ring, conn, 0);
+        return 1;
+    }
+
+    if (conn->file_fd >= 0 && config.zerocopy != ZC_COPY &&
+        (conn->file_remaining > 0 || conn->pipe_len > 0)) {
+        if (conn->out_sent < conn->out_len) {
+            uring_queue_send(ring, conn, IOSQE_IO_LINK);
+        }
+        if (conn->pipe_len > 0) {
+            uring_queue_splice(ring, conn, UOP_SPLICE_OUT, conn->pipe_len, 0);
+        } else if (conn_open_pipe(conn) == 0) {
+            size_t chunk = conn->file_remaining < PIPE_CHUNK ? conn->file_remaining : PIPE_CHUNK;
+            conn->read_len = chunk;
+            uring_queue_splice(ring, conn, UOP_SPLICE_IN, chunk, IOSQE_IO_LINK);
+            uring_queue_splice(ring, conn, UOP_SPLICE_OUT, chunk, 0);
+        } else {
+            conn->chain_failed = 1;
+        }
+        return conn->chain_pending > 0;
+    }
+
+    if (conn->file_fd >= 0 && conn->file_remaining > 0 && conn->out_sent == 0 &&
+        conn->out_len < conn->out_size) {
+        if (conn_out_buffer(conn) < 0) {
+            conn->chain_failed = 1;
+            return 0;
+        }
+        size_t chunk = conn->out_size - conn->out_len;
+        if ((off_t)chunk > conn->file_remaining) chunk = conn->file_remaining;
+
+        struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_READ, conn);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = conn->file_fd;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->addr = (unsigned long)(conn->out + conn->out_len);
+        sqe->len = chunk;
+        sqe->off = conn->file_offset;
+        conn->chain_pending++;
+
+        // The linked send covers the chunk; a short read cancels it
+        conn->read_len = chunk;
+        conn->out_len += chunk;
+        uring_queue_send(ring, conn, 0);
+        return 1;
+    }
+
+    if (conn->out_sent < conn->out_len) {
+        uring_queue_send(ring, conn, 0);
+        return 1;
+    }
+    return 0;
+}
 
 /**
- * @struct HTTPRequest
- * @brief Parsed HTTP request structure
+ * @brief Begin closing a connection; it is freed once no requests are in flight
+ * @param worker Worker owning the connection
+ * @param conn Client connection
  */
-typedef struct {
-    char method[16];    /**< HTTP method (GET, POST, etc.) */
-    char path[256];     /**< Requested resource path */
-    char version[16];   /**< HTTP version */
-} HTTPRequest;
+void uring_close_conn(Worker* worker, Connection* conn) {
+    if (conn->state != CONN_CLOSING) {
+        conn->state = CONN_CLOSING;
+        timer_cancel(&worker->timers, &conn->timer);
+        // Shutdown completes the armed recv and fails any stalled send
+        shutdown(conn->fd, SHUT_RDWR);
+        if (conn->h2) h2_session_release(conn);
+        conn_release_file(conn);
+        if (conn->pipe_fds[0] >= 0) {
+            close(conn->pipe_fds[0]);
+            close(conn->pipe_fds[1]);
+            conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        }
+        close(conn->fd);
+    }
+    if (conn->pending_ops == 0) {
+        worker->metrics.active--;
+        conn_release_buffers(conn, 1);
+        conn_pool_put(&worker->conns, conn);
+    }
+}
 
 /**
- * @brief Parse HTTP request line
- * @param request_line The first line of HTTP request
- * @param req Pointer to HTTPRequest structure to populate
- * @return int 0 on success, -1 on error
+ * @brief Move held recv buffers into the input buffer as room allows
+ * @param ring Ring owning the buffers
+ * @param conn Client connection
  */
-int parse_http_request(const char* request_line, HTTPRequest* req) {
-    return sscanf(request_line, "%15s %255s %15s", 
-                  req->method, req->path, req->version) == 3 ? 0 : -1;
+void uring_drain_held(Uring* ring, Connection* conn) {
+    while (conn->held_count > 0) {
+        size_t room = conn_in_room(conn);
+        if (room == 0) break;
+        size_t left = conn->held[0].len - conn->held[0].off;
+        size_t len = left < room ? left : room;
+
+        if (conn->in_len == 0 && len > 0) conn->request_start = monotonic_ns();
+        memcpy(conn->in + conn->in_len,
+               ring->bufs + (size_t)conn->held[0].bid * URING_BUF_SIZE + conn->held[0].off, len);
+        conn->in_len += len;
+        conn->in[conn->in_len] = '\0';
+        conn->held[0].off += len;
+        if (len < left) break;
+
+        uring_recycle_buf(ring, conn->held[0].bid);
+        conn->held_count--;
+        memmove(&conn->held[0], &conn->held[1], conn->held_count * sizeof(conn->held[0]));
+    }
 }
 
 /**
- * @brief Get MIME type based on file extension
- * @param filename File name to check
- * @return const char* MIME type string
+ * @brief Take ownership of a received buffer's bytes
+ *
+ * Bytes go straight into the input buffer; whatever does not fit (a deep
+ * pipeline behind a slow response) stays in the provided buffer until
+ * earlier requests are consumed.
+ *
+ * @param ring Ring owning the buffer
+ * @param conn Client connection
+ * @param bid Provided buffer id
+ * @param len Bytes received
+ * @return int 0 on success, -1 if the client is too far ahead
  */
-const char* get_mime_type(const char* filename) {
-    const char *ext = strrchr(filename, '.');
-    if (!ext) return "text/plain";
-    
-    if (strcmp(ext, ".html") == 0) return "text/html";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".js") == 0) return "application/javascript";
-    if (strcmp(ext, ".json") == 0) return "application/json";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    
-    return "text/plain";
+int uring_stash(Uring* ring, Connection* conn, unsigned short bid, size_t len) {
+    // An HTTP/2 client may send a whole connection window of DATA while
+    // a response is still going out, so it gets room for 64 KiB
+    if (conn->held_count == (conn->h2 ? URING_HELD_H2 : URING_HELD_MAX)) {
+        uring_recycle_buf(ring, bid);
+        return -1;
+    }
+    conn->held[conn->held_count].bid = bid;
+    conn->held[conn->held_count].off = 0;
+    conn->held[conn->held_count].len = len;
+    conn->held_count++;
+    uring_drain_held(ring, conn);
+    return 0;
 }
 
 /**
- * @brief Send HTTP response to client
- * @param client_sock Client socket descriptor
- * @param status_code HTTP status code
- * @param status_text HTTP status text
- * @param content_type Response content type
- * @param content Response body content
- * @param content_length Length of response body
+ * @brief Queue responses for buffered requests if the connection is idle
+ * @param ring Ring to queue sends on
+ * @param worker Worker owning the connection
+ * @param conn Client connection
  */
-void send_response(int client_sock, int status_code, const char* status_text,
-                   const char* content_type, const char* content, size_t content_length) {
-    char header[512];
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 %d %s\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: close\r\n"
-             "\r\n",
-             status_code, status_text, content_type, content_length);
-    
-    write(client_sock, header, strlen(header));
-    write(client_sock, content, content_length);
+void uring_advance(Uring* ring, Worker* worker, Connection* conn) {
+    if (conn->state != CONN_READING) return;
+
+    process_pipeline(conn);
+    // Discarding a request body made room for the bytes still held
+    while (conn->state == CONN_READING && conn->held_count > 0 && conn_in_room(conn) > 0) {
+        uring_drain_held(ring, conn);
+        process_pipeline(conn);
+    }
+    if (conn->state == CONN_WRITING) {
+        if (!uring_continue_send(ring, conn)) uring_close_conn(worker, conn);
+    } else if (conn->peer_closed) {
+        uring_close_conn(worker, conn);
+    }
 }
 
 /**
- * @brief Send HTTP error response
- * @param client_sock Client socket descriptor
- * @param status_code HTTP status code
- * @param message Error message
+ * @brief Handle a completed multishot recv
+ * @param ring Ring the completion came from
+ * @param worker Worker owning the connection
+ * @param conn Client connection
+ * @param cqe Completion entry
  */
-void send_error(int client_sock, int status_code, const char* message) {
-    char body[512];
-    snprintf(body, sizeof(body),
-             "<html><body><h1>%d %s</h1><p>%s</p></body></html>",
-             status_code, message, message);
-    
-    send_response(client_sock, status_code, message, "text/html", body, strlen(body));
+void uring_on_recv(Uring* ring, Worker* worker, Connection* conn, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && conn->state != CONN_CLOSING) {
+            if (uring_stash(ring, conn, bid, cqe->res) < 0) {
+                uring_close_conn(worker, conn);
+            }
+        } else {
+            uring_recycle_buf(ring, bid);
+        }
+    }
+
+    if (conn->state == CONN_CLOSING) return;
+
+    if (cqe->res == 0) {
+        conn->peer_closed = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        uring_close_conn(worker, conn);
+        return;
+    }
+
+    uring_advance(ring, worker, conn);
+
+    // Re-arm after the kernel ended the multishot (e.g. buffers ran out)
+    if (!conn->recv_armed && !conn->peer_closed && conn->state != CONN_CLOSING) {
+        uring_arm_recv(ring, conn);
+    }
 }
 
 /**
- * @brief Serve file to client
- * @param client_sock Client socket descriptor
- * @param filepath Path to file to serve
+ * @brief Handle a completed step of a connection's send chain
+ *
+ * Each step only updates the bookkeeping; the next chain is queued once
+ * the last step of the current one has completed, so a step cancelled by
+ * a short predecessor is simply retried.
+ *
+ * @param ring Ring the completion came from
+ * @param worker Worker owning the connection
+ * @param conn Client connection
+ * @param op Completed step
+ * @param res Bytes moved or negative errno
  */
-void serve_file(int client_sock, const char* filepath) {
-    // Security: Prevent directory traversal
-    if (strstr(filepath, "..")) {
-        send_error(client_sock, 403, "Forbidden");
+void uring_on_chain(Uring* ring, Worker* worker, Connection* conn, UringOp op, int res) {
+    conn->chain_pending--;
+    if (conn->state == CONN_CLOSING) return;
+
+    if (res == 0 && (op == UOP_READ || op == UOP_SPLICE_IN)) {
+        res = -EIO; // File shrank under us
+    }
+    if (res < 0) {
+        if (res != -ECANCELED) conn->chain_failed = 1;
+    } else if (op == UOP_SEND) {
+        conn_sent(conn, res);
+    } else if (op == UOP_READ) {
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        // Drop the part of the buffer the short read did not fill
+        conn->out_len -= conn->read_len - res;
+    } else if (op == UOP_SPLICE_IN) {
+        conn->file_offset += res;
+        conn->file_remaining -= res;
+        conn->pipe_len += res;
+    } else if (op == UOP_SPLICE_OUT) {
+        conn->pipe_len -= res;
+        conn_count_sent(conn, res);
+    }
+
+    if (conn->chain_pending > 0) return;
+    if (conn->chain_failed) {
+        uring_close_conn(worker, conn);
         return;
     }
-    
-    // Default to index.html for root
-    if (strcmp(filepath, "/") == 0) {
-        filepath = "/index.html";
+    if (uring_continue_send(ring, conn)) return;
+    if (conn->chain_failed) {
+        uring_close_conn(worker, conn);
+        return;
     }
-    
-    char fullpath[512];
-    snprintf(fullpath, sizeof(fullpath), ".%s", filepath);
-    
-    int fd = open(fullpath, O_RDONLY);
-    if (fd == -1) {
-        send_error(client_sock, 404, "Not Found");
+
+    // Responses complete
+    if (!conn->keep_alive) {
+        uring_close_conn(worker, conn);
         return;
     }
-    
-    // Get file size
-    struct stat st;
-    fstat(fd, &st);
-    off_t file_size = st.st_size;
-    
-    // Send headers
-    const char* mime_type = get_mime_type(fullpath);
-    char header[512];
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %ld\r\n"
-             "Connection: close\r\n"
-             "\r\n",
-             mime_type, file_size);
-    
-    write(client_sock, header, strlen(header));
-    
-    // Send file content efficiently
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-        write(client_sock, buffer, bytes_read);
-    }
-    
-    close(fd);
+    conn->state = CONN_READING;
+    uring_drain_held(ring, conn);
+    uring_advance(ring, worker, conn);
 }
 
 /**
- * @brief Handle individual client connection
- * @param client_sock Client socket descriptor
- * @param client_addr Client address information
+ * @brief Accept a connection reported by the multishot accept
+ * @param ring Ring to queue the first recv on
+ * @param worker Worker owning the listener
+ * @param client_sock Accepted socket
  */
-void handle_client(int client_sock, struct sockaddr_in* client_addr) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = read(client_sock, buffer, sizeof(buffer) - 1);
-    
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-        
-        // Parse HTTP request
-        HTTPRequest req;
-        char* first_line = strtok(buffer, "\r\n");
-        
-        if (first_line && parse_http_request(first_line, &req) == 0) {
-            printf("[%s] %s %s\n", inet_ntoa(client_addr->sin_addr), 
-                   req.method, req.path);
-            
-            if (strcmp(req.method, "GET") == 0) {
-                serve_file(client_sock, req.path);
+void uring_on_accept(Uring* ring, Worker* worker, int client_sock) {
+    set_nodelay(client_sock);
+    Connection* conn = conn_pool_get(&worker->conns);
+    if (!conn) {
+        perror("malloc failed");
+        close(client_sock);
+        return;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
+    getpeername(client_sock, (struct sockaddr*)&client_addr, &client_len);
+    conn_init(conn, worker, client_sock, &client_addr);
+    worker->metrics.accepted++;
+    worker->metrics.active++;
+    uring_arm_recv(ring, conn);
+    conn_update_timer(worker, conn, 0, 0);
+}
+
+/**
+ * @brief Watch the file cache's inotify descriptor for change events
+ * @param ring Ring to queue on
+ * @param inotify_fd Descriptor to poll
+ */
+void uring_arm_notify(Uring* ring, int inotify_fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_NOTIFY, NULL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = inotify_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * @brief Queue the once-a-second tick that drives the timer wheel
+ * @param ring Ring to queue on
+ * @param ts Timeout, must stay valid until the tick completes
+ */
+void uring_arm_tick(Uring* ring, struct __kernel_timespec* ts) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, UOP_TICK, NULL);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+}
+
+/**
+ * @brief Serve clients from an io_uring completion loop
+ *
+ * One io_uring_enter() both submits every request queued while handling
+ * the previous batch of completions and waits for the next batch.
+ *
+ * @param worker Worker whose listener to serve
+ * @return int -1 if io_uring could not be set up, otherwise does not return
+ */
+int run_uring_engine(Worker* worker) {
+    Uring ring;
+    if (uring_init(&ring) < 0) {
+        return -1;
+    }
+
+    struct __kernel_timespec tick = { 1, 0 };
+    worker_update_clock(worker);
+    uring_arm_accept(&ring, worker->listen_sock);
+    uring_arm_tick(&ring, &tick);
+    if (worker->files.inotify_fd >= 0) {
+        uring_arm_notify(&ring, worker->files.inotify_fd);
+    }
+
+    while (1) {
+        if (uring_submit(&ring, 1) < 0) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        worker_update_clock(worker);
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+            UringOp op = cqe->user_data & UOP_MASK;
+            Connection* conn = (Connection*)(unsigned long)(cqe->user_data & ~(unsigned long)UOP_MASK);
+            int final = !(cqe->flags & IORING_CQE_F_MORE);
+
+            if (op == UOP_ACCEPT) {
+                if (cqe->res >= 0) {
+                    uring_on_accept(&ring, worker, cqe->res);
+                } else if (cqe->res != -EINTR && cqe->res != -ECANCELED) {
+                    worker->metrics.accept_errors++;
+                    errno = -cqe->res;
+                    perror("accept failed");
+                }
+                if (final) uring_arm_accept(&ring, worker->listen_sock);
+                continue;
+            }
+
+            if (op == UOP_TICK) {
+                Timer* timer = timer_wheel_advance(&worker->timers, worker->now);
+                while (timer) {
+                    Timer* next = timer->next;
+                    worker->timeouts[timer->kind]++;
+                    uring_close_conn(worker, conn_from_timer(timer));
+                    timer = next;
+                }
+                uring_arm_tick(&ring, &tick);
+                continue;
+            }
+
+            if (op == UOP_NOTIFY) {
+                file_cache_drain(&worker->files);
+                if (final) uring_arm_notify(&ring, worker->files.inotify_fd);
+                continue;
+            }
+
+            if (op == UOP_RECV) {
+                uring_on_recv(&ring, worker, conn, cqe);
             } else {
-                send_error(client_sock, 501, "Not Implemented");
+                uring_on_chain(&ring, worker, conn, op, cqe->res);
+            }
+
+            if (conn->state != CONN_CLOSING) {
+                int sent = (op == UOP_SEND || op == UOP_SPLICE_OUT) && cqe->res > 0;
+                conn_update_timer(worker, conn, op == UOP_RECV && cqe->res > 0, sent);
+                conn_release_buffers(conn, 0);
+            }
+            if (final) {
+                conn->pending_ops--;
+                if (conn->state == CONN_CLOSING) uring_close_conn(worker, conn);
             }
-        } else {
-            send_error(client_sock, 400, "Bad Request");
         }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
     }
-    
-    close(client_sock);
-    exit(0); // Important for forked process
+
+    uring_destroy(&ring);
+    return 0;
 }
 
 /**
- * @brief Signal handler for zombie processes
- * @param sig Signal number
+ * @brief Check whether this kernel supports the io_uring engine
+ * @return int 1 if supported, 0 otherwise
  */
-void zombie_handler(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+int uring_supported(void) {
+    Uring ring;
+    if (uring_init(&ring) < 0) return 0;
+    uring_destroy(&ring);
+    return 1;
+}
+
+#else
+
+int run_uring_engine(Worker* worker) {
+    (void)worker;
+    return -1;
+}
+
+int uring_supported(void) {
+    return 0;
 }
 
+#endif /* HAVE_IO_URING */
+
 /**
- * @brief Main server function
- * @return int Exit status
+ * @brief Worker thread entry point: apply CPU affinity and run the event loop
+ * @param arg Worker to run
+ * @return void* Always NULL
+ */
+void* worker_main(void* arg) {
+    Worker* worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "worker %d: cannot pin to CPU %d: %s\n",
+                    worker->id, worker->cpu, strerror(err));
+        }
+    }
+
+    file_cache_init(&worker->files, config.file_cache_entries);
+
+    if (config.engine == ENGINE_URING && run_uring_engine(worker) < 0) {
+        fprintf(stderr, "worker %d: io_uring setup failed, using epoll\n", worker->id);
+    }
+    run_epoll_engine(worker);
+    return NULL;
+}
+
+/**
+ * @brief Print each worker's file cache, pool and timeout counters
+ *
+ * Counters are written only by their worker and read here without
+ * stopping it, so the figures are a snapshot rather than a consistent cut.
+ *
+ * @param workers Worker array
+ * @param count Number of workers
+ */
+void print_stats(Worker* workers, int count) {
+    for (int i = 0; i < count; i++) {
+        FileCache* cache = &workers[i].files;
+        printf("worker %d: file cache %d entries, %ld bytes in memory, %lu hits, %lu misses\n",
+               workers[i].id, __atomic_load_n(&cache->count, __ATOMIC_RELAXED),
+               __atomic_load_n(&cache->mem_bytes, __ATOMIC_RELAXED),
+               __atomic_load_n(&cache->hits, __ATOMIC_RELAXED),
+               __atomic_load_n(&cache->misses, __ATOMIC_RELAXED));
+        ConnPool* pool = &workers[i].conns;
+        printf("worker %d: connection pool %lu of %lu in use, peak %lu, %lu arena blocks\n",
+               workers[i].id, __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED),
+               __atomic_load_n(&pool->capacity, __ATOMIC_RELAXED),
+               __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED),
+               __atomic_load_n(&pool->block_count, __ATOMIC_RELAXED));
+        BufferPool* buffers = &workers[i].buffers;
+        printf("worker %d: buffers", workers[i].id);
+        for (int class = 0; class < config.buffer_classes; class++) {
+            printf("%s %d bytes %lu of %lu in use, peak %lu", class ? "," : "",
+                   config.buffer_sizes[class],
+                   __atomic_load_n(&buffers->in_use[class], __ATOMIC_RELAXED),
+                   __atomic_load_n(&buffers->capacity[class], __ATOMIC_RELAXED),
+                   __atomic_load_n(&buffers->high_water[class], __ATOMIC_RELAXED));
+        }
+        printf("; %lu chunks, %lu on huge pages\n",
+               __atomic_load_n(&buffers->chunks, __ATOMIC_RELAXED),
+               __atomic_load_n(&buffers->huge_chunks, __ATOMIC_RELAXED));
+        printf("worker %d: %lu access log records dropped\n", workers[i].id,
+               __atomic_load_n(&workers[i].log.dropped, __ATOMIC_RELAXED));
+        printf("worker %d: timeouts", workers[i].id);
+        for (int kind = 0; kind < TIMEOUT_COUNT; kind++) {
+            printf("%s %lu %s", kind ? "," : "",
+                   __atomic_load_n(&workers[i].timeouts[kind], __ATOMIC_RELAXED), timeout_names[kind]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Serve clients by forking one process per connection
+ * @param server_sock Listening socket
  */
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
+void run_fork_engine(int server_sock) {
+    int client_sock;
+    struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
-    
+
     // Setup signal handler for zombie processes
     signal(SIGCHLD, zombie_handler);
-    
+
+    while (1) {
+        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
+        if (client_sock < 0) {
+            perror("accept failed");
+            continue;
+        }
+
+        // Fork to handle client concurrently
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Child process
+            close(server_sock);
+            handle_client(client_sock, &client_addr);
+        } else if (pid > 0) {
+            // Parent process
+            close(client_sock);
+        } else {
+            perror("fork failed");
+            close(client_sock);
+        }
+    }
+}
+
+/**
+ * @brief Print command line usage
+ * @param prog Program name
+ */
+void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --engine=epoll|uring|fork|pool\n"
+            "                        Connection handling engine (default: epoll)\n"
+            "  --pool-threads=N      Threads running blocking work for the pool engine\n"
+            "                        (default: %d)\n"
+            "  --port=N              TCP port to listen on (default: %d)\n"
+            "  --workers=N           Event loop workers (default: one per CPU)\n"
+            "  --cpus=LIST           Pin workers to CPUs, e.g. 0-3,6 (default: no pinning)\n"
+            "  --max-requests=N      Requests per keep-alive connection (default: %d)\n"
+            "  --idle-timeout=SEC    Close keep-alive connections idle this long (default: %d)\n"
+            "  --header-timeout=SEC  Time allowed to send a whole request header (default: %d)\n"
+            "  --body-timeout=SEC    Time allowed between request body reads (default: %d)\n"
+            "  --write-timeout=SEC   Time a response may make no progress (default: %d)\n"
+            "  --zerocopy=sendfile|splice|off\n"
+            "                        File body transmission (default: sendfile)\n"
+            "  --max-header-size=N   Largest request header in bytes, below the largest\n"
+            "                        buffer size (default: %d)\n"
+            "  --buffer-sizes=LIST   Connection buffer size classes, ascending, e.g.\n"
+            "                        1024,4096,16384; receive buffers grow through them\n"
+            "                        and send buffers use the largest (default: 2048,%d)\n"
+            "  --max-headers=N       Most header fields per request (default: %d)\n"
+            "  --max-uri=N           Longest request target (default: %d)\n"
+            "  --simd=auto|avx2|sse4.2|scalar\n"
+            "                        Parser scan kernels (default: auto via CPUID)\n"
+            "  --file-cache=N        Open files cached per worker, 0 to disable (default: %d)\n"
+            "  --file-cache-revalidate=SEC\n"
+            "                        Re-stat cached files this often instead of using\n"
+            "                        inotify (default: 0 = inotify)\n"
+            "  --mem-cache-size=N    File bytes kept in memory per worker, 0 to disable\n"
+            "                        (default: %d)\n"
+            "  --mem-cache-max-file=N\n"
+            "                        Largest file kept in memory (default: %d)\n"
+            "  --compress=gzip,zstd|off\n"
+            "                        Compress text files on the fly when no sibling\n"
+            "                        exists (default: off)\n"
+            "  --compress-min-size=N Smallest file to compress (default: %d)\n"
+            "  --compress-threads=N  Background compression threads (default: 1)\n"
+            "  --mime-types=FILE     Extra extension to type mappings in mime.types\n"
+            "                        format, e.g. /etc/mime.types\n"
+            "  --access-log=FILE|-|off\n"
+            "                        Access log destination (default: - for stdout)\n"
+            "  --log-format=common|combined|json\n"
+            "                        Access log line layout (default: common)\n"
+            "  --metrics=PATH|off    Prometheus metrics endpoint, event loop engines only\n"
+            "                        (default: /metrics)\n"
+            "  --http2=on|off        Cleartext HTTP/2 for clients that open with its\n"
+            "                        preface (default: on)\n",
+            prog, DEFAULT_POOL_THREADS, PORT, DEFAULT_MAX_REQUESTS, DEFAULT_IDLE_TIMEOUT,
+            DEFAULT_HEADER_TIMEOUT, DEFAULT_BODY_TIMEOUT, DEFAULT_WRITE_TIMEOUT, BUFFER_SIZE - 1, BUFFER_SIZE, MAX_HEADERS, DEFAULT_MAX_URI, DEFAULT_FILE_CACHE,
+            DEFAULT_MEM_CACHE, DEFAULT_MEM_CACHE_MAX_FILE, DEFAULT_COMPRESS_MIN_SIZE);
+}
+
+/**
+ * @brief Parse a CPU list such as "0-3,6" into the config affinity list
+ * @param list Comma-separated CPUs and inclusive ranges
+ * @return int 0 on success, -1 on invalid list
+ */
+int parse_cpu_list(const char* list) {
+    config.cpu_count = 0;
+    while (*list) {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (config.cpu_count >= MAX_WORKERS || cpu >= CPU_SETSIZE) return -1;
+            config.cpus[config.cpu_count++] = (int)cpu;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        list = end;
+    }
+    return config.cpu_count > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Parse a list of buffer sizes such as "1024,4096,16384" into the config
+ * @param list Comma-separated sizes in bytes, strictly ascending
+ * @return int 0 on success, -1 on invalid list
+ */
+int parse_buffer_sizes(const char* list) {
+    config.buffer_classes = 0;
+    while (*list) {
+        char* end;
+        long size = strtol(list, &end, 10);
+        if (end == list || size < 1024 || size > BUFFER_CHUNK_SIZE / 2) return -1;
+        if (config.buffer_classes == BUFFER_CLASSES_MAX) return -1;
+        if (config.buffer_classes > 0 && size <= config.buffer_sizes[config.buffer_classes - 1]) {
+            return -1;
+        }
+        config.buffer_sizes[config.buffer_classes++] = (int)size;
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        list = end;
+    }
+    // Send buffers use the largest class and must fit a pipelined response
+    if (config.buffer_classes == 0) return -1;
+    return config.buffer_sizes[config.buffer_classes - 1] >= PIPELINE_RESERVE ? 0 : -1;
+}
+
+/**
+ * @brief Parse a list of encodings such as "gzip,zstd" into the config
+ * @param list Comma-separated encoding tokens, or "off"
+ * @return int 0 on success, -1 on an unknown or unsupported encoding
+ */
+int parse_compress_list(const char* list) {
+    config.compress = 0;
+    if (strcmp(list, "off") == 0) return 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int found = -1;
+        for (int enc = ENC_IDENTITY + 1; enc < ENC_COUNT; enc++) {
+            if (strlen(encodings[enc].token) == len &&
+                strncmp(list, encodings[enc].token, len) == 0) {
+                found = enc;
+            }
+        }
+        if (found < 0) return -1;
+        if (!(compress_supported & (1u << found))) {
+            fprintf(stderr, "%s compression is not built in (see -DHAVE_ZLIB, -DHAVE_ZSTD)\n",
+                    encodings[found].token);
+            return -1;
+        }
+        config.compress |= 1u << found;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return config.compress ? 0 : -1;
+}
+
+/**
+ * @brief Parse command line options into the global config
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return int 0 on success, -1 on invalid arguments
+ */
+int parse_args(int argc, char* argv[]) {
+    int header_size_set = 0;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--engine=epoll") == 0) {
+            config.engine = ENGINE_EPOLL;
+        } else if (strcmp(arg, "--engine=uring") == 0) {
+            config.engine = ENGINE_URING;
+        } else if (strcmp(arg, "--engine=fork") == 0) {
+            config.engine = ENGINE_FORK;
+        } else if (strcmp(arg, "--engine=pool") == 0) {
+            config.engine = ENGINE_POOL;
+        } else if (strncmp(arg, "--pool-threads=", 15) == 0) {
+            config.pool_threads = atoi(arg + 15);
+            if (config.pool_threads <= 0) return -1;
+        } else if (strncmp(arg, "--port=", 7) == 0) {
+            config.port = atoi(arg + 7);
+            if (config.port <= 0 || config.port > 65535) return -1;
+        } else if (strncmp(arg, "--workers=", 10) == 0) {
+            config.workers = atoi(arg + 10);
+            if (config.workers <= 0 || config.workers > MAX_WORKERS) return -1;
+        } else if (strncmp(arg, "--cpus=", 7) == 0) {
+            if (parse_cpu_list(arg + 7) < 0) return -1;
+        } else if (strncmp(arg, "--max-requests=", 15) == 0) {
+            config.max_requests = atoi(arg + 15);
+            if (config.max_requests <= 0) return -1;
+        } else if (strcmp(arg, "--zerocopy=sendfile") == 0) {
+            config.zerocopy = ZC_SENDFILE;
+        } else if (strcmp(arg, "--zerocopy=splice") == 0) {
+            config.zerocopy = ZC_SPLICE;
+        } else if (strcmp(arg, "--zerocopy=off") == 0) {
+            config.zerocopy = ZC_COPY;
+        } else if (strncmp(arg, "--max-header-size=", 18) == 0) {
+            config.max_header_size = atoi(arg + 18);
+            if (config.max_header_size <= 0) return -1;
+            header_size_set = 1;
+        } else if (strncmp(arg, "--buffer-sizes=", 15) == 0) {
+            if (parse_buffer_sizes(arg + 15) < 0) return -1;
+        } else if (strncmp(arg, "--max-headers=", 14) == 0) {
+            config.max_headers = atoi(arg + 14);
+            if (config.max_headers < 0 || config.max_headers > MAX_HEADERS) return -1;
+        } else if (strncmp(arg, "--max-uri=", 10) == 0) {
+            config.max_uri = atoi(arg + 10);
+            if (config.max_uri <= 0 || config.max_uri > PATH_MAX - 2) return -1;
+        } else if (strncmp(arg, "--simd=", 7) == 0) {
+            if (scan_select(arg + 7) < 0) {
+                fprintf(stderr, "SIMD kernels '%s' are not available on this CPU\n", arg + 7);
+                return -1;
+            }
+        } else if (strncmp(arg, "--file-cache=", 13) == 0) {
+            config.file_cache_entries = atoi(arg + 13);
+            if (config.file_cache_entries < 0) return -1;
+        } else if (strncmp(arg, "--file-cache-revalidate=", 24) == 0) {
+            config.file_cache_revalidate = atoi(arg + 24);
+            if (config.file_cache_revalidate < 0) return -1;
+        } else if (strncmp(arg, "--mem-cache-size=", 17) == 0) {
+            config.mem_cache_size = atol(arg + 17);
+            if (config.mem_cache_size < 0) return -1;
+        } else if (strncmp(arg, "--mem-cache-max-file=", 21) == 0) {
+            config.mem_cache_max_file = atol(arg + 21);
+            if (config.mem_cache_max_file < 0) return -1;
+        } else if (strncmp(arg, "--mime-types=", 13) == 0) {
+            config.mime_types = arg + 13;
+        } else if (strcmp(arg, "--http2=on") == 0) {
+            config.http2 = 1;
+        } else if (strcmp(arg, "--http2=off") == 0) {
+            config.http2 = 0;
+        } else if (strcmp(arg, "--metrics=off") == 0) {
+            config.metrics_path = NULL;
+        } else if (strncmp(arg, "--metrics=", 10) == 0 && arg[10] == '/') {
+            config.metrics_path = arg + 10;
+        } else if (strcmp(arg, "--access-log=off") == 0) {
+            config.access_log = NULL;
+        } else if (strncmp(arg, "--access-log=", 13) == 0 && arg[13]) {
+            config.access_log = arg + 13;
+        } else if (strcmp(arg, "--log-format=common") == 0) {
+            config.log_format = LOG_COMMON;
+        } else if (strcmp(arg, "--log-format=combined") == 0) {
+            config.log_format = LOG_COMBINED;
+        } else if (strcmp(arg, "--log-format=json") == 0) {
+            config.log_format = LOG_JSON;
+        } else if (strncmp(arg, "--compress=", 11) == 0) {
+            if (parse_compress_list(arg + 11) < 0) return -1;
+        } else if (strncmp(arg, "--compress-min-size=", 20) == 0) {
+            config.compress_min_size = atol(arg + 20);
+            if (config.compress_min_size < 0) return -1;
+        } else if (strncmp(arg, "--compress-threads=", 19) == 0) {
+            config.compress_threads = atoi(arg + 19);
+            if (config.compress_threads <= 0) return -1;
+        } else if (strncmp(arg, "--idle-timeout=", 15) == 0) {
+            config.idle_timeout = atoi(arg + 15);
+            if (config.idle_timeout <= 0) return -1;
+        } else if (strncmp(arg, "--header-timeout=", 17) == 0) {
+            config.header_timeout = atoi(arg + 17);
+            if (config.header_timeout <= 0) return -1;
+        } else if (strncmp(arg, "--body-timeout=", 15) == 0) {
+            config.body_timeout = atoi(arg + 15);
+            if (config.body_timeout <= 0) return -1;
+        } else if (strncmp(arg, "--write-timeout=", 16) == 0) {
+            config.write_timeout = atoi(arg + 16);
+            if (config.write_timeout <= 0) return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    // A request header has to fit in the largest receive buffer
+    int largest = config.buffer_sizes[config.buffer_classes - 1];
+    if (!header_size_set && config.max_header_size > largest - 1) {
+        config.max_header_size = largest - 1;
+    }
+    return config.max_header_size <= largest - 1 ? 0 : -1;
+}
+
+/**
+ * @brief Create a bound, listening TCP socket on the configured port
+ * @param reuseport Set SO_REUSEPORT so several workers can bind the same port
+ * @param backlog Listen queue length
+ * @return int Listening socket
+ */
+int create_listener(int reuseport, int backlog) {
+    int server_sock;
+    struct sockaddr_in server_addr;
+
     // Create socket
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
-    
+
     // Set socket options
     int opt = 1;
     setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
+    if (reuseport && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(server_sock);
+        exit(EXIT_FAILURE);
+    }
+
     // Bind socket
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-    
+    server_addr.sin_port = htons(config.port);
+
     if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
-    
+
     // Listen for connections
-    if (listen(server_sock, BACKLOG) < 0) {
+    if (listen(server_sock, backlog) < 0) {
         perror("listen failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
-    
-    printf("Mini HTTP Server running on http://localhost:%d\n", PORT);
+
+    return server_sock;
+}
+
+#ifndef SERVER_NO_MAIN
+/**
+ * @brief Main server function
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return int Exit status
+ */
+int main(int argc, char* argv[]) {
+    scan_select("auto");
+    hpack_init();
+    snprintf(range_boundary, sizeof(range_boundary), "%08x%08x",
+             (unsigned)time(NULL), (unsigned)getpid());
+    if (parse_args(argc, argv) < 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (mime_init(config.mime_types) < 0) {
+        perror(config.mime_types ? config.mime_types : "mime_init failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Writes to closed sockets must fail with EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.engine == ENGINE_FORK) {
+        int server_sock = create_listener(0, BACKLOG);
+        printf("Mini HTTP Server running on http://localhost:%d (fork engine)\n", config.port);
+        printf("Serving files from: %s\n", getcwd(NULL, 0));
+        printf("Press Ctrl+C to stop\n\n");
+        fflush(stdout);
+
+        access_log_start(NULL, 0);
+        run_fork_engine(server_sock);
+        close(server_sock);
+        return 0;
+    }
+
+    if (config.engine == ENGINE_URING && !uring_supported()) {
+        fprintf(stderr, "io_uring is not supported by this kernel, falling back to epoll\n");
+        config.engine = ENGINE_EPOLL;
+    }
+
+    if (config.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = cpus > 0 ? (cpus < MAX_WORKERS ? (int)cpus : MAX_WORKERS) : 1;
+    }
+
+    // Bind every listener up front so a busy port fails before any thread starts
+    static Worker workers[MAX_WORKERS];
+    for (int i = 0; i < config.workers; i++) {
+        workers[i].id = i;
+        workers[i].cpu = config.cpu_count > 0 ? config.cpus[i % config.cpu_count] : -1;
+        workers[i].listen_sock = create_listener(1, SOMAXCONN);
+        workers[i].epfd = -1;
+        timer_wheel_init(&workers[i].timers, monotonic_seconds());
+        memset(workers[i].timeouts, 0, sizeof(workers[i].timeouts));
+        memset(&workers[i].metrics, 0, sizeof(workers[i].metrics));
+        workers[i].compressed = NULL;
+        workers[i].tasks.top = 0;
+        workers[i].tasks.bottom = 0;
+        workers[i].tasks_done = NULL;
+        workers[i].task_fd = -1;
+        workers[i].resume_head = NULL;
+    }
+
+    printf("Mini HTTP Server running on http://localhost:%d (%s engine, %d worker%s)\n",
+           config.port, config.engine == ENGINE_URING ? "io_uring" :
+                        config.engine == ENGINE_POOL ? "thread pool" : "epoll",
+           config.workers, config.workers == 1 ? "" : "s");
     printf("Serving files from: %s\n", getcwd(NULL, 0));
-    printf("Press Ctrl+C to stop\n\n");
-    
-    // Main server loop
-    while (1) {
-        client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_len);
-        if (client_sock < 0) {
-            perror("accept failed");
-            continue;
+    printf("Press Ctrl+C to stop, send SIGUSR1 for cache and timeout statistics\n\n");
+    fflush(stdout);
+
+    // Workers inherit the blocked mask, so SIGUSR1 is only taken by sigwait()
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+    metrics_registry.workers = workers;
+    metrics_registry.worker_count = config.workers;
+    access_log_start(workers, config.workers);
+    if (config.engine == ENGINE_POOL) {
+        pool_start(workers, config.workers, config.pool_threads);
+    } else if (config.compress) {
+        compress_start(config.compress_threads);
+    }
+
+    for (int i = 0; i < config.workers; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
         }
-        
-        // Fork to handle client concurrently
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
-            close(server_sock);
-            handle_client(client_sock, &client_addr);
-        } else if (pid > 0) {
-            // Parent process
-            close(client_sock);
-        } else {
-            perror("fork failed");
-            close(client_sock);
+    }
+
+    while (1) {
+        int sig;
+        if (sigwait(&usr1, &sig) == 0) {
+            print_stats(workers, config.workers);
         }
     }
-    
-    close(server_sock);
-    return 0;
-}
\ No newline at end of file
+}
+#endif /* SERVER_NO_MAIN */